@@ -0,0 +1,558 @@
+/*
+ * bench.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+// Throughput of every stage and of the whole pipeline on synthetic inputs
+// drawn from a fixed seed. The results are written as JSON, to the file
+// given as the first argument or to stdout, the progress goes to stderr.
+//
+//   EYE_bench.bin [result.json] [--quick]
+
+#include "EYE.hpp"
+#include "EYE/eye_thread.hpp"
+
+#include <sys/time.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ostringstream;
+using std::string;
+using std::vector;
+using namespace EYE;
+
+namespace
+{
+  const int BENCH_SEED = 1000;
+
+  struct Config
+  {
+      bool quick;
+      // every measure repeats its run for at least this long
+      double min_time;
+      uint32_t width;
+      uint32_t height;
+      uint32_t num_frame;
+      uint32_t dim;
+  };
+
+  double now()
+  {
+    timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+  }
+
+  // one JSON object per measure, a measure whose stage fails records the
+  // status as its error instead of the throughput
+  class Record
+  {
+     public:
+      explicit Record(const char* stage)
+      {
+        out_ << "{\"stage\": \"" << stage << "\"";
+      }
+
+      Record& add(const char* key, const double value)
+      {
+        out_ << ", \"" << key << "\": " << value;
+        return *this;
+      }
+      Record& add(const char* key, const char* value)
+      {
+        out_ << ", \"" << key << "\": \"" << value << "\"";
+        return *this;
+      }
+
+      string str() const
+      {
+        return out_.str() + "}";
+      }
+
+     private:
+      ostringstream out_;
+  };
+
+  // a smooth random texture in [0, 255], so that the gradients look like
+  // the ones of a photograph rather than of white noise
+  void make_image(VlRand* rand, const uint32_t width, const uint32_t height,
+                  float* const img)
+  {
+    vector<float> noise(width * height);
+    for (uint32_t i = 0; i < width * height; ++i)
+      noise[i] = (float) vl_rand_real3(rand);
+
+    const int r = 2;
+    for (uint32_t y = 0; y < height; ++y)
+      for (uint32_t x = 0; x < width; ++x)
+      {
+        float sum(0);
+        int num(0);
+        for (int dy = -r; dy <= r; ++dy)
+          for (int dx = -r; dx <= r; ++dx)
+          {
+            const int xx = (int) x + dx;
+            const int yy = (int) y + dy;
+            if (xx < 0 || yy < 0 || xx >= (int) width || yy >= (int) height)
+              continue;
+            sum += noise[yy * width + xx];
+            ++num;
+          }
+        img[y * width + x] = 255.0f * sum / num;
+      }
+  }
+
+  const char* smooth_name(const DSift::SmoothMethod method)
+  {
+    switch (method)
+    {
+      case DSift::SMOOTH_EXACT:
+        return "exact";
+      case DSift::SMOOTH_CASCADE:
+        return "cascade";
+      case DSift::SMOOTH_RECURSIVE:
+        return "recursive";
+      default:
+        return "unknown";
+    }
+  }
+
+  void bench_dsift(const Config& cfg, VlRand* rand, vector<string>* results)
+  {
+    const uint32_t num_img = 8;
+    vector<float> imgs(num_img * cfg.width * cfg.height);
+    for (uint32_t n = 0; n < num_img; ++n)
+      make_image(rand, cfg.width, cfg.height,
+                 &imgs[n * cfg.width * cfg.height]);
+
+    DSift dsift;
+    const vector<uint32_t> all_sizes = dsift.get_sizes();
+
+    const DSift::SmoothMethod methods[] = { DSift::SMOOTH_EXACT,
+        DSift::SMOOTH_CASCADE, DSift::SMOOTH_RECURSIVE };
+    const size_t num_methods = sizeof(methods) / sizeof(methods[0]);
+
+    // every scale alone, then all of them together with every smoothing,
+    // which only differ when the sizes share the work
+    for (size_t s = 0; s < all_sizes.size() + num_methods; ++s)
+    {
+      vector<uint32_t> sizes(all_sizes);
+      if (s < all_sizes.size())
+        sizes.assign(1, all_sizes[s]);
+      const DSift::SmoothMethod method = (
+          s < all_sizes.size() ? DSift::SMOOTH_EXACT :
+              methods[s - all_sizes.size()]);
+
+      dsift.set_sizes(sizes);
+      dsift.set_smooth_method(method);
+      Status status = dsift.SetUp(cfg.width, cfg.height);
+
+      vector<VlDsiftKeypoint> frames;
+      vector<float> descrs;
+      uint32_t dim(0);
+
+      int runs(0);
+      const double start = now();
+      while (status == STATUS_OK)
+      {
+        status = dsift.Extract(&imgs[(runs % num_img) * cfg.width
+                                   * cfg.height],
+                               cfg.width, cfg.height, &frames, &descrs, &dim);
+        ++runs;
+        if (now() - start >= cfg.min_time)
+          break;
+      }
+      const double sec = (now() - start) / std::max(runs, 1);
+
+      Record rec("dsift");
+      if (s < all_sizes.size())
+        rec.add("scale", all_sizes[s]);
+      else
+        rec.add("scale", "all");
+      rec.add("smooth", smooth_name(method));
+      rec.add("width", cfg.width).add("height", cfg.height);
+      if (status != STATUS_OK)
+        rec.add("error", get_status_string(status));
+      else
+      {
+        rec.add("images_per_s", 1.0 / sec);
+        rec.add("descriptors_per_s", frames.size() / sec);
+      }
+      results->push_back(rec.str());
+      cerr << "dsift " << rec.str() << endl;
+    }
+  }
+
+  const char* search_name(const LLC::SearchMethod method)
+  {
+    switch (method)
+    {
+      case LLC::SEARCH_KDFOREST:
+        return "kdforest";
+      case LLC::SEARCH_EXACT:
+        return "exact";
+      case LLC::SEARCH_EXACT_BLOCKED:
+        return "exact_blocked";
+      case LLC::SEARCH_TREE:
+        return "tree";
+      case LLC::SEARCH_PQ:
+        return "pq";
+      default:
+        return "unknown";
+    }
+  }
+
+  void bench_llc(const Config& cfg, VlRand* rand, vector<string>* results)
+  {
+    const uint32_t dim = cfg.dim;
+    vector<float> frames(cfg.num_frame * dim);
+    for (uint32_t i = 0; i < frames.size(); ++i)
+      frames[i] = (float) (int) (vl_rand_real3(rand) * 256);
+
+    const uint32_t base_sizes[] = { 256, 1024, 4096 };
+    const uint32_t num_sizes = (cfg.quick ? 2 : 3);
+    const uint32_t knns[] = { 2, 5, 10 };
+    const LLC::SearchMethod methods[] = { LLC::SEARCH_KDFOREST,
+        LLC::SEARCH_EXACT, LLC::SEARCH_EXACT_BLOCKED, LLC::SEARCH_TREE,
+        LLC::SEARCH_PQ };
+
+    SparseCode codes;
+    for (uint32_t b = 0; b < num_sizes; ++b)
+    {
+      const uint32_t num_base = base_sizes[b];
+
+      // the bases are frames, there is no need to train them here
+      float* base_data = new float[num_base * dim];
+      for (uint32_t i = 0; i < num_base; ++i)
+        memcpy(base_data + i * dim,
+               &frames[vl_rand_uindex(rand, cfg.num_frame) * dim],
+               sizeof(float) * dim);
+      shared_ptr<float> base(base_data);
+
+      // about num_base words in two levels
+      const uint32_t branch = (uint32_t) (std::sqrt((double) num_base) + 0.5);
+      shared_ptr<VocabTree> tree(new VocabTree);
+      CodeBook tree_trainer;
+      tree_trainer.set_algorithm(CodeBook::KMEANS_LLOYD);
+      tree_trainer.set_seeding(CodeBook::SEED_KMEANSPP);
+      tree_trainer.set_max_iter(10);
+      const Status tree_status = tree_trainer.GenVocabTree(&frames[0],
+                                                           cfg.num_frame, dim,
+                                                           branch, 2,
+                                                           tree.get());
+
+      for (uint32_t m = 0; m < sizeof(methods) / sizeof(methods[0]); ++m)
+        for (uint32_t k = 0; k < sizeof(knns) / sizeof(knns[0]); ++k)
+        {
+          LLC llc;
+          if (methods[m] == LLC::SEARCH_TREE)
+            llc.set_vocab_tree(tree);
+          else
+            llc.set_base(base, dim, num_base);
+          llc.set_search_method(methods[m]);
+          llc.set_num_knn(knns[k]);
+
+          Status status(STATUS_OK);
+          if (methods[m] == LLC::SEARCH_TREE)
+            status = tree_status;
+
+          const double setup_start = now();
+          if (status == STATUS_OK)
+            status = llc.SetUp();
+          const double setup_sec = now() - setup_start;
+
+          int runs(0);
+          const double start = now();
+          while (status == STATUS_OK)
+          {
+            status = llc.Encode_sparse(&frames[0], dim, cfg.num_frame,
+                                       &codes);
+            ++runs;
+            if (now() - start >= cfg.min_time)
+              break;
+          }
+          const double sec = (now() - start) / std::max(runs, 1);
+
+          Record rec("llc");
+          rec.add("search", search_name(methods[m]));
+          rec.add("num_base", num_base).add("num_knn", knns[k]);
+          rec.add("dim", dim);
+          if (status != STATUS_OK)
+            rec.add("error", get_status_string(status));
+          else
+          {
+            rec.add("setup_s", setup_sec);
+            rec.add("frames_per_s", cfg.num_frame / sec);
+          }
+          results->push_back(rec.str());
+          cerr << "llc " << rec.str() << endl;
+        }
+    }
+  }
+
+  void bench_spm(const Config& cfg, VlRand* rand, vector<string>* results)
+  {
+    const uint32_t feat_dims[] = { 256, 1024 };
+    const uint32_t num_data = cfg.num_frame;
+
+    vector<float> pos(2 * num_data);
+    for (uint32_t i = 0; i < num_data; ++i)
+    {
+      pos[2 * i] = (float) vl_rand_real3(rand) * (cfg.width - 1);
+      pos[2 * i + 1] = (float) vl_rand_real3(rand) * (cfg.height - 1);
+    }
+
+    for (uint32_t f = 0; f < sizeof(feat_dims) / sizeof(feat_dims[0]); ++f)
+    {
+      const uint32_t feat_dim = feat_dims[f];
+      vector<float> data((size_t) num_data * feat_dim);
+      for (size_t i = 0; i < data.size(); ++i)
+        data[i] = (float) vl_rand_real3(rand);
+
+      SPM spm;
+      Status status = spm.SetUp(cfg.width, cfg.height);
+      vector<float> code(spm.get_total_num_blk() * feat_dim);
+
+      int runs(0);
+      const double start = now();
+      while (status == STATUS_OK)
+      {
+        status = spm.MaxPooling(&data[0], feat_dim, num_data, &pos[0],
+                                &code[0]);
+        ++runs;
+        if (now() - start >= cfg.min_time)
+          break;
+      }
+      const double sec = (now() - start) / std::max(runs, 1);
+
+      Record rec("spm");
+      rec.add("pool", "max").add("feat_dim", feat_dim);
+      rec.add("num_data", num_data);
+      rec.add("levels", spm.get_num_spm_level());
+      if (status != STATUS_OK)
+        rec.add("error", get_status_string(status));
+      else
+        rec.add("gb_per_s", sizeof(float) * data.size() / sec / 1e9);
+      results->push_back(rec.str());
+      cerr << "spm " << rec.str() << endl;
+    }
+  }
+
+  const char* algorithm_name(const CodeBook::Algorithm algorithm)
+  {
+    switch (algorithm)
+    {
+      case CodeBook::KMEANS_ANN:
+        return "ann";
+      case CodeBook::KMEANS_ELKAN:
+        return "elkan";
+      case CodeBook::KMEANS_LLOYD:
+        return "lloyd";
+      case CodeBook::KMEANS_MINIBATCH:
+        return "minibatch";
+      default:
+        return "unknown";
+    }
+  }
+
+  void bench_kmeans(const Config& cfg, VlRand* rand, vector<string>* results)
+  {
+    const uint32_t dim = cfg.dim;
+    const uint32_t num_data = (cfg.quick ? 5000 : 20000);
+    const uint32_t num_center = (cfg.quick ? 256 : 1024);
+    const uint32_t num_iter = 4;
+
+    vector<float> data(num_data * dim);
+    for (uint32_t i = 0; i < data.size(); ++i)
+      data[i] = (float) vl_rand_real3(rand) * 255;
+
+    const CodeBook::Algorithm algorithms[] = { CodeBook::KMEANS_LLOYD,
+        CodeBook::KMEANS_ELKAN, CodeBook::KMEANS_ANN };
+
+    for (uint32_t a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); ++a)
+    {
+      // the seeding is taken out by the difference of two runs
+      double sec[2] = { 0, 0 };
+      Status status(STATUS_OK);
+      for (int r = 0; r < 2 && status == STATUS_OK; ++r)
+      {
+        CodeBook codebook;
+        codebook.set_algorithm(algorithms[a]);
+        codebook.set_max_iter(r == 0 ? 1 : 1 + num_iter);
+
+        const double start = now();
+        status = codebook.GenKMeans(&data[0], num_data, dim, num_center);
+        sec[r] = now() - start;
+      }
+
+      Record rec("kmeans");
+      rec.add("algorithm", algorithm_name(algorithms[a]));
+      rec.add("num_data", num_data).add("num_center", num_center);
+      rec.add("dim", dim);
+      if (status != STATUS_OK)
+        rec.add("error", get_status_string(status));
+      else
+        rec.add("iter_s", std::max(0.0, sec[1] - sec[0]) / num_iter);
+      results->push_back(rec.str());
+      cerr << "kmeans " << rec.str() << endl;
+    }
+  }
+
+  void bench_pipeline(const Config& cfg, VlRand* rand,
+                      vector<string>* results)
+  {
+    const uint32_t num_img = 8;
+    const uint32_t num_base = 1024;
+    vector<float> imgs(num_img * cfg.width * cfg.height);
+    for (uint32_t n = 0; n < num_img; ++n)
+      make_image(rand, cfg.width, cfg.height,
+                 &imgs[n * cfg.width * cfg.height]);
+
+    // the base is drawn from the descriptors of the images
+    vector<VlDsiftKeypoint> frames;
+    vector<float> descrs;
+    uint32_t dim(0);
+    {
+      DSift dsift;
+      const Status status = dsift.Extract(&imgs[0], cfg.width, cfg.height,
+                                          &frames, &descrs, &dim);
+      if (status != STATUS_OK || frames.empty())
+      {
+        Record rec("pipeline");
+        rec.add("num_base", num_base);
+        rec.add("width", cfg.width).add("height", cfg.height);
+        rec.add("error", get_status_string(status));
+        results->push_back(rec.str());
+        cerr << "pipeline " << rec.str() << endl;
+        return;
+      }
+    }
+    float* base_data = new float[num_base * dim];
+    for (uint32_t i = 0; i < num_base; ++i)
+      memcpy(base_data + i * dim,
+             &descrs[vl_rand_uindex(rand, frames.size()) * dim],
+             sizeof(float) * dim);
+    shared_ptr<float> base(base_data);
+
+    const int max_threads = get_real_num_threads(0);
+    for (int num_threads = 1;; num_threads *= 2)
+    {
+      if (num_threads > max_threads)
+        num_threads = max_threads;
+
+      Pipeline pipeline;
+      pipeline.get_llc().set_base(base, dim, num_base);
+      pipeline.get_llc().set_num_threads(num_threads);
+      pipeline.get_dsift().set_num_threads(num_threads);
+      Status status = pipeline.SetUp(cfg.width, cfg.height);
+      vector<float> code(pipeline.get_code_len());
+
+      int runs(0);
+      const double start = now();
+      while (status == STATUS_OK)
+      {
+        status = pipeline.Process(&imgs[(runs % num_img) * cfg.width
+                                      * cfg.height],
+                                  cfg.width, cfg.height, &code[0]);
+        ++runs;
+        if (now() - start >= cfg.min_time)
+          break;
+      }
+      const double sec = (now() - start) / std::max(runs, 1);
+
+      Record rec("pipeline");
+      rec.add("num_threads", num_threads).add("num_base", num_base);
+      rec.add("width", cfg.width).add("height", cfg.height);
+      if (status != STATUS_OK)
+        rec.add("error", get_status_string(status));
+      else
+        rec.add("images_per_s", 1.0 / sec);
+      results->push_back(rec.str());
+      cerr << "pipeline " << rec.str() << endl;
+
+      if (num_threads == max_threads)
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  const char* filename(NULL);
+  Config cfg;
+  cfg.quick = false;
+  for (int i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--quick") == 0)
+      cfg.quick = true;
+    else
+      filename = argv[i];
+  }
+  cfg.min_time = (cfg.quick ? 0.2 : 1.0);
+  cfg.width = 256;
+  cfg.height = 256;
+  cfg.num_frame = (cfg.quick ? 5000 : 20000);
+  cfg.dim = 128;
+
+  // every stage draws from its own stream, so that one of them can change
+  // without moving the inputs of the others
+  vector<string> results;
+  VlRand rand;
+  vl_rand_init(&rand);
+
+  vl_rand_seed(&rand, BENCH_SEED);
+  bench_dsift(cfg, &rand, &results);
+  vl_rand_seed(&rand, BENCH_SEED + 1);
+  bench_llc(cfg, &rand, &results);
+  vl_rand_seed(&rand, BENCH_SEED + 2);
+  bench_spm(cfg, &rand, &results);
+  vl_rand_seed(&rand, BENCH_SEED + 3);
+  bench_kmeans(cfg, &rand, &results);
+  vl_rand_seed(&rand, BENCH_SEED + 4);
+  bench_pipeline(cfg, &rand, &results);
+
+  ostringstream json;
+  json << "{" << endl;
+  json << "  \"benchmark\": \"EYE\"," << endl;
+  json << "  \"seed\": " << BENCH_SEED << "," << endl;
+  json << "  \"quick\": " << (cfg.quick ? "true" : "false") << "," << endl;
+  json << "  \"simd\": \"" << get_simd_name(get_simd_level()) << "\","
+       << endl;
+  json << "  \"max_threads\": " << get_real_num_threads(0) << "," << endl;
+  json << "  \"time\": " << (long) now() << "," << endl;
+  json << "  \"results\": [" << endl;
+  for (size_t i = 0; i < results.size(); ++i)
+    json << "    " << results[i] << (i + 1 < results.size() ? "," : "")
+         << endl;
+  json << "  ]" << endl;
+  json << "}" << endl;
+
+  if (filename == NULL)
+  {
+    cout << json.str();
+    return 0;
+  }
+
+  FILE* output = fopen(filename, "w");
+  if (output == NULL)
+  {
+    cerr << "ERROR: can not write " << filename << endl;
+    return -1;
+  }
+  fputs(json.str().c_str(), output);
+  fclose(output);
+
+  return 0;
+}
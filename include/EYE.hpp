@@ -10,7 +10,16 @@
 
 #include "EYE/eye_codebook.hpp"
 #include "EYE/eye_dsift.hpp"
+#include "EYE/eye_knn.hpp"
 #include "EYE/eye_llc.hpp"
+#include "EYE/eye_mmap.hpp"
+#include "EYE/eye_pipeline.hpp"
+#include "EYE/eye_pq.hpp"
+#include "EYE/eye_simd.hpp"
+#include "EYE/eye_smooth.hpp"
 #include "EYE/eye_spm.hpp"
+#include "EYE/eye_status.hpp"
+#include "EYE/eye_vocab_tree.hpp"
+#include "EYE/eye_workspace.hpp"
 
 #endif /* __EYE_EYE_HPP__ */
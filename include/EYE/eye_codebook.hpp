@@ -8,27 +8,59 @@
 #ifndef __EYE_EYE_CODEBOOK_HPP__
 #define __EYE_EYE_CODEBOOK_HPP__
 
+#include "EYE/eye_status.hpp"
+#include "EYE/eye_vocab_tree.hpp"
+
 #include <vl/kmeans.h>
 
 #include <stdint.h>
 #include <cstddef>
 #include <cstdio>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 
 namespace EYE
 {
   using boost::shared_ptr;
+  using std::vector;
 
   class CodeBook
   {
   public:
+    enum Algorithm
+    {
+      KMEANS_ANN = 0,  // vlfeat, kd-forest assignment
+      KMEANS_ELKAN,  // vlfeat, exact with the triangle inequality
+      KMEANS_LLOYD,  // native, GEMM assignment on all the threads
+      KMEANS_MINIBATCH,  // native, one random mini-batch per iteration
+    };
+
+    enum Seeding
+    {
+      SEED_RANDOM = 0,  // K random data
+      SEED_KMEANSPP,  // k-means++, D^2 sampling
+      SEED_KMEANS_PARALLEL,  // k-means||, oversampled D^2 rounds
+    };
+
+    // reads at most max_num descriptors into buf and returns the number
+    // read. It returns 0 at the end of the stream and then starts over.
+    typedef uint32_t (*ChunkReader)(float* buf, const uint32_t max_num,
+                                    void* user);
+
     enum
     {
       DEFAULT_MAX_KMEANS_ITER = 100,
       DEFAULT_NUM_KDTREES = 3,
       DEFAULT_MAX_COMP = 500,
+      DEFAULT_BATCH_SIZE = 4096,
+      DEFAULT_NUM_EPOCHS = 1,
+      DEFAULT_NUM_THREADS = 1,
+      DEFAULT_SEED = 5489,
+      DEFAULT_SEED_ROUNDS = 5,
     };
 #define DEFAULT_DIST_COMP VlDistanceL2
+#define DEFAULT_KMEANS_ALGORITHM KMEANS_ANN
+#define DEFAULT_SEEDING SEED_RANDOM
 
     // constructor and destructor
   public:
@@ -42,6 +74,27 @@ namespace EYE
   private:
     void init_with_default_parameter();
 
+    // native trainers, the centers are kept in centers_
+    void seed_centers(const float* data, const uint32_t num_data,
+                      const uint32_t dim, const uint32_t K);
+    void init_centers_with_rand_data(const float* data,
+                                     const uint32_t num_data,
+                                     const uint32_t dim, const uint32_t K);
+    // weight can be NULL for unit weights
+    void init_centers_plus_plus(const float* data, const float* weight,
+                                const uint32_t num_data, const uint32_t dim,
+                                const uint32_t K);
+    void init_centers_parallel(const float* data, const uint32_t num_data,
+                               const uint32_t dim, const uint32_t K);
+    void refine_lloyd(const float* data, const uint32_t num_data,
+                      const uint32_t dim, const uint32_t K);
+    void refine_minibatch(const float* data, const uint32_t num_data,
+                          const uint32_t dim, const uint32_t K);
+    // one mini-batch step, counts is the number of data seen by each center
+    void minibatch_step(const float* batch, const uint32_t num,
+                        const uint32_t dim, const uint32_t K,
+                        vector<double>& counts);
+
     // setting and accessing
   public:
     inline void set_max_iter(const uint32_t max_iter)
@@ -72,9 +125,47 @@ namespace EYE
       dist_type_ = type;
       has_setup_ = false;
     }
+    inline void set_algorithm(const Algorithm algorithm)
+    {
+      if (algorithm == algorithm_)
+        return;
+      algorithm_ = algorithm;
+      has_setup_ = false;
+    }
+    // size of the mini-batches and of the chunks in streaming
+    inline void set_batch_size(const uint32_t batch_size)
+    {
+      batch_size_ = (batch_size == 0 ? 1 : batch_size);
+    }
+    // passes over the stream in GenKMeansStream()
+    inline void set_num_epochs(const uint32_t num_epochs)
+    {
+      num_epochs_ = num_epochs;
+    }
+    // threads of the native trainers and seedings, 0 for all the cores
+    inline void set_num_threads(const uint32_t num_threads)
+    {
+      num_threads_ = num_threads;
+    }
+    inline void set_seeding(const Seeding seeding)
+    {
+      seeding_ = seeding;
+    }
+    // the same seed gives the same centers, whatever the number of threads
+    inline void set_seed(const uint32_t seed)
+    {
+      seed_ = seed;
+    }
+    // oversampling rounds of k-means||
+    inline void set_seed_rounds(const uint32_t seed_rounds)
+    {
+      seed_rounds_ = (seed_rounds == 0 ? 1 : seed_rounds);
+    }
 
     inline const float* get_clusters() const
     {
+      if (!centers_.empty())
+        return &centers_[0];
       if (kmeans_model_ == NULL)
         return NULL;
       return ((const float*) vl_kmeans_get_centers(kmeans_model_));
@@ -95,15 +186,66 @@ namespace EYE
     {
       return dist_type_;
     }
+    inline Algorithm get_algorithm() const
+    {
+      return algorithm_;
+    }
+    inline uint32_t get_batch_size() const
+    {
+      return batch_size_;
+    }
+    inline uint32_t get_num_epochs() const
+    {
+      return num_epochs_;
+    }
+    inline uint32_t get_num_threads() const
+    {
+      return num_threads_;
+    }
+    inline Seeding get_seeding() const
+    {
+      return seeding_;
+    }
+    inline uint32_t get_seed() const
+    {
+      return seed_;
+    }
+    inline uint32_t get_seed_rounds() const
+    {
+      return seed_rounds_;
+    }
 
-    // IO operation
+    // IO operation, the outputs are only set on success
   public:
-    static void save(FILE* output, const shared_ptr<float>& clusters,
-                     const uint32_t dim, const uint32_t K);
-    static void save(FILE* output, const float* clusters, const uint32_t dim,
-                     const uint32_t K);
-    static void load(FILE* input, shared_ptr<float>& clusters, uint32_t* dim,
-                     uint32_t* K);
+    static Status save(FILE* output, const shared_ptr<float>& clusters,
+                       const uint32_t dim, const uint32_t K);
+    static Status save(FILE* output, const float* clusters,
+                       const uint32_t dim, const uint32_t K);
+    static Status load(FILE* input, shared_ptr<float>& clusters,
+                       uint32_t* dim, uint32_t* K);
+
+    // versioned binary format: a 64-byte header (magic, version, K, dim,
+    // dtype, distance type, checksum) followed by the 64-byte aligned
+    // centers. dist_type can be NULL when loading.
+    static Status save_binary(FILE* output, const shared_ptr<float>& clusters,
+                              const uint32_t dim, const uint32_t K,
+                              const VlVectorComparisonType dist_type =
+                                  DEFAULT_DIST_COMP);
+    static Status save_binary(FILE* output, const float* clusters,
+                              const uint32_t dim, const uint32_t K,
+                              const VlVectorComparisonType dist_type =
+                                  DEFAULT_DIST_COMP);
+    static Status load_binary(FILE* input, shared_ptr<float>& clusters,
+                              uint32_t* dim, uint32_t* K,
+                              VlVectorComparisonType* dist_type = NULL);
+    // zero copy loading: clusters points into the read-only mapping of the
+    // file, which is released with the last copy of clusters. The checksum
+    // is only verified on demand since it touches every page.
+    static Status map_binary(const char* filename,
+                             shared_ptr<float>& clusters, uint32_t* dim,
+                             uint32_t* K,
+                             VlVectorComparisonType* dist_type = NULL,
+                             const bool verify = false);
 
   private:
     VlKMeans* kmeans_model_;
@@ -113,15 +255,42 @@ namespace EYE
     uint32_t num_kdtrees_;
     uint32_t max_comp_;
     VlVectorComparisonType dist_type_;
+    Algorithm algorithm_;
+    uint32_t batch_size_;
+    uint32_t num_epochs_;
+    uint32_t num_threads_;
+    Seeding seeding_;
+    uint32_t seed_;
+    uint32_t seed_rounds_;
+
+    // centers of the native trainers
+    vector<float> centers_;
 
     // setup
     bool has_setup_;
 
+    // a failed training keeps the clusters of the previous one
   public:
-    void GenKMeans(const shared_ptr<float>& data, const uint32_t num_data,
-                   const uint32_t dim, const uint32_t K);
-    void GenKMeans(const float* data, const uint32_t num_data,
-                   const uint32_t dim, const uint32_t K);
+    Status GenKMeans(const shared_ptr<float>& data, const uint32_t num_data,
+                     const uint32_t dim, const uint32_t K);
+    Status GenKMeans(const float* data, const uint32_t num_data,
+                     const uint32_t dim, const uint32_t K);
+
+    // mini-batch k-means over a stream that does not fit in memory, each
+    // chunk of get_batch_size() descriptors is one mini-batch
+    Status GenKMeansStream(ChunkReader reader, void* user, const uint32_t dim,
+                           const uint32_t K);
+    // the stream is the rest of the file, as raw float rows of dim values
+    Status GenKMeansStream(FILE* input, const uint32_t dim, const uint32_t K);
+
+    // vocabulary tree from a recursive k-means: every node with at least
+    // branch data is split into branch children, down to depth levels, so
+    // that there are at most branch^depth words. Each split is trained with
+    // the parameters of this codebook. L2 only.
+    Status GenVocabTree(const float* data, const uint32_t num_data,
+                        const uint32_t dim, const uint32_t branch,
+                        const uint32_t depth, VocabTree* const tree);
+
   };
 }
 
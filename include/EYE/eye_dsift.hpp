@@ -8,9 +8,14 @@
 #ifndef __EYE_EYE_DSIFT_HPP__
 #define __EYE_EYE_DSIFT_HPP__
 
+#include "EYE/eye_smooth.hpp"
+#include "EYE/eye_status.hpp"
+#include "EYE/eye_workspace.hpp"
+
 #include <vl/dsift.h>
 
 #include <stdint.h>
+#include <list>
 #include <vector>
 #include <cmath>
 #include <climits>
@@ -26,15 +31,131 @@ namespace EYE
 
   class DSift
   {
+     public:
+      // gaussian smoothing of the sizes, sigma = size / magnif
+      enum SmoothMethod
+      {
+        SMOOTH_EXACT = 0,  // vl_imsmooth_f, every size from the image
+        SMOOTH_CASCADE,  // every size from the smaller one, sequentially
+        SMOOTH_RECURSIVE,  // Deriche's filter, its cost does not grow with sigma
+      };
+
+      // receives the descriptors of a band of Extract_tiled(): num frames
+      // of the i-th size, which are the frames [first, first + num) of the
+      // output of Extract() for the whole image. descrs holds num * dim
+      // values. Returning false stops the extraction.
+      typedef bool (*FloatSink)(const uint32_t i, const uint32_t first,
+                                const VlDsiftKeypoint* frames,
+                                const float* descrs, const uint32_t num,
+                                const uint32_t dim, void* user);
+      typedef bool (*ByteSink)(const uint32_t i, const uint32_t first,
+                               const VlDsiftKeypoint* frames,
+                               const uint8_t* descrs, const uint32_t num,
+                               const uint32_t dim, void* user);
+
      public:
       DSift();
       ~DSift();
 
      public:
-      void SetUp(const uint32_t width, const uint32_t height);
-      void Extract(const float* gray_img, const uint32_t width,
-                   const uint32_t height, vector<VlDsiftKeypoint>* frames,
-                   vector<float>* descrs, uint32_t* dim);
+      // the filters and the geometry of the last get_cache_size() image
+      // sizes are kept, setting up one of them again only selects it
+      Status SetUp(const uint32_t width, const uint32_t height);
+      Status Extract(const float* gray_img, const uint32_t width,
+                     const uint32_t height, vector<VlDsiftKeypoint>* frames,
+                     vector<float>* descrs, uint32_t* dim);
+      // !Note: Must call SetUp() and allocate memory outside before calling
+      // this one. frames (can be NULL) holds get_total_num_patches() points
+      // and descrs get_total_num_patches() * get_descr_dim() values, for
+      // the size of this image. An image of another size than the last one
+      // set up returns STATUS_SIZE_MISMATCH, the overloads on vectors set
+      // it up instead.
+      Status Extract(const float* gray_img, const uint32_t width,
+                     const uint32_t height, VlDsiftKeypoint* const frames,
+                     float* const descrs);
+      // quantized descriptors, a quarter of the memory. They are truncated
+      // to [0, 255] whatever float_desc is.
+      Status Extract(const float* gray_img, const uint32_t width,
+                     const uint32_t height, vector<VlDsiftKeypoint>* frames,
+                     vector<uint8_t>* descrs, uint32_t* dim);
+      Status Extract(const float* gray_img, const uint32_t width,
+                     const uint32_t height, VlDsiftKeypoint* const frames,
+                     uint8_t* const descrs);
+
+      // 8 and 16 bit images as decoded, their rows are stride bytes apart,
+      // a multiple of the pixel size. The pixels are converted by the
+      // first pass of the smoothing, the output is the one of the float
+      // image.
+      Status Extract(const uint8_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     vector<VlDsiftKeypoint>* frames, vector<float>* descrs,
+                     uint32_t* dim);
+      Status Extract(const uint8_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     vector<VlDsiftKeypoint>* frames,
+                     vector<uint8_t>* descrs, uint32_t* dim);
+      Status Extract(const uint8_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     VlDsiftKeypoint* const frames, float* const descrs);
+      Status Extract(const uint8_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     VlDsiftKeypoint* const frames, uint8_t* const descrs);
+      Status Extract(const uint16_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     vector<VlDsiftKeypoint>* frames, vector<float>* descrs,
+                     uint32_t* dim);
+      Status Extract(const uint16_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     vector<VlDsiftKeypoint>* frames,
+                     vector<uint8_t>* descrs, uint32_t* dim);
+      Status Extract(const uint16_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     VlDsiftKeypoint* const frames, float* const descrs);
+      Status Extract(const uint16_t* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     VlDsiftKeypoint* const frames, uint8_t* const descrs);
+
+      // num_img images of the same size in one call, the threads share the
+      // images instead of the sizes. The frames (can be NULL) and the
+      // descriptors of all the images are contiguous, those of the i-th
+      // image start at the frame (*offsets)[i], offsets holds num_img + 1
+      // values.
+      Status Extract_batch(const float* const* gray_imgs,
+                           const uint32_t num_img, const uint32_t width,
+                           const uint32_t height,
+                           vector<VlDsiftKeypoint>* frames,
+                           vector<float>* descrs, vector<uint32_t>* offsets,
+                           uint32_t* dim);
+      Status Extract_batch(const float* const* gray_imgs,
+                           const uint32_t num_img, const uint32_t width,
+                           const uint32_t height,
+                           vector<VlDsiftKeypoint>* frames,
+                           vector<uint8_t>* descrs, vector<uint32_t>* offsets,
+                           uint32_t* dim);
+      // packed images, the i-th one starts at gray_imgs + i * width * height
+      Status Extract_batch(const float* gray_imgs, const uint32_t num_img,
+                           const uint32_t width, const uint32_t height,
+                           vector<VlDsiftKeypoint>* frames,
+                           vector<float>* descrs, vector<uint32_t>* offsets,
+                           uint32_t* dim);
+      Status Extract_batch(const float* gray_imgs, const uint32_t num_img,
+                           const uint32_t width, const uint32_t height,
+                           vector<VlDsiftKeypoint>* frames,
+                           vector<uint8_t>* descrs, vector<uint32_t>* offsets,
+                           uint32_t* dim);
+
+      // images too large for Extract(), e.g. mapped from a file. The image
+      // is processed in horizontal bands of get_band_height() rows, each
+      // one smoothed and described with a halo of rows around it, so that
+      // the memory grows with width * band height instead of the image.
+      // The descriptors are the ones of Extract(), handed to sink band
+      // after band, the sizes of a band in order. The size of the image is
+      // not set up. The bands are always smoothed by the kernels of
+      // SMOOTH_EXACT, the halos are as wide as these kernels.
+      Status Extract_tiled(const float* gray_img, const uint32_t width,
+                           const uint32_t height, FloatSink sink, void* user);
+      Status Extract_tiled(const float* gray_img, const uint32_t width,
+                           const uint32_t height, ByteSink sink, void* user);
       void Clear();
 
       // accessing data
@@ -67,6 +188,27 @@ namespace EYE
       {
         return contr_thrd_;
       }
+      inline uint32_t get_num_threads() const
+      {
+        return num_threads_;
+      }
+      inline uint32_t get_cache_size() const
+      {
+        return cache_size_;
+      }
+      inline uint32_t get_band_height() const
+      {
+        return band_height_;
+      }
+      inline SmoothMethod get_smooth_method() const
+      {
+        return smooth_method_;
+      }
+      // the workspace the smoothing buffers are taken from
+      inline Workspace* get_workspace()
+      {
+        return (workspace_ == NULL ? &own_workspace_ : workspace_);
+      }
       inline void get_bound(int* minx, int* miny, int* maxx, int* maxy) const
       {
         *minx = bound_minx_;
@@ -75,7 +217,15 @@ namespace EYE
         *maxy = bound_maxy_;
       }
 
-      // aux data
+      // aux data of the last size set up
+      inline uint32_t get_width() const
+      {
+        return width_;
+      }
+      inline uint32_t get_height() const
+      {
+        return height_;
+      }
       inline const vector<uint32_t>& get_off() const
       {
         return off_;
@@ -104,6 +254,10 @@ namespace EYE
       {
         return total_num_patches_;
       }
+      inline uint32_t get_descr_dim() const
+      {
+        return descr_dim_;
+      }
 
       inline void set_sizes(const vector<uint32_t>& sizes)
       {
@@ -152,6 +306,37 @@ namespace EYE
         contr_thrd_ = contr_thrd;
         has_setup_ = false;
       }
+      // number of threads sharing the sizes, 0 for all the cores. It does
+      // not require to call SetUp() again
+      inline void set_num_threads(const uint32_t num_threads)
+      {
+        num_threads_ = num_threads;
+      }
+      // number of image sizes kept, at least the current one. It does not
+      // require to call SetUp() again
+      inline void set_cache_size(const uint32_t cache_size)
+      {
+        cache_size_ = (cache_size == 0 ? 1 : cache_size);
+      }
+      // rows of frames in a band of Extract_tiled(), at least 1. It does
+      // not require to call SetUp() again
+      inline void set_band_height(const uint32_t band_height)
+      {
+        band_height_ = (band_height == 0 ? 1 : band_height);
+      }
+      // the kernels of every method are built by SetUp(), it does not
+      // require to call SetUp() again
+      inline void set_smooth_method(const SmoothMethod method)
+      {
+        smooth_method_ = method;
+      }
+      // workspace of the calling thread, e.g. shared with the other stages.
+      // NULL for the one of the DSift. It does not require to call SetUp()
+      // again
+      inline void set_workspace(Workspace* const workspace)
+      {
+        workspace_ = workspace;
+      }
       inline void set_bound(const int* minx, const int* miny, const int* maxx,
                             const int* maxy)
       {
@@ -169,9 +354,137 @@ namespace EYE
         has_setup_ = false;
       }
 
+     private:
+      // filters, aux data and workspaces of an image size
+      struct Geometry
+      {
+          Geometry()
+              : width(0),
+                height(0),
+                total_num_patches(0)
+          {
+          }
+
+          uint32_t width;
+          uint32_t height;
+          vector<VlDsiftFilter*> dsift_models;
+          vector<uint32_t> off;
+          vector<int> start_x;
+          vector<int> start_y;
+          vector<int> end_x;
+          vector<int> end_y;
+          vector<uint32_t> num_patches;
+          vector<uint32_t> patch_off;
+          uint32_t total_num_patches;
+      };
+
+      // frames of a size on an image, as vlfeat lays them out, and the
+      // rows of a band of Extract_tiled()
+      struct FrameGrid
+      {
+          int min_x;
+          int min_y;
+          int max_x;
+          uint32_t num_x;
+          uint32_t num_y;
+          // first frame in the output of the whole image
+          uint32_t first;
+          // rows smoothed above the first frame and below the last one
+          int halo_top;
+          int halo_bottom;
+          uint32_t band_height;
+      };
+
      private:
       void init_with_default_parameter();
       void clear_data();
+      // checks the parameters and builds the kernels after a change
+      Status set_up_parameters();
+      // make the geometry of this size the current one, from the cache or
+      // built, and evict the least recently used sizes
+      void use_size(const uint32_t width, const uint32_t height);
+      // build the geometry of a size into the current one, which is empty
+      void build_geometry(const uint32_t width, const uint32_t height);
+      // exchange the current geometry with a cached one
+      void swap_geometry(Geometry* const geom);
+      static void delete_geometry(Geometry* const geom);
+      // create the filter of the i-th size with its bounds and geometry
+      VlDsiftFilter* new_scale_model(const uint32_t i) const;
+      // the same without the bounds, for an image of any size
+      VlDsiftFilter* new_model(const uint32_t i, const uint32_t width,
+                               const uint32_t height) const;
+      void get_grid(const uint32_t i, const uint32_t width,
+                    const uint32_t height, FrameGrid* const grid) const;
+      // band filters for these heights
+      void reserve_band_models(const uint32_t width,
+                               const vector<uint32_t>& heights);
+      // gaussian kernel of each size, and the ones of the cascade
+      void build_kernels();
+      // filter sets for num threads
+      void reserve_models(const uint32_t num);
+      // the Extract() of every pixel type P and descriptor type T
+      template<typename P, typename T>
+      Status extract(const P* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     vector<VlDsiftKeypoint>* frames, vector<T>* descrs,
+                     uint32_t* dim);
+      template<typename P, typename T>
+      Status extract(const P* gray_img, const uint32_t width,
+                     const uint32_t height, const size_t stride,
+                     VlDsiftKeypoint* const frames, T* const descrs);
+      template<typename T>
+      Status extract_batch(const float* const* gray_imgs,
+                           const uint32_t num_img, const uint32_t width,
+                           const uint32_t height,
+                           vector<VlDsiftKeypoint>* frames,
+                           vector<T>* descrs, vector<uint32_t>* offsets,
+                           uint32_t* dim);
+      // the i-th size of an image with the filter set of a thread, the
+      // output points to the first frame of the image. The workspace of
+      // the thread holds width_ * height_ + get_smooth_buffer_size() floats.
+      template<typename P, typename T>
+      void extract_size(const P* gray_img, const size_t stride,
+                        const uint32_t i, const uint32_t set,
+                        float* const workspace, VlDsiftKeypoint* const frames,
+                        T* const descrs);
+      // the descriptors of the i-th size from its smoothed image
+      template<typename T>
+      void describe_size(const float* smooth_img, const uint32_t i,
+                         const uint32_t set, VlDsiftKeypoint* const frames,
+                         T* const descrs);
+      template<typename T, typename Sink>
+      Status extract_tiled(const float* gray_img, const uint32_t width,
+                           const uint32_t height, Sink sink, void* user);
+      // the rows of frames [first_k, end_k) of the i-th size into the band
+      // buffers, the workspace of the thread holds width * grid.band_height
+      // + get_separable_buffer_size() floats
+      template<typename T>
+      void extract_band(const float* gray_img, const uint32_t width,
+                        const uint32_t height, const uint32_t i,
+                        const FrameGrid& grid, const uint32_t first_k,
+                        const uint32_t end_k, float* const workspace,
+                        VlDsiftKeypoint* const frames, T* const descrs);
+      // the gaussian of the i-th size on a width x height image with rows
+      // stride bytes apart into out, by the kernels of SMOOTH_EXACT or by
+      // the recursive filter. buffer holds get_smooth_buffer_size() floats.
+      template<typename P>
+      void smooth(const P* gray_img, const size_t stride,
+                  const uint32_t width, const uint32_t height,
+                  const uint32_t i, const SmoothMethod method,
+                  float* const out, float* const buffer) const;
+      // every size, the i-th one into levels + i * width * height, each
+      // from the smaller one in smooth_order_
+      template<typename P>
+      void smooth_cascade(const P* gray_img, const size_t stride,
+                          const uint32_t width, const uint32_t height,
+                          float* const levels, float* const buffer) const;
+      // floats of the buffer of smooth() and smooth_cascade()
+      size_t get_smooth_buffer_size(const uint32_t width,
+                                    const uint32_t height,
+                                    const SmoothMethod method) const;
+      Status check_input(const void* gray_img, const uint32_t width,
+                         const uint32_t height) const;
+
 
      public:
 #define DEFAULT_FAST true
@@ -184,6 +497,10 @@ namespace EYE
 #define DEFAULT_BOUND_MINY 0
 #define DEFAULT_BOUND_MAXX INT_MAX
 #define DEFAULT_BOUND_MAXY INT_MAX
+#define DEFAULT_DSIFT_NUM_THREADS 1
+#define DEFAULT_DSIFT_CACHE_SIZE 4
+#define DEFAULT_DSIFT_BAND_HEIGHT 128
+#define DEFAULT_DSIFT_SMOOTH_METHOD SMOOTH_EXACT
       enum
       {
         DEFAULT_NUM_BIN_X = 4,
@@ -192,7 +509,10 @@ namespace EYE
       };
 
      private:
-      VlDsiftFilter* dsift_model_;
+      // one filter per size, so that the sizes can run concurrently. The
+      // threads of Extract_batch() have a set of them each, the set s is
+      // dsift_models_[s * num_sz, (s + 1) * num_sz)
+      vector<VlDsiftFilter*> dsift_models_;
       uint32_t width_;
       uint32_t height_;
 
@@ -208,6 +528,10 @@ namespace EYE
       int bound_miny_;
       int bound_maxx_;
       int bound_maxy_;
+      uint32_t num_threads_;
+      uint32_t cache_size_;
+      uint32_t band_height_;
+      SmoothMethod smooth_method_;
 
       bool has_setup_;
 
@@ -219,7 +543,31 @@ namespace EYE
       vector<int> end_x_;
       vector<int> end_y_;
       vector<uint32_t> num_patches_;
+      // first frame of each size in the output of an image
+      vector<uint32_t> patch_off_;
       uint32_t total_num_patches_;
+      uint32_t descr_dim_;
+
+      // same for all the image sizes
+      vector<vector<float> > kernels_;
+      // the sizes by increasing sigma, and the kernel taking each one from
+      // the previous in this order, of sigma sqrt(s_k^2 - s_{k-1}^2)
+      vector<uint32_t> smooth_order_;
+      vector<vector<float> > cascade_kernels_;
+      uint32_t max_radius_;
+
+      // filters of Extract_tiled(), one per size, for bands of
+      // band_width_ x band_heights_[i]
+      vector<VlDsiftFilter*> band_models_;
+      uint32_t band_width_;
+      vector<uint32_t> band_heights_;
+
+      // the smoothed images and the smoothing buffers of the threads
+      Workspace* workspace_;
+      Workspace own_workspace_;
+
+      // the other sizes, the most recently used first
+      std::list<Geometry> cache_;
   };
 
 }
@@ -0,0 +1,140 @@
+/*
+ * eye_knn.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_KNN_HPP__
+#define __EYE_EYE_KNN_HPP__
+
+#include "EYE/eye_status.hpp"
+#include "EYE/eye_workspace.hpp"
+
+#include <vl/generic.h>
+
+#include <stdint.h>
+#include <vector>
+
+namespace EYE
+{
+  using std::vector;
+
+  // Exact k-nearest-neighbor search with the L2 distance. The squared
+  // distances of a block of queries are computed as
+  // ||x||^2 - 2 * x' * b + ||b||^2 with one SGEMM, followed by a partial
+  // top-k selection. In the blocked mode the base is visited in tiles small
+  // enough to stay in the L2 cache. With a uint8 base and uint8 queries
+  // the distances are exact integers computed with the SIMD dot products.
+  class ExactKNN
+  {
+     public:
+      ExactKNN();
+      ~ExactKNN();
+
+      // the base is not copied, it must stay alive until Clear(). A failed
+      // SetUp() keeps the previous base.
+      Status SetUp(const float* const base, const uint32_t dim,
+                   const uint32_t num_base);
+      Status SetUp(const uint8_t* const base, const uint32_t dim,
+                   const uint32_t num_base);
+      void Clear();
+
+      // index and dist are num_query * num_knn, sorted by increasing
+      // distance for each query. dist can be NULL. The scratch of the
+      // threads is taken from the workspace of the calling thread, or from
+      // the heap without one.
+      Status Search(const float* const query, const uint32_t num_query,
+                    const uint32_t num_knn, vl_uint32* const index,
+                    float* const dist, Workspace* const workspace = NULL) const;
+      // the base must be set up as uint8 as well
+      Status Search(const uint8_t* const query, const uint32_t num_query,
+                    const uint32_t num_knn, vl_uint32* const index,
+                    float* const dist, Workspace* const workspace = NULL) const;
+
+     public:
+      inline void set_blocked(const bool blocked)
+      {
+        blocked_ = blocked;
+      }
+      inline void set_query_block(const uint32_t query_block)
+      {
+        query_block_ = (query_block == 0 ? 1 : query_block);
+      }
+      // size in bytes of the base tile in the blocked mode
+      inline void set_cache_size(const uint32_t cache_size)
+      {
+        cache_size_ = cache_size;
+      }
+      inline void set_num_threads(const uint32_t num_threads)
+      {
+        num_threads_ = num_threads;
+      }
+
+      inline bool get_blocked() const
+      {
+        return blocked_;
+      }
+      inline uint32_t get_query_block() const
+      {
+        return query_block_;
+      }
+      inline uint32_t get_cache_size() const
+      {
+        return cache_size_;
+      }
+      inline uint32_t get_num_threads() const
+      {
+        return num_threads_;
+      }
+      inline const float* get_base() const
+      {
+        return base_;
+      }
+      inline const uint8_t* get_base_u8() const
+      {
+        return base_u8_;
+      }
+      inline uint32_t get_dim() const
+      {
+        return dim_;
+      }
+      inline uint32_t get_num_base() const
+      {
+        return num_base_;
+      }
+
+     public:
+      enum
+      {
+        DEFAULT_QUERY_BLOCK = 256,
+        DEFAULT_CACHE_SIZE = 256 * 1024,
+        DEFAULT_NUM_THREADS = 1,
+      };
+
+     private:
+      void init_with_default_parameter();
+      Status check_search(const void* const query, const uint32_t num_knn,
+                          const vl_uint32* const index) const;
+
+      // number of base vectors computed together
+      uint32_t get_base_block(const uint32_t elem_size) const;
+
+     private:
+      // only one of base_ and base_u8_ is set
+      const float* base_;
+      const uint8_t* base_u8_;
+      uint32_t dim_;
+      uint32_t num_base_;
+      vector<float> base_norm_;
+      vector<uint32_t> base_norm_u8_;
+
+      // param
+      bool blocked_;
+      uint32_t query_block_;
+      uint32_t cache_size_;
+      uint32_t num_threads_;
+  };
+}
+
+#endif /* __EYE_EYE_KNN_HPP__ */
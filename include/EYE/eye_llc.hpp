@@ -8,17 +8,58 @@
 #ifndef __EYE_EYE_LLC_HPP__
 #define __EYE_EYE_LLC_HPP__
 
+#include "EYE/eye_knn.hpp"
+#include "EYE/eye_mmap.hpp"
+#include "EYE/eye_pq.hpp"
+#include "EYE/eye_status.hpp"
+#include "EYE/eye_thread.hpp"
+#include "EYE/eye_vocab_tree.hpp"
+#include "EYE/eye_workspace.hpp"
+
 #include <stdint.h>
 #include <cmath>
+#include <string>
+#include <vector>
 #include <vl/kdtree.h>
 #include <boost/shared_ptr.hpp>
 
 namespace EYE
 {
   using boost::shared_ptr;
+  using std::vector;
+
+  // LLC codes stored as num_knn (index, weight) pairs per frame, i.e. a CSR
+  // matrix whose i-th row starts at i * num_knn
+  struct SparseCode
+  {
+      uint32_t num_frame;
+      uint32_t num_knn;
+      uint32_t num_base;
+      vector<uint32_t> index;
+      vector<float> weight;
+  };
+
+  class LLCModel;
+  class LLCEncoder;
 
+  // Locality-constrained linear coding of the frames over a base. SetUp()
+  // builds an immutable LLCModel, the encoding functions share the frames
+  // among num_threads LLCEncoder of that model. The encoders are kept
+  // between two calls with their scratch. To encode from threads of the
+  // caller, get_model() and give one LLCEncoder to each thread.
   class LLC
   {
+     public:
+      // backend of the nearest neighbor search
+      enum SearchMethod
+      {
+        SEARCH_KDFOREST = 0,  // approximate, vlfeat kd-forest
+        SEARCH_EXACT,  // exact, one SGEMM against the whole base
+        SEARCH_EXACT_BLOCKED,  // exact, base tiles resident in L2
+        SEARCH_TREE,  // beam search in a vocabulary tree, see set_vocab_tree()
+        SEARCH_PQ,  // product quantization, max_comp re-ranked candidates
+      };
+
       // constructor and destructor
      public:
       LLC();
@@ -26,33 +67,88 @@ namespace EYE
           const uint32_t num_base);
       ~LLC();
 
-      // must call this function before encoder!!!
-      void SetUp();
+      // must call this function before encoder!!! A failed SetUp() leaves
+      // the LLC as it was.
+      Status SetUp();
       void Clear();
 
+      // write the kd-forest built by SetUp() to a binary file, see
+      // set_index_file()
+      Status save_index(const char* filename) const;
+
+      // the model built by the last SetUp(), NULL if the LLC is not set up.
+      // It stays valid, and unchanged, when the LLC is set up again or
+      // destroyed.
+      shared_ptr<const LLCModel> get_model() const;
+
+      // the codes are only written when the input is valid
      public:
-      void Encode(const float* const data, const uint32_t dim,
-                  const uint32_t num_frame,
-                  shared_ptr<float>* const codes) const;
-      void Encode_with_max_pooling(const float* const data, const uint32_t dim,
-                                   const uint32_t num_frame,
-                                   shared_ptr<float>* const codes) const;
+      Status Encode(const float* const data, const uint32_t dim,
+                    const uint32_t num_frame,
+                    shared_ptr<float>* const codes) const;
+      Status Encode_with_max_pooling(const float* const data,
+                                     const uint32_t dim,
+                                     const uint32_t num_frame,
+                                     shared_ptr<float>* const codes) const;
 
       // !Note: Must allocate memory outside before calling these two
-      void Encode(const float* const data, const uint32_t dim,
-                  const uint32_t num_frame, float* const codes) const;
-      void Encode_with_max_pooling(const float* const data, const uint32_t dim,
-                                   const uint32_t num_frame,
-                                   float* const codes) const;
+      Status Encode(const float* const data, const uint32_t dim,
+                    const uint32_t num_frame, float* const codes) const;
+      Status Encode_with_max_pooling(const float* const data,
+                                     const uint32_t dim,
+                                     const uint32_t num_frame,
+                                     float* const codes) const;
+
+      // only the num_knn_ non-zeros of each frame
+      Status Encode_sparse(const float* const data, const uint32_t dim,
+                           const uint32_t num_frame,
+                           SparseCode* const codes) const;
+      // !Note: Must allocate num_frame * num_knn_ elements for index and
+      // weight outside
+      Status Encode_sparse(const float* const data, const uint32_t dim,
+                           const uint32_t num_frame, uint32_t* const index,
+                           float* const weight) const;
+
+      // quantized descriptors from DSift. The exact searches run on a uint8
+      // copy of the base, built by the first call, only the frames of a tile
+      // and their neighbors are converted to float for the solve.
+      Status Encode_sparse(const uint8_t* const data, const uint32_t dim,
+                           const uint32_t num_frame,
+                           SparseCode* const codes) const;
+      Status Encode_sparse(const uint8_t* const data, const uint32_t dim,
+                           const uint32_t num_frame, uint32_t* const index,
+                           float* const weight) const;
 
      private:
       void init_with_default_parameter();
       void clear_data();
+      Status check_encode(const void* const data, const uint32_t dim,
+                          const uint32_t num_frame,
+                          const void* const codes) const;
+
+      // the frames are cut into one range of whole batches per thread,
+      // returns the number of frames of a range
+      uint32_t split_frames(const uint32_t num_frame,
+                            int* const num_threads) const;
+      // an encoder of the model from the pool, the one of the calling
+      // thread takes the workspace
+      LLCEncoder* acquire_encoder(const bool caller) const;
+      void release_encoder(LLCEncoder* const encoder) const;
+      void clear_encoders();
+
+      // the Encode_sparse() of both descriptor types
+      template<typename T>
+      Status encode_sparse(const T* const data, const uint32_t dim,
+                           const uint32_t num_frame, uint32_t* const index,
+                           float* const weight) const;
 
      public:
-      // setting and accessing
-      void set_base(const shared_ptr<float>& base, const uint32_t dim,
-                    const uint32_t num_base);
+      // setting and accessing, an invalid base is not taken
+      Status set_base(const shared_ptr<float>& base, const uint32_t dim,
+                      const uint32_t num_base);
+      // the words of the tree become the base, and the search method is
+      // SEARCH_TREE
+      Status set_vocab_tree(const shared_ptr<VocabTree>& tree);
 
       inline void set_thrd_method(const VlKDTreeThresholdingMethod method)
       {
@@ -82,6 +178,7 @@ namespace EYE
         num_knn_ = num_knn;
         has_setup_ = false;
       }
+      // comparisons of the kd-forest, candidates re-ranked by SEARCH_PQ
       inline void set_max_comp(const uint32_t max_comp)
       {
         if (max_comp == max_comp_)
@@ -96,6 +193,61 @@ namespace EYE
         beta_ = beta;
         has_setup_ = false;
       }
+      // number of frames whose covariance matrices are built and solved
+      // together, it does not require to call SetUp() again. The batched
+      // products and the unrolled Cholesky do not sum in the order of the
+      // k^2 dot products and sposv of the former encoder, the weights differ
+      // from its ones by up to 2e-3 times the largest weight of the frame,
+      // as checked by test_llc_solve()
+      inline void set_batch_size(const uint32_t batch_size)
+      {
+        batch_size_ = (batch_size == 0 ? 1 : batch_size);
+      }
+      // number of threads sharing the frames in encoding, 0 for all the
+      // cores, it does not require to call SetUp() again
+      inline void set_num_threads(const uint32_t num_threads)
+      {
+        num_threads_ = num_threads;
+      }
+      inline void set_search_method(const SearchMethod method)
+      {
+        if (method == search_method_)
+          return;
+        search_method_ = method;
+        has_setup_ = false;
+      }
+      // SetUp() maps the kd-forest saved in this file by save_index(), with
+      // the same base and parameters, instead of building it. The mapping
+      // is shared by the processes of the machine. Empty to build.
+      inline void set_index_file(const std::string& filename)
+      {
+        if (filename == index_file_)
+          return;
+        index_file_ = filename;
+        has_setup_ = false;
+      }
+      // subspaces of the product quantization, dim must be a multiple of it
+      inline void set_num_subspaces(const uint32_t num_subspaces)
+      {
+        if (num_subspaces == num_subspaces_)
+          return;
+        num_subspaces_ = num_subspaces;
+        has_setup_ = false;
+      }
+      // nodes kept at each level of the tree search, it does not require
+      // to call SetUp() again
+      inline void set_beam_width(const uint32_t beam_width)
+      {
+        beam_width_ = (beam_width == 0 ? 1 : beam_width);
+      }
+      // workspace of the calling thread, e.g. shared with the other stages,
+      // the other threads use the ones of their encoders. NULL to use the
+      // one of an encoder as well. The LLC then encodes for one calling
+      // thread at a time. It does not require to call SetUp() again
+      inline void set_workspace(Workspace* const workspace)
+      {
+        workspace_ = workspace;
+      }
 
       inline const float* get_base() const
       {
@@ -133,6 +285,38 @@ namespace EYE
       {
         return beta_;
       }
+      inline uint32_t get_batch_size() const
+      {
+        return batch_size_;
+      }
+      inline uint32_t get_num_threads() const
+      {
+        return num_threads_;
+      }
+      inline SearchMethod get_search_method() const
+      {
+        return search_method_;
+      }
+      inline uint32_t get_beam_width() const
+      {
+        return beam_width_;
+      }
+      inline uint32_t get_num_subspaces() const
+      {
+        return num_subspaces_;
+      }
+      inline const std::string& get_index_file() const
+      {
+        return index_file_;
+      }
+      inline const shared_ptr<VocabTree>& get_vocab_tree() const
+      {
+        return vocab_tree_;
+      }
+      inline Workspace* get_workspace() const
+      {
+        return workspace_;
+      }
 
      public:
       enum
@@ -140,10 +324,14 @@ namespace EYE
         DEFAULT_NUM_TREE = 1,
         DEFAULT_NUM_KNN = 5,
         DEFAULT_MAX_COMP = 500,
+        DEFAULT_BATCH_SIZE = 64,
+        DEFAULT_NUM_THREADS = 1,
+        DEFAULT_BEAM_WIDTH = 8,
       };
 #define DEFAULT_THRD_METHOD VL_KDTREE_MEDIAN
 #define DEFAULT_DIST_METHOD VlDistanceL2
 #define DEFAULT_BETA 1e-4
+#define DEFAULT_SEARCH_METHOD SEARCH_KDFOREST
 
      private:
       // base data
@@ -151,20 +339,246 @@ namespace EYE
       uint32_t dim_;
       uint32_t num_base_;
 
-      // kd-forest data
-      VlKDForest* kdforest_model_;
+      // kd-forest parameter
       VlKDTreeThresholdingMethod thrd_method_;
       VlVectorComparisonType dist_method_;
       uint32_t num_tree_;
       uint32_t num_knn_;
       uint32_t max_comp_;
+      std::string index_file_;
+
+      SearchMethod search_method_;
+
+      // tree search data
+      shared_ptr<VocabTree> vocab_tree_;
+      uint32_t beam_width_;
+
+      // product quantization parameter
+      uint32_t num_subspaces_;
+
+      // built by SetUp()
+      shared_ptr<const LLCModel> model_;
 
       // LLC parameter
       float beta_;
+      uint32_t batch_size_;
+      uint32_t num_threads_;
+
+      // encoders of model_ which are not in use
+      mutable vector<LLCEncoder*> encoders_;
+      mutable Mutex encoders_lock_;
+      Workspace* workspace_;
 
       // tag
       bool has_setup_;
   };
+
+  // The read-only state of a set up LLC: the base, the index of the
+  // nearest neighbor search and the parameters of the codes. Nothing
+  // modifies it after LLC::SetUp(), so that it is shared by any number of
+  // LLCEncoder in any threads instead of being duplicated.
+  class LLCModel
+  {
+     public:
+      ~LLCModel();
+
+     public:
+      inline const float* get_base() const
+      {
+        return base_.get();
+      }
+      inline uint32_t get_dim() const
+      {
+        return dim_;
+      }
+      inline uint32_t get_num_base() const
+      {
+        return num_base_;
+      }
+      inline uint32_t get_num_knn() const
+      {
+        return num_knn_;
+      }
+      inline uint32_t get_max_comp() const
+      {
+        return max_comp_;
+      }
+      inline float get_beta() const
+      {
+        return beta_;
+      }
+      inline LLC::SearchMethod get_search_method() const
+      {
+        return search_method_;
+      }
+
+     private:
+      friend class LLC;
+      friend class LLCEncoder;
+
+      // only built by LLC::SetUp()
+      LLCModel();
+      LLCModel(const LLCModel&);
+      LLCModel& operator=(const LLCModel&);
+
+      void build_kdforest();
+      // the nodes of an attached kd-forest are in index_map_, they must not
+      // be freed by vlfeat
+      Status attach_kdforest(const char* filename);
+      Status save_kdforest(const char* filename) const;
+      void delete_kdforest();
+      // the uint8 copy of the base for the exact search of quantized
+      // frames, built by the first of them. NULL if it cannot be built.
+      const ExactKNN* get_exact_knn_u8() const;
+
+     private:
+      // base data
+      shared_ptr<float> base_;
+      uint32_t dim_;
+      uint32_t num_base_;
+
+      // parameters of the codes
+      uint32_t num_knn_;
+      uint32_t max_comp_;
+      float beta_;
+      LLC::SearchMethod search_method_;
+
+      // kd-forest data, the searchers of the encoders are created and
+      // deleted under searcher_lock_
+      VlKDForest* kdforest_;
+      VlKDTreeThresholdingMethod thrd_method_;
+      VlVectorComparisonType dist_method_;
+      uint32_t num_tree_;
+      shared_ptr<MappedFile> index_map_;
+      mutable Mutex searcher_lock_;
+
+      // exact search data, the uint8 base is the rounded base. Only the
+      // encoders of quantized frames build it, under base_u8_lock_.
+      ExactKNN exact_knn_;
+      mutable vector<uint8_t> base_u8_;
+      mutable ExactKNN exact_knn_u8_;
+      mutable bool has_base_u8_;
+      mutable Mutex base_u8_lock_;
+
+      // tree search data
+      shared_ptr<const VocabTree> vocab_tree_;
+
+      // product quantization data
+      PQIndex pq_;
+  };
+
+  // Handle of one thread on a shared LLCModel. It owns the state of the
+  // kd-forest search, and takes the scratch of the search and of the
+  // solver from its workspace, so that the encoders of one model run
+  // concurrently. An encoder is used by one thread at a time, it keeps its
+  // model alive. An encoder of a NULL model returns STATUS_NOT_SETUP.
+  class LLCEncoder
+  {
+     public:
+      explicit LLCEncoder(const shared_ptr<const LLCModel>& model);
+      ~LLCEncoder();
+
+     public:
+      // the same as the ones of LLC, on the calling thread. Must allocate
+      // the memory outside.
+      Status Encode(const float* const data, const uint32_t dim,
+                    const uint32_t num_frame, float* const codes);
+      Status Encode_with_max_pooling(const float* const data,
+                                     const uint32_t dim,
+                                     const uint32_t num_frame,
+                                     float* const codes);
+
+      Status Encode_sparse(const float* const data, const uint32_t dim,
+                           const uint32_t num_frame,
+                           SparseCode* const codes);
+      Status Encode_sparse(const float* const data, const uint32_t dim,
+                           const uint32_t num_frame, uint32_t* const index,
+                           float* const weight);
+      Status Encode_sparse(const uint8_t* const data, const uint32_t dim,
+                           const uint32_t num_frame,
+                           SparseCode* const codes);
+      Status Encode_sparse(const uint8_t* const data, const uint32_t dim,
+                           const uint32_t num_frame, uint32_t* const index,
+                           float* const weight);
+
+     public:
+      inline void set_batch_size(const uint32_t batch_size)
+      {
+        batch_size_ = (batch_size == 0 ? 1 : batch_size);
+      }
+      inline void set_beam_width(const uint32_t beam_width)
+      {
+        beam_width_ = (beam_width == 0 ? 1 : beam_width);
+      }
+      // workspace of the thread of the encoder, NULL for its own one
+      inline void set_workspace(Workspace* const workspace)
+      {
+        workspace_ = workspace;
+      }
+
+      inline uint32_t get_batch_size() const
+      {
+        return batch_size_;
+      }
+      inline uint32_t get_beam_width() const
+      {
+        return beam_width_;
+      }
+      inline const shared_ptr<const LLCModel>& get_model() const
+      {
+        return model_;
+      }
+      inline Workspace* get_workspace()
+      {
+        return (workspace_ == NULL ? &own_workspace_ : workspace_);
+      }
+
+     private:
+      friend class LLC;
+
+      LLCEncoder(const LLCEncoder&);
+      LLCEncoder& operator=(const LLCEncoder&);
+
+      Status check_input(const void* const data, const uint32_t dim,
+                         const uint32_t num_frame,
+                         const void* const codes) const;
+
+      // max pooling of the codes of the frames into codes, which is not
+      // cleared
+      void max_pool(const float* const data, const uint32_t num_frame,
+                    float* const codes);
+
+      // the Encode_sparse() of both descriptor types
+      template<typename T>
+      Status encode_sparse(const T* const data, const uint32_t dim,
+                           const uint32_t num_frame, uint32_t* const index,
+                           float* const weight);
+
+      // find the num_knn nearest bases of each frame
+      void search(const float* const data, const uint32_t num_frame,
+                  vl_uint32* const index);
+      void search(const uint8_t* const data, const uint32_t num_frame,
+                  vl_uint32* const index);
+
+      // solve the LLC weights of a tile of frames whose neighbors are given
+      // in index, the weights are written to w (num_frame * num_knn)
+      void encode_tile(const float* const data, const vl_uint32* const index,
+                       const uint32_t num_frame, float* const w);
+
+     private:
+      shared_ptr<const LLCModel> model_;
+
+      // kd-forest search state
+      VlKDForestSearcher* searcher_;
+
+      // scratch
+      Workspace* workspace_;
+      Workspace own_workspace_;
+
+      // param
+      uint32_t batch_size_;
+      uint32_t beam_width_;
+  };
 }
 
 #endif /* __EYE_EYE_LLC_HPP__ */
@@ -0,0 +1,50 @@
+/*
+ * eye_mmap.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_MMAP_HPP__
+#define __EYE_EYE_MMAP_HPP__
+
+#include <stdint.h>
+#include <cstddef>
+
+namespace EYE
+{
+  // FNV-1a over raw bytes, checks the payload of the binary files
+  uint64_t fnv1a_checksum(const void* data, const size_t len);
+
+  // read-only memory mapping of a whole file, unmapped in the destructor.
+  // Processes mapping the same file share the page-cache copy.
+  class MappedFile
+  {
+     public:
+      MappedFile();
+      ~MappedFile();
+
+      bool Open(const char* filename);
+      void Close();
+
+      inline const uint8_t* get_data() const
+      {
+        return data_;
+      }
+      inline size_t get_size() const
+      {
+        return size_;
+      }
+
+     private:
+      // not copyable
+      MappedFile(const MappedFile&);
+      MappedFile& operator=(const MappedFile&);
+
+     private:
+      uint8_t* data_;
+      size_t size_;
+  };
+}
+
+#endif /* __EYE_EYE_MMAP_HPP__ */
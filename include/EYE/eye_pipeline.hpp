@@ -0,0 +1,111 @@
+/*
+ * eye_pipeline.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_PIPELINE_HPP__
+#define __EYE_EYE_PIPELINE_HPP__
+
+#include "EYE/eye_dsift.hpp"
+#include "EYE/eye_llc.hpp"
+#include "EYE/eye_spm.hpp"
+#include "EYE/eye_workspace.hpp"
+
+#include <stdint.h>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+namespace EYE
+{
+  using std::vector;
+  using boost::shared_ptr;
+
+  // From a gray image to its SPM code: DSift -> LLC -> SPM max pooling.
+  // The frames are encoded to sparse codes which are pooled directly, so
+  // the num_frame * num_base code matrix is never built. All the buffers
+  // are kept between two images and the stages take their scratch from one
+  // workspace, so that an image of a size already seen is processed
+  // without heap allocations.
+  class Pipeline
+  {
+     public:
+      Pipeline();
+      ~Pipeline();
+
+      // configure the stages before SetUp(), the base of the LLC must be set
+      inline DSift& get_dsift()
+      {
+        return dsift_;
+      }
+      inline LLC& get_llc()
+      {
+        return llc_;
+      }
+      inline SPM& get_spm()
+      {
+        return spm_;
+      }
+
+      Status SetUp(const uint32_t width, const uint32_t height);
+      void Clear();
+
+      // carry the descriptors as uint8 from DSift to the LLC search
+      inline void set_quantized(const bool quantized)
+      {
+        quantized_ = quantized;
+      }
+      inline bool get_quantized() const
+      {
+        return quantized_;
+      }
+
+      // workspace of the calling thread given to the three stages, NULL
+      // for the one of the pipeline
+      void set_workspace(Workspace* const workspace);
+      inline Workspace* get_workspace()
+      {
+        return (workspace_ == NULL ? &own_workspace_ : workspace_);
+      }
+
+      // length of the spm code: total number of blocks * number of bases
+      inline uint32_t get_code_len() const
+      {
+        return spm_.get_total_num_blk() * llc_.get_num_base();
+      }
+
+     public:
+      // the image size may change between calls, the per-size state of
+      // DSift and SPM is then rebuilt. The status is the one of the first
+      // stage which fails, the pipeline can go on with the next image.
+      Status Process(const float* gray_img, const uint32_t width,
+                     const uint32_t height,
+                     shared_ptr<float>* const spm_code);
+      // !Note: Must allocate get_code_len() floats outside
+      Status Process(const float* gray_img, const uint32_t width,
+                     const uint32_t height, float* const spm_code);
+
+     private:
+      DSift dsift_;
+      LLC llc_;
+      SPM spm_;
+
+      uint32_t width_;
+      uint32_t height_;
+      bool quantized_;
+      bool has_setup_;
+
+      Workspace* workspace_;
+      Workspace own_workspace_;
+
+      // per image state, reused
+      vector<VlDsiftKeypoint> frames_;
+      vector<float> descrs_;
+      vector<uint8_t> descrs_u8_;
+      vector<float> pos_;
+      SparseCode codes_;
+  };
+}
+
+#endif /* __EYE_EYE_PIPELINE_HPP__ */
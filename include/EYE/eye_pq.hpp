@@ -0,0 +1,119 @@
+/*
+ * eye_pq.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_PQ_HPP__
+#define __EYE_EYE_PQ_HPP__
+
+#include "EYE/eye_codebook.hpp"
+#include "EYE/eye_workspace.hpp"
+
+#include <vl/generic.h>
+
+#include <stdint.h>
+#include <vector>
+
+namespace EYE
+{
+  using std::vector;
+
+  // Product quantization index over a base. The space is split into M
+  // subspaces of dim / M dimensions, each quantized with up to 256
+  // centroids trained by a CodeBook, so that every base vector is coded on
+  // M bytes. A query builds the table of its distances to all the
+  // centroids (M * 256 floats, in L1), scans the codes with table lookups,
+  // and re-ranks the max_comp best candidates with exact L2 distances.
+  class PQIndex
+  {
+     public:
+      PQIndex();
+      ~PQIndex();
+
+      // train the quantizers on the base and code it. The base is not
+      // copied, it must stay alive until Clear()
+      Status SetUp(const float* const base, const uint32_t dim,
+                   const uint32_t num_base);
+      void Clear();
+
+      // index and dist are num_query * num_knn, sorted by increasing
+      // distance for each query. dist can be NULL. The tables and the heaps
+      // of the threads are taken from the workspace of the calling thread,
+      // or from the heap without one.
+      Status Search(const float* const query, const uint32_t num_query,
+                    const uint32_t num_knn, const uint32_t max_comp,
+                    vl_uint32* const index, float* const dist,
+                    Workspace* const workspace = NULL) const;
+      // the same on this number of threads instead of get_num_threads()
+      Status Search(const float* const query, const uint32_t num_query,
+                    const uint32_t num_knn, const uint32_t max_comp,
+                    vl_uint32* const index, float* const dist,
+                    Workspace* const workspace,
+                    const uint32_t threads) const;
+
+
+     public:
+      // dim must be a multiple of it
+      inline void set_num_subspaces(const uint32_t num_subspaces)
+      {
+        num_subspaces_ = (num_subspaces == 0 ? 1 : num_subspaces);
+      }
+      inline void set_num_threads(const uint32_t num_threads)
+      {
+        num_threads_ = num_threads;
+        trainer_.set_num_threads(num_threads);
+      }
+      // the k-means of the subspaces, configure it before SetUp()
+      inline CodeBook& get_trainer()
+      {
+        return trainer_;
+      }
+
+      inline uint32_t get_num_subspaces() const
+      {
+        return num_subspaces_;
+      }
+      inline uint32_t get_num_threads() const
+      {
+        return num_threads_;
+      }
+      inline uint32_t get_num_centroids() const
+      {
+        return num_centroids_;
+      }
+      inline const uint8_t* get_codes() const
+      {
+        return codes_.empty() ? NULL : &codes_[0];
+      }
+
+     public:
+      enum
+      {
+        MAX_NUM_CENTROIDS = 256,
+        DEFAULT_NUM_SUBSPACES = 8,
+        DEFAULT_TRAIN_ITER = 25,
+        DEFAULT_NUM_THREADS = 1,
+      };
+
+     private:
+      const float* base_;
+      uint32_t dim_;
+      uint32_t num_base_;
+      uint32_t sub_dim_;
+      uint32_t num_centroids_;
+
+      // M * num_centroids_ * sub_dim_ centroids, num_base_ * M codes
+      vector<float> centroids_;
+      vector<uint8_t> codes_;
+
+      CodeBook trainer_;
+
+      // param
+      uint32_t num_subspaces_;
+      uint32_t num_threads_;
+  };
+}
+
+#endif /* __EYE_EYE_PQ_HPP__ */
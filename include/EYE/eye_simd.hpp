@@ -0,0 +1,44 @@
+/*
+ * eye_simd.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_SIMD_HPP__
+#define __EYE_EYE_SIMD_HPP__
+
+#include <stdint.h>
+
+namespace EYE
+{
+  // instruction sets picked at run time for the vector kernels
+  enum SimdLevel
+  {
+    SIMD_NONE = 0,
+    SIMD_SSE,
+    SIMD_AVX2,
+    SIMD_AVX512,
+  };
+
+  SimdLevel get_simd_level();
+  const char* get_simd_name(const SimdLevel level);
+
+  // pooling kernels over n contiguous floats
+  // out[i] = max(out[i], in[i])
+  void vec_max(float* const out, const float* const in, const uint32_t n);
+  // out[i] += in[i]
+  void vec_add(float* const out, const float* const in, const uint32_t n);
+  // out[i] *= scale
+  void vec_scale(float* const out, const float scale, const uint32_t n);
+  // out[i] += a * in[i], the product is rounded before the sum on every
+  // instruction set, as in plain C
+  void vec_axpy(float* const out, const float a, const float* const in,
+                const uint32_t n);
+
+  // exact integer dot product of two uint8 vectors, n <= 65536
+  uint32_t dot_u8(const uint8_t* const a, const uint8_t* const b,
+                  const uint32_t n);
+}
+
+#endif /* __EYE_EYE_SIMD_HPP__ */
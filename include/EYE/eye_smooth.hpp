@@ -0,0 +1,74 @@
+/*
+ * eye_smooth.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_SMOOTH_HPP__
+#define __EYE_EYE_SMOOTH_HPP__
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+namespace EYE
+{
+  using std::vector;
+
+  // the sampled gaussian of vl_imsmooth_f, 2 * ceil(3 * sigma) + 1 taps of
+  // sum 1. A null sigma gives the identity.
+  void get_gaussian_kernel(const float sigma, vector<float>* kernel);
+
+  // convolution of a width x height image, whose rows are stride bytes
+  // apart, by a symmetric kernel of 2 * radius + 1 taps along the columns
+  // and then along the rows, padded by continuity. The sums run in the
+  // order of vl_imconvcol_vf, so the result is the one of vl_imsmooth_f
+  // with this kernel. out holds width * height floats and buffer
+  // get_separable_buffer_size() floats.
+  void smooth_separable(float* const out, const float* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float* const kernel,
+                        const uint32_t radius, float* const buffer);
+  void smooth_separable(float* const out, const uint8_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float* const kernel,
+                        const uint32_t radius, float* const buffer);
+  void smooth_separable(float* const out, const uint16_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float* const kernel,
+                        const uint32_t radius, float* const buffer);
+
+  // the 4th order approximation of the gaussian of Deriche, run forward
+  // and backward along the columns and then along the rows, padded by
+  // continuity. Its impulse response is within 0.1% of the peak of the
+  // gaussian for sigma from 0.6 to 8. buffer holds
+  // get_recursive_buffer_size() floats.
+  void smooth_recursive(float* const out, const float* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float sigma,
+                        float* const buffer);
+  void smooth_recursive(float* const out, const uint8_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float sigma,
+                        float* const buffer);
+  void smooth_recursive(float* const out, const uint16_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float sigma,
+                        float* const buffer);
+
+  inline size_t get_separable_buffer_size(const uint32_t width,
+                                          const uint32_t radius)
+  {
+    // a row padded on both sides
+    return (size_t) width + 2 * radius;
+  }
+  inline size_t get_recursive_buffer_size(const uint32_t width,
+                                          const uint32_t height)
+  {
+    // the image between the passes
+    return (size_t) width * height;
+  }
+}
+
+#endif /* __EYE_EYE_SMOOTH_HPP__ */
@@ -8,12 +8,13 @@
 #ifndef __EYE_EYE_SPM_HPP__
 #define __EYE_EYE_SPM_HPP__
 
+#include "EYE/eye_status.hpp"
+#include "EYE/eye_workspace.hpp"
+
 #include <stdint.h>
 #include <vector>
-#include <map>
 #include <boost/shared_ptr.hpp>
 using std::vector;
-using std::map;
 using std::pair;
 using boost::shared_ptr;
 
@@ -21,9 +22,17 @@ namespace EYE
 {
   class SPM
   {
+     public:
+      enum PoolMethod
+      {
+        POOL_MAX = 0,
+        POOL_SUM,
+        POOL_AVG,
+      };
+
      public:
       SPM();
-      void SetUp(const uint32_t width, const uint32_t height);
+      Status SetUp(const uint32_t width, const uint32_t height);
 
      public:
       // accessing data
@@ -40,6 +49,12 @@ namespace EYE
         same_geom_ = same;
       }
 
+      // used by Pooling(), MaxPooling() always takes the max
+      void set_pool_method(const PoolMethod method)
+      {
+        pool_method_ = method;
+      }
+
       uint32_t get_num_spm_level() const
       {
         return num_spm_level_;
@@ -50,39 +65,93 @@ namespace EYE
         return same_geom_;
       }
 
+      PoolMethod get_pool_method() const
+      {
+        return pool_method_;
+      }
+
+      // workspace of the calling thread for the counters of the pooling,
+      // NULL for the one of the SPM
+      void set_workspace(Workspace* const workspace)
+      {
+        workspace_ = workspace;
+      }
+
+      Workspace* get_workspace()
+      {
+        return (workspace_ == NULL ? &own_workspace_ : workspace_);
+      }
+
       uint32_t get_total_num_blk() const
       {
         return total_num_blk_;
       }
 
-      const map<uint32_t, vector<uint32_t> >& get_map_cell_blks() const
+      uint32_t get_finest_num_blk() const
       {
-        return map_cell_blk_;
+        return finest_num_blk_;
       }
-      const map<uint32_t, vector<uint32_t> >& get_map_blk_cells() const
+
+      // index of a block in the spm code
+      uint32_t get_block_start_idx(const uint32_t level, const uint32_t yidx,
+                                   const uint32_t xidx) const;
+
+      // block of each descriptor at the finest level, row major
+      const vector<uint16_t>& get_cell_blk() const
       {
-        return map_blk_cell_;
+        return cell_blk_;
       }
 
      public:
-      void MaxPooling(const float* const data, const uint32_t feat_dim,
-                      const uint32_t num_data, const float* const pos,
-                      float* const spm_code);
-      void MaxPooling(const float* const data, const uint32_t feat_dim,
-                      const uint32_t num_data, const float* const pos,
-                      shared_ptr<float>* const spm_code);
-      void build_cell_blk_map(const float* const pos, const uint32_t num_data);
+      Status MaxPooling(const float* const data, const uint32_t feat_dim,
+                        const uint32_t num_data, const float* const pos,
+                        float* const spm_code);
+      Status MaxPooling(const float* const data, const uint32_t feat_dim,
+                        const uint32_t num_data, const float* const pos,
+                        shared_ptr<float>* const spm_code);
+      // max pooling of sparse codes given as num_knn (index, weight) pairs
+      // per descriptor, e.g. LLC::Encode_sparse(). The absent entries count
+      // as zeros, so the result equals the pooling of the dense codes.
+      Status MaxPooling(const uint32_t* const index, const float* const weight,
+                        const uint32_t num_knn, const uint32_t feat_dim,
+                        const uint32_t num_data, const float* const pos,
+                        float* const spm_code);
+      Status Pooling(const float* const data, const uint32_t feat_dim,
+                     const uint32_t num_data, const float* const pos,
+                     float* const spm_code);
+      Status Pooling(const float* const data, const uint32_t feat_dim,
+                     const uint32_t num_data, const float* const pos,
+                     shared_ptr<float>* const spm_code);
+      Status build_cell_blk_map(const float* const pos,
+                                const uint32_t num_data);
+      // pool the coarser levels of spm_code, whose finest blocks already
+      // hold the pooled codes of the descriptors given to the last
+      // build_cell_blk_map()
+      Status PoolPyramid(const PoolMethod method, const uint32_t feat_dim,
+                         float* const spm_code);
      private:
       void init_with_default_parameter();
-      uint32_t get_block_start_idx(const uint32_t level, const uint32_t yidx,
-                                   const uint32_t xidx);
+      Status check_input(const void* const data, const uint32_t feat_dim,
+                         const uint32_t num_data, const float* const pos,
+                         const float* const spm_code) const;
+      Status pool(const float* const data, const uint32_t feat_dim,
+                  const uint32_t num_data, const float* const pos,
+                  const PoolMethod method, float* const spm_code);
+
+      // pool the coarser levels from the finest one, blk_count holds the
+      // number of descriptors of each finest block and gets the ones of
+      // the coarser blocks
+      void pool_pyramid(const PoolMethod method, const uint32_t feat_dim,
+                        uint32_t* const blk_count, float* const spm_code);
 
      public:
 #define DEFAULT_SPM_LEVEL 3
+#define DEFAULT_POOL_METHOD POOL_MAX
 
      private:
       // param
       int num_spm_level_;
+      PoolMethod pool_method_;
 
       uint32_t finest_num_blk_;
       uint32_t total_num_blk_;
@@ -100,10 +169,15 @@ namespace EYE
       // aux data
       vector<uint32_t> level_start_idx_;
 
-      map<uint32_t, vector<uint32_t> > map_cell_blk_;
-      map<uint32_t, vector<uint32_t> > map_blk_cell_;
+      vector<uint16_t> cell_blk_;
+
+      // the counters of a pooling: the number of descriptors falling in
+      // each block, and the number of non-zeros of each entry of the
+      // finest blocks for the sparse codes
+      Workspace* workspace_;
+      Workspace own_workspace_;
 
-      // to save time for map_cell_blk and map_blk_cell
+      // to save time for cell_blk
       bool same_geom_;
       bool has_built_map_;
 
@@ -0,0 +1,57 @@
+/*
+ * eye_status.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_STATUS_HPP__
+#define __EYE_EYE_STATUS_HPP__
+
+namespace EYE
+{
+  // result of the calls which check their input. A call which fails prints
+  // the reason on stderr and returns without touching its outputs, the
+  // object stays usable for the next input. Running out of memory in the
+  // scratch of a call throws std::bad_alloc instead, on the calling thread.
+  enum Status
+  {
+    STATUS_OK = 0,
+    STATUS_NULL_POINTER,      // a required input or output is NULL
+    STATUS_INVALID_ARGUMENT,  // a size or a parameter is out of range
+    STATUS_NOT_SETUP,         // SetUp() was not called or has failed
+    STATUS_SIZE_MISMATCH,     // the input does not match the set up sizes
+    STATUS_UNSUPPORTED,       // the combination of parameters is unsupported
+    STATUS_OUT_OF_MEMORY,     // a codebook read from a file does not fit
+    STATUS_IO_ERROR,          // a file can not be opened, read or written
+    STATUS_BAD_FILE           // a file is corrupted or built for other data
+  };
+
+  inline const char* get_status_string(const Status status)
+  {
+    switch (status)
+    {
+      case STATUS_OK:
+        return "OK";
+      case STATUS_NULL_POINTER:
+        return "NULL pointer";
+      case STATUS_INVALID_ARGUMENT:
+        return "invalid argument";
+      case STATUS_NOT_SETUP:
+        return "not set up";
+      case STATUS_SIZE_MISMATCH:
+        return "size mismatch";
+      case STATUS_UNSUPPORTED:
+        return "unsupported";
+      case STATUS_OUT_OF_MEMORY:
+        return "out of memory";
+      case STATUS_IO_ERROR:
+        return "I/O error";
+      case STATUS_BAD_FILE:
+        return "bad file";
+    }
+    return "unknown status";
+  }
+}
+
+#endif /* __EYE_EYE_STATUS_HPP__ */
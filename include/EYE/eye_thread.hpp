@@ -0,0 +1,99 @@
+/*
+ * eye_thread.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_THREAD_HPP__
+#define __EYE_EYE_THREAD_HPP__
+
+#include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace EYE
+{
+  // number of OpenMP threads to use, 0 means all the available cores
+  inline int get_real_num_threads(const uint32_t num_threads)
+  {
+#ifdef _OPENMP
+    if (num_threads == 0)
+      return omp_get_max_threads();
+    return (int) num_threads;
+#else
+    return 1;
+#endif
+  }
+
+  inline int get_thread_id()
+  {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+  }
+
+  // lock usable from the OpenMP threads as well as from the threads of the
+  // caller
+  class Mutex
+  {
+     public:
+      Mutex()
+      {
+#ifdef _OPENMP
+        omp_init_lock(&lock_);
+#endif
+      }
+      ~Mutex()
+      {
+#ifdef _OPENMP
+        omp_destroy_lock(&lock_);
+#endif
+      }
+
+      inline void lock()
+      {
+#ifdef _OPENMP
+        omp_set_lock(&lock_);
+#endif
+      }
+      inline void unlock()
+      {
+#ifdef _OPENMP
+        omp_unset_lock(&lock_);
+#endif
+      }
+
+     private:
+      // not copyable
+      Mutex(const Mutex&);
+      Mutex& operator=(const Mutex&);
+
+#ifdef _OPENMP
+      omp_lock_t lock_;
+#endif
+  };
+
+  // holds the lock of a Mutex until the end of the scope
+  class ScopedLock
+  {
+     public:
+      explicit ScopedLock(Mutex& mutex)
+          : mutex_(mutex)
+      {
+        mutex_.lock();
+      }
+      ~ScopedLock()
+      {
+        mutex_.unlock();
+      }
+
+     private:
+      Mutex& mutex_;
+  };
+}
+
+#endif /* __EYE_EYE_THREAD_HPP__ */
@@ -0,0 +1,127 @@
+/*
+ * eye_vocab_tree.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_VOCAB_TREE_HPP__
+#define __EYE_EYE_VOCAB_TREE_HPP__
+
+#include "EYE/eye_status.hpp"
+#include "EYE/eye_workspace.hpp"
+
+#include <vl/generic.h>
+
+#include <stdint.h>
+#include <cstdio>
+#include <vector>
+
+namespace EYE
+{
+  using std::vector;
+
+  // Hierarchical codebook from a recursive k-means, built by
+  // CodeBook::GenVocabTree(). The leaves are the words: get_words() is the
+  // base given to the LLC. A query descends the tree keeping the beam_width
+  // closest nodes of each level, the leaves met on the way are the
+  // candidates whose exact L2 distances give the k nearest words. The cost
+  // is about depth * beam_width * branch distances instead of the number
+  // of words.
+  class VocabTree
+  {
+     public:
+      VocabTree();
+      ~VocabTree();
+
+      void Clear();
+
+      // index and dist are num_query * num_knn, sorted by increasing
+      // distance for each query. dist can be NULL. The candidates of the
+      // threads are taken from the workspace of the calling thread, or from
+      // the heap without one.
+      Status Search(const float* const query, const uint32_t num_query,
+                    const uint32_t num_knn, const uint32_t beam_width,
+                    vl_uint32* const index, float* const dist,
+                    Workspace* const workspace = NULL) const;
+      // the same on this number of threads instead of get_num_threads(), for
+      // the callers sharing the tree, e.g. the encoders of LLC
+      Status Search(const float* const query, const uint32_t num_query,
+                    const uint32_t num_knn, const uint32_t beam_width,
+                    vl_uint32* const index, float* const dist,
+                    Workspace* const workspace,
+                    const uint32_t threads) const;
+
+      // building, used by CodeBook::GenVocabTree(). The nodes are numbered
+      // in breadth first order, the root is node 0.
+     public:
+      Status init(const float* const root_center, const uint32_t dim);
+      // append the children of a leaf, first gets the index of the first one
+      Status add_children(const uint32_t parent, const float* const centers,
+                          const uint32_t num, uint32_t* const first);
+      // number the leaves and gather their centers into the words
+      void finish();
+
+     public:
+      static Status save(FILE* output, const VocabTree& tree);
+      // a tree which fails to load is left empty
+      static Status load(FILE* input, VocabTree* tree);
+
+
+     public:
+      inline void set_num_threads(const uint32_t num_threads)
+      {
+        num_threads_ = num_threads;
+      }
+
+      inline uint32_t get_num_threads() const
+      {
+        return num_threads_;
+      }
+      inline uint32_t get_dim() const
+      {
+        return dim_;
+      }
+      inline uint32_t get_num_nodes() const
+      {
+        return num_children_.size();
+      }
+      inline uint32_t get_num_words() const
+      {
+        return words_.size() / (dim_ == 0 ? 1 : dim_);
+      }
+      inline const float* get_words() const
+      {
+        return words_.empty() ? NULL : &words_[0];
+      }
+      inline uint32_t get_depth() const
+      {
+        return depth_;
+      }
+
+     public:
+      enum
+      {
+        DEFAULT_NUM_THREADS = 1,
+      };
+
+     private:
+      uint32_t dim_;
+      uint32_t depth_;
+
+      // per node
+      vector<float> centers_;
+      vector<uint32_t> first_child_;
+      vector<uint32_t> num_children_;
+      vector<uint32_t> level_;
+      // word index of the leaves, the inner nodes are not words
+      vector<uint32_t> word_;
+
+      // centers of the leaves, in word order
+      vector<float> words_;
+
+      uint32_t num_threads_;
+  };
+}
+
+#endif /* __EYE_EYE_VOCAB_TREE_HPP__ */
@@ -0,0 +1,149 @@
+/*
+ * eye_workspace.hpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#ifndef __EYE_EYE_WORKSPACE_HPP__
+#define __EYE_EYE_WORKSPACE_HPP__
+
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+namespace EYE
+{
+  using std::vector;
+
+  // Arena for the temporaries of one thread. Every call of a stage takes
+  // its scratch from the arena and gives it back when it returns, so the
+  // memory reaches the peak of the largest call and is reused afterwards:
+  // once warmed up by one image, processing an image of the same size does
+  // not touch the heap. A workspace belongs to one thread at a time, the
+  // stages which run threads of their own carve a slice for each of them
+  // before starting them. The stages, see their set_workspace(), share it
+  // so that the scratch of DSift, LLC and SPM is the same memory. Nothing
+  // in a workspace outlives a call, so a copy starts empty. Like the
+  // vectors of the stages, the arena throws std::bad_alloc when the heap
+  // is exhausted, which no Status reports.
+  class Workspace
+  {
+     public:
+      // position in the arena, see rewind()
+      struct Marker
+      {
+          Marker()
+              : block(0),
+                offset(0)
+          {
+          }
+
+          size_t block;
+          size_t offset;
+      };
+
+     public:
+      Workspace();
+      Workspace(const Workspace&);
+      ~Workspace();
+      // keeps its own memory
+      Workspace& operator=(const Workspace&);
+
+      // num elements of T, aligned to ALIGN bytes and not initialized. They
+      // stay valid until the workspace is rewound before them.
+      template<typename T>
+      inline T* alloc(const size_t num)
+      {
+        return static_cast<T*>(alloc_bytes(sizeof(T) * num));
+      }
+      void* alloc_bytes(const size_t size);
+
+      inline Marker get_marker() const
+      {
+        Marker marker;
+        marker.block = block_;
+        marker.offset = offset_;
+        return marker;
+      }
+      // give back everything allocated after the marker. Rewound to the
+      // start, the blocks grown during the call are merged into one.
+      void rewind(const Marker& marker);
+      // at least size bytes in one block, to skip the warm up
+      void reserve(const size_t size);
+      // give the memory back to the system
+      void Clear();
+
+      // bytes held
+      inline size_t get_capacity() const
+      {
+        return capacity_;
+      }
+      // largest number of bytes in use at once
+      inline size_t get_peak() const
+      {
+        return peak_;
+      }
+      // number of blocks taken from the heap since the construction
+      inline uint64_t get_num_heap_alloc() const
+      {
+        return num_heap_alloc_;
+      }
+
+     public:
+      enum
+      {
+        ALIGN = 64,
+        MIN_BLOCK_SIZE = 64 * 1024,
+      };
+
+     private:
+      struct Block
+      {
+          char* mem;  // from malloc
+          char* data;  // mem aligned
+          size_t size;
+          size_t used;  // bytes in use when the next block was taken
+      };
+
+      // append a block of at least size bytes after the current one
+      void grow(const size_t size);
+      void free_blocks();
+
+     private:
+      // the blocks after block_ are free
+      vector<Block> blocks_;
+      size_t block_;
+      size_t offset_;
+      // bytes in use in the blocks before block_
+      size_t used_before_;
+
+      size_t capacity_;
+      size_t peak_;
+      uint64_t num_heap_alloc_;
+  };
+
+  // gives back what was allocated from a workspace in a scope
+  class WorkspaceScope
+  {
+     public:
+      explicit WorkspaceScope(Workspace& workspace)
+          : workspace_(workspace),
+            marker_(workspace.get_marker())
+      {
+      }
+      ~WorkspaceScope()
+      {
+        workspace_.rewind(marker_);
+      }
+
+     private:
+      WorkspaceScope(const WorkspaceScope&);
+      WorkspaceScope& operator=(const WorkspaceScope&);
+
+      Workspace& workspace_;
+      const Workspace::Marker marker_;
+  };
+}
+
+#endif /* __EYE_EYE_WORKSPACE_HPP__ */
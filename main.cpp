@@ -14,7 +14,7 @@ int main(int argc, char* argv[])
 
   cerr << "Start Testing" << endl;
   cerr << "1. codebook" << endl << "2. dsift" << endl << "3. LLC" << endl
-       << "4. SPM" << endl;
+       << "4. SPM" << endl << "5. PQ" << endl << "6. LLC solve" << endl;
 
   int sel(0);
   cin >> sel;
@@ -33,6 +33,12 @@ int main(int argc, char* argv[])
     case 4:
       EYE::test_spm(argc, argv);
       break;
+    case 5:
+      EYE::test_pq(argc, argv);
+      break;
+    case 6:
+      EYE::test_llc_solve(argc, argv);
+      break;
     default:
       break;
   }
@@ -6,15 +6,238 @@
  */
 
 #include "EYE/eye_codebook.hpp"
+#include "EYE/eye_knn.hpp"
+#include "EYE/eye_mmap.hpp"
+#include "EYE/eye_thread.hpp"
 
 #include <vl/kmeans.h>
+#include <vl/random.h>
 
+#include <algorithm>
+#include <cfloat>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 
 namespace EYE
 {
+  namespace
+  {
+    const char CODEBOOK_MAGIC[8] = { 'E', 'Y', 'E', 'C', 'B', 'O', 'O', 'K' };
+    const uint32_t CODEBOOK_VERSION = 1;
+    const uint32_t CODEBOOK_ALIGN = 64;
+
+    // header of the binary codebook, the centers start at data_offset
+    struct CodeBookHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t K;
+        uint32_t dim;
+        uint32_t dtype;
+        uint32_t dist_type;
+        uint32_t data_offset;
+        uint64_t checksum;
+        uint8_t reserved[24];
+    };
+    typedef char check_header_size[
+        sizeof(CodeBookHeader) == CODEBOOK_ALIGN ? 1 : -1];
+
+    Status check_header(const CodeBookHeader& header)
+    {
+      if (memcmp(header.magic, CODEBOOK_MAGIC, sizeof(CODEBOOK_MAGIC)) != 0
+          || header.version != CODEBOOK_VERSION)
+      {
+        fprintf(stderr, "Not a binary codebook or unsupported version\n");
+        return STATUS_BAD_FILE;
+      }
+      if (header.dtype != VL_TYPE_FLOAT || header.K == 0 || header.dim == 0
+          || header.data_offset % CODEBOOK_ALIGN != 0
+          || header.data_offset < sizeof(CodeBookHeader))
+      {
+        fprintf(stderr, "Corrupted codebook header\n");
+        return STATUS_BAD_FILE;
+      }
+      return STATUS_OK;
+    }
+
+    struct FreeDeleter
+    {
+        void operator()(float* p) const
+        {
+          free(p);
+        }
+    };
+
+    struct FileStream
+    {
+        FILE* file;
+        long start;
+        uint32_t dim;
+    };
+
+    uint32_t read_file_chunk(float* buf, const uint32_t max_num, void* user)
+    {
+      FileStream* stream = (FileStream*) user;
+      const size_t num = fread(buf, sizeof(float) * stream->dim, max_num,
+                               stream->file);
+      // start over for the next pass
+      if (num == 0)
+        fseek(stream->file, stream->start, SEEK_SET);
+      return num;
+    }
+
+    // Move every center to the mean of its data, weighted with prior[c]
+    // for its current position (prior is NULL for a zero weight), and add
+    // the new counts to prior. The data are grouped by center first so that
+    // each center is summed by one thread in a fixed order: the result does
+    // not depend on the number of threads. hits gets the count per center.
+    void update_centers(const float* data, const uint32_t num,
+                        const uint32_t dim, const uint32_t K,
+                        const vl_uint32* assign, const uint32_t num_threads,
+                        double* prior, float* centers, vector<uint32_t>& hits)
+    {
+      vector<uint32_t> start(K + 1, 0);
+      for (uint32_t i = 0; i < num; ++i)
+        ++start[assign[i] + 1];
+      for (uint32_t c = 0; c < K; ++c)
+        start[c + 1] += start[c];
+
+      vector<uint32_t> order(num);
+      {
+        vector<uint32_t> fill(start.begin(), start.end() - 1);
+        for (uint32_t i = 0; i < num; ++i)
+          order[fill[assign[i]]++] = i;
+      }
+
+      hits.resize(K);
+      const int real_num_threads = get_real_num_threads(num_threads);
+
+#pragma omp parallel if (real_num_threads > 1) num_threads(real_num_threads)
+      {
+        vector<double> acc(dim);
+
+#pragma omp for schedule(dynamic, 16)
+        for (int c = 0; c < (int) K; ++c)
+        {
+          const uint32_t n = start[c + 1] - start[c];
+          hits[c] = n;
+          if (n == 0)
+            continue;
+
+          float* const center = centers + (size_t) c * dim;
+          const double w = (prior == NULL ? 0 : prior[c]);
+          for (uint32_t d = 0; d < dim; ++d)
+            acc[d] = w * center[d];
+
+          for (uint32_t j = start[c]; j < start[c + 1]; ++j)
+          {
+            const float* const x = data + (size_t) order[j] * dim;
+            for (uint32_t d = 0; d < dim; ++d)
+              acc[d] += x[d];
+          }
+
+          for (uint32_t d = 0; d < dim; ++d)
+            center[d] = acc[d] / (w + n);
+          if (prior != NULL)
+            prior[c] += n;
+        }
+      }
+    }
+
+    // the seedings sum the weights over blocks of fixed size, so the
+    // sampling does not depend on the number of threads
+    const uint32_t SEED_BLOCK = 4096;
+
+    inline uint32_t num_seed_blocks(const uint32_t num)
+    {
+      return (num + SEED_BLOCK - 1) / SEED_BLOCK;
+    }
+
+    // min_dist[i] = min(min_dist[i], weight[i] * |x_i - center|^2), and
+    // block_sum gets the sum of min_dist over each block
+    void update_min_dist(const float* data, const float* weight,
+                         const uint32_t num, const uint32_t dim,
+                         const float* center, const uint32_t num_threads,
+                         float* min_dist, double* block_sum)
+    {
+      const int num_blk = num_seed_blocks(num);
+      const int real_num_threads = get_real_num_threads(num_threads);
+
+#pragma omp parallel for if (real_num_threads > 1) num_threads(real_num_threads) schedule(dynamic, 1)
+      for (int b = 0; b < num_blk; ++b)
+      {
+        const uint32_t end = std::min((b + 1) * SEED_BLOCK, num);
+        double sum(0);
+        for (uint32_t i = b * SEED_BLOCK; i < end; ++i)
+        {
+          const float* const x = data + (size_t) i * dim;
+          float d(0);
+          for (uint32_t k = 0; k < dim; ++k)
+            d += (x[k] - center[k]) * (x[k] - center[k]);
+          if (weight != NULL)
+            d *= weight[i];
+          if (d < min_dist[i])
+            min_dist[i] = d;
+          sum += min_dist[i];
+        }
+        block_sum[b] = sum;
+      }
+    }
+
+    // the datum where the cumulated min_dist reaches target
+    uint32_t sample_index(const vector<float>& min_dist,
+                          const vector<double>& block_sum, const double target)
+    {
+      const uint32_t num = min_dist.size();
+      double acc(0);
+      uint32_t last(0);
+      for (uint32_t b = 0; b < block_sum.size(); ++b)
+      {
+        if (block_sum[b] <= 0)
+          continue;
+        if (acc + block_sum[b] <= target)
+        {
+          acc += block_sum[b];
+          last = b;
+          continue;
+        }
+
+        const uint32_t end = std::min((b + 1) * SEED_BLOCK, num);
+        for (uint32_t i = b * SEED_BLOCK; i < end; ++i)
+        {
+          if (min_dist[i] <= 0)
+            continue;
+          acc += min_dist[i];
+          last = i;
+          if (acc > target)
+            return i;
+        }
+        return last;
+      }
+
+      // rounding: the last datum with a positive weight
+      const uint32_t end = std::min((last + 1) * SEED_BLOCK, num);
+      for (uint32_t i = end; i > last * SEED_BLOCK; --i)
+        if (min_dist[i - 1] > 0)
+          return i - 1;
+      return 0;
+    }
+
+    // uniform number in [0, 1) from (seed, round, index), so that the
+    // data can be sampled independently on any thread
+    inline double hash_uniform(const uint32_t seed, const uint32_t round,
+                               const uint32_t index)
+    {
+      uint64_t z = ((uint64_t) seed << 32 | round) * 0x9E3779B97F4A7C15ULL
+          + index;
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      z ^= z >> 31;
+      return (z >> 11) * (1.0 / 9007199254740992.0);
+    }
+  }
+
   CodeBook::CodeBook()
       : kmeans_model_(NULL), has_setup_(false)
   {
@@ -35,6 +258,7 @@ namespace EYE
       vl_kmeans_delete(kmeans_model_);
       kmeans_model_ = NULL;
     }
+    centers_.clear();
 
     has_setup_ = false;
   }
@@ -45,22 +269,34 @@ namespace EYE
     num_kdtrees_ = DEFAULT_NUM_KDTREES;
     max_comp_ = DEFAULT_MAX_COMP;
     dist_type_ = DEFAULT_DIST_COMP;
+    algorithm_ = DEFAULT_KMEANS_ALGORITHM;
+    batch_size_ = DEFAULT_BATCH_SIZE;
+    num_epochs_ = DEFAULT_NUM_EPOCHS;
+    num_threads_ = DEFAULT_NUM_THREADS;
+    seeding_ = DEFAULT_SEEDING;
+    seed_ = DEFAULT_SEED;
+    seed_rounds_ = DEFAULT_SEED_ROUNDS;
   }
 
-  void CodeBook::save(FILE* output, const shared_ptr<float>& cluster,
-                      const uint32_t dim, const uint32_t K)
+  Status CodeBook::save(FILE* output, const shared_ptr<float>& cluster,
+                        const uint32_t dim, const uint32_t K)
   {
     const float* clusters = cluster.get();
-    save(output, clusters, dim, K);
+    return save(output, clusters, dim, K);
   }
 
-  void CodeBook::save(FILE* output, const float* clusters, const uint32_t dim,
-                      const uint32_t K)
+  Status CodeBook::save(FILE* output, const float* clusters,
+                        const uint32_t dim, const uint32_t K)
   {
-    if (clusters == NULL)
+    if (clusters == NULL || output == NULL)
     {
       fprintf(stderr, "Check the clusters\n");
-      exit(-1);
+      return STATUS_NULL_POINTER;
+    }
+    if (dim == 0)
+    {
+      fprintf(stderr, "Check the dim\n");
+      return STATUS_INVALID_ARGUMENT;
     }
 
     fprintf(output, "K:%u dim:%u\n", K, dim);
@@ -70,26 +306,186 @@ namespace EYE
       if ((i + 1) % dim == 0)
         fprintf(output, "\n");
     }
+
+    if (ferror(output))
+    {
+      fprintf(stderr, "Failed to write the codebook\n");
+      return STATUS_IO_ERROR;
+    }
+    return STATUS_OK;
   }
 
-  void CodeBook::load(FILE* input, shared_ptr<float>& _clusters, uint32_t* _dim,
-                      uint32_t* _K)
+  Status CodeBook::load(FILE* input, shared_ptr<float>& _clusters,
+                        uint32_t* _dim, uint32_t* _K)
   {
-
-    fscanf(input, "K:%u dim:%u\n", _K, _dim);
-    const uint32_t K = *_K;
-    const uint32_t dim = *_dim;
+    uint32_t K(0), dim(0);
+    if (input == NULL || fscanf(input, "K:%u dim:%u\n", &K, &dim) != 2)
+    {
+      fprintf(stderr, "Failed to read the codebook header\n");
+      return STATUS_IO_ERROR;
+    }
+    if (K == 0 || dim == 0)
+    {
+      fprintf(stderr, "Corrupted codebook header\n");
+      return STATUS_BAD_FILE;
+    }
 
     float* clusters = (float*) malloc(sizeof(float) * K * dim);
+    if (clusters == NULL)
+    {
+      fprintf(stderr, "Failed to allocate the codebook\n");
+      return STATUS_OUT_OF_MEMORY;
+    }
 
     for (uint32_t i = 0; i < K * dim; ++i)
     {
-      fscanf(input, "%f ", clusters + i);
+      if (fscanf(input, "%f ", clusters + i) != 1)
+      {
+        free(clusters);
+        fprintf(stderr, "Corrupted codebook data\n");
+        return STATUS_BAD_FILE;
+      }
       if ((i + 1) % dim == 0)
         fscanf(input, "\n");
     }
 
+    *_K = K;
+    *_dim = dim;
     _clusters.reset(clusters);
+    return STATUS_OK;
+  }
+
+  Status CodeBook::save_binary(FILE* output, const shared_ptr<float>& cluster,
+                               const uint32_t dim, const uint32_t K,
+                               const VlVectorComparisonType dist_type)
+  {
+    const float* clusters = cluster.get();
+    return save_binary(output, clusters, dim, K, dist_type);
+  }
+
+  Status CodeBook::save_binary(FILE* output, const float* clusters,
+                               const uint32_t dim, const uint32_t K,
+                               const VlVectorComparisonType dist_type)
+  {
+    if (clusters == NULL || output == NULL)
+    {
+      fprintf(stderr, "Check the clusters\n");
+      return STATUS_NULL_POINTER;
+    }
+    // load_binary() rejects an empty codebook
+    if (K == 0 || dim == 0)
+    {
+      fprintf(stderr, "Check the K and the dim\n");
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    const size_t len_data = sizeof(float) * K * dim;
+
+    CodeBookHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CODEBOOK_MAGIC, sizeof(CODEBOOK_MAGIC));
+    header.version = CODEBOOK_VERSION;
+    header.K = K;
+    header.dim = dim;
+    header.dtype = VL_TYPE_FLOAT;
+    header.dist_type = dist_type;
+    header.data_offset = sizeof(CodeBookHeader);
+    header.checksum = fnv1a_checksum(clusters, len_data);
+
+    if (fwrite(&header, sizeof(header), 1, output) != 1
+        || fwrite(clusters, 1, len_data, output) != len_data)
+    {
+      fprintf(stderr, "Failed to write the codebook\n");
+      return STATUS_IO_ERROR;
+    }
+    return STATUS_OK;
+  }
+
+  Status CodeBook::load_binary(FILE* input, shared_ptr<float>& _clusters,
+                               uint32_t* _dim, uint32_t* _K,
+                               VlVectorComparisonType* dist_type)
+  {
+    CodeBookHeader header;
+    if (input == NULL || fread(&header, sizeof(header), 1, input) != 1)
+    {
+      fprintf(stderr, "Failed to read the codebook header\n");
+      return STATUS_IO_ERROR;
+    }
+    const Status status = check_header(header);
+    if (status != STATUS_OK)
+      return status;
+
+    const size_t len_data = sizeof(float) * header.K * header.dim;
+    void* clusters(NULL);
+    if (posix_memalign(&clusters, CODEBOOK_ALIGN, len_data) != 0)
+    {
+      fprintf(stderr, "Failed to allocate the codebook\n");
+      return STATUS_OUT_OF_MEMORY;
+    }
+
+    if (fseek(input, header.data_offset - sizeof(header), SEEK_CUR) != 0
+        || fread(clusters, 1, len_data, input) != len_data
+        || fnv1a_checksum(clusters, len_data) != header.checksum)
+    {
+      free(clusters);
+      fprintf(stderr, "Corrupted codebook data\n");
+      return STATUS_BAD_FILE;
+    }
+
+    *_K = header.K;
+    *_dim = header.dim;
+    if (dist_type != NULL)
+      *dist_type = (VlVectorComparisonType) header.dist_type;
+    _clusters.reset((float*) clusters, FreeDeleter());
+    return STATUS_OK;
+  }
+
+  Status CodeBook::map_binary(const char* filename,
+                              shared_ptr<float>& _clusters, uint32_t* _dim,
+                              uint32_t* _K, VlVectorComparisonType* dist_type,
+                              const bool verify)
+  {
+    shared_ptr<MappedFile> file(new MappedFile);
+    if (filename == NULL || !file->Open(filename))
+    {
+      fprintf(stderr, "Failed to map the codebook %s\n",
+              filename == NULL ? "" : filename);
+      return STATUS_IO_ERROR;
+    }
+    if (file->get_size() < sizeof(CodeBookHeader))
+    {
+      fprintf(stderr, "Truncated codebook %s\n", filename);
+      return STATUS_BAD_FILE;
+    }
+
+    const CodeBookHeader& header = *((const CodeBookHeader*) file->get_data());
+    const Status status = check_header(header);
+    if (status != STATUS_OK)
+      return status;
+
+    const size_t len_data = sizeof(float) * header.K * header.dim;
+    if (file->get_size() < header.data_offset + len_data)
+    {
+      fprintf(stderr, "Truncated codebook %s\n", filename);
+      return STATUS_BAD_FILE;
+    }
+
+    const float* clusters = (const float*) (file->get_data()
+        + header.data_offset);
+    if (verify && fnv1a_checksum(clusters, len_data) != header.checksum)
+    {
+      fprintf(stderr, "Corrupted codebook data %s\n", filename);
+      return STATUS_BAD_FILE;
+    }
+
+    *_K = header.K;
+    *_dim = header.dim;
+    if (dist_type != NULL)
+      *dist_type = (VlVectorComparisonType) header.dist_type;
+
+    // the clusters share the ownership of the mapping
+    _clusters = shared_ptr<float>(file, const_cast<float*>(clusters));
+    return STATUS_OK;
   }
 
   void CodeBook::SetUp()
@@ -98,47 +494,549 @@ namespace EYE
       vl_kmeans_delete(kmeans_model_);
 
     kmeans_model_ = vl_kmeans_new(VL_TYPE_FLOAT, dist_type_);
-    // use the ANN for fast computation
+    // use the ANN for fast computation, unless Elkan is asked for. The
+    // native trainers do not use the model.
     vl_kmeans_set_max_num_iterations(kmeans_model_, max_iter_);
-    vl_kmeans_set_algorithm(kmeans_model_, VlKMeansANN);
+    vl_kmeans_set_algorithm(kmeans_model_,
+                            algorithm_ == KMEANS_ELKAN ?
+                                VlKMeansElkan : VlKMeansANN);
     vl_kmeans_set_num_trees(kmeans_model_, num_kdtrees_);
     vl_kmeans_set_max_num_comparisons(kmeans_model_, max_comp_);
 
     has_setup_ = true;
   }
 
-  void CodeBook::GenKMeans(const shared_ptr<float>& org_data,
-                           const uint32_t num_data, const uint32_t dim,
-                           const uint32_t K)
+  Status CodeBook::GenKMeans(const shared_ptr<float>& org_data,
+                             const uint32_t num_data, const uint32_t dim,
+                             const uint32_t K)
   {
     const float* data = org_data.get();
 
-    GenKMeans(data, num_data, dim, K);
+    return GenKMeans(data, num_data, dim, K);
   }
 
-  void CodeBook::GenKMeans(const float* data, const uint32_t num_data,
-                           const uint32_t dim, const uint32_t K)
+  Status CodeBook::GenKMeans(const float* data, const uint32_t num_data,
+                             const uint32_t dim, const uint32_t K)
   {
     if (data == NULL)
     {
       fprintf(stderr, "NULL pointer for data\n");
-      exit(-1);
+      return STATUS_NULL_POINTER;
+    }
+
+    if (dim == 0 || K == 0)
+    {
+      fprintf(stderr, "Check the dim and K\n");
+      return STATUS_INVALID_ARGUMENT;
     }
 
     if (num_data < K)
     {
       fprintf(stderr, "number of data must be equal or greater than centers\n");
-      exit(-1);
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    const bool native = (algorithm_ == KMEANS_LLOYD
+        || algorithm_ == KMEANS_MINIBATCH);
+    if (native && dist_type_ != VlDistanceL2)
+    {
+      fprintf(stderr, "native k-means only supports the L2 distance\n");
+      return STATUS_UNSUPPORTED;
     }
 
     if (!has_setup_)
       SetUp();
 
-    // initialize centers
-    vl_kmeans_init_centers_with_rand_data(kmeans_model_, data, dim, num_data,
-                                          K);
+    if (native)
+    {
+      seed_centers(data, num_data, dim, K);
+      if (algorithm_ == KMEANS_LLOYD)
+        refine_lloyd(data, num_data, dim, K);
+      else
+        refine_minibatch(data, num_data, dim, K);
+      return STATUS_OK;
+    }
+
+    // initialize centers. k-means|| needs L2, it falls back to the
+    // k-means++ of vlfeat for L1
+    if (seeding_ == SEED_RANDOM || dist_type_ != VlDistanceL2)
+    {
+      vl_rand_seed(vl_get_rand(), seed_);
+      if (seeding_ == SEED_RANDOM)
+        vl_kmeans_init_centers_with_rand_data(kmeans_model_, data, dim,
+                                              num_data, K);
+      else
+        vl_kmeans_init_centers_plus_plus(kmeans_model_, data, dim, num_data,
+                                         K);
+    }
+    else
+    {
+      seed_centers(data, num_data, dim, K);
+      vl_kmeans_set_centers(kmeans_model_, &centers_[0], dim, K);
+    }
+    centers_.clear();
 
     vl_kmeans_refine_centers(kmeans_model_, data, num_data);
+    return STATUS_OK;
   }
-}
 
+  Status CodeBook::GenKMeansStream(FILE* input, const uint32_t dim,
+                                   const uint32_t K)
+  {
+    if (input == NULL)
+    {
+      fprintf(stderr, "NULL pointer for input\n");
+      return STATUS_NULL_POINTER;
+    }
+
+    FileStream stream;
+    stream.file = input;
+    stream.start = ftell(input);
+    stream.dim = dim;
+
+    return GenKMeansStream(read_file_chunk, &stream, dim, K);
+  }
+
+  Status CodeBook::GenKMeansStream(ChunkReader reader, void* user,
+                                   const uint32_t dim, const uint32_t K)
+  {
+    if (reader == NULL)
+    {
+      fprintf(stderr, "NULL pointer for reader\n");
+      return STATUS_NULL_POINTER;
+    }
+    if (dim == 0 || K == 0)
+    {
+      fprintf(stderr, "Check the reader, dim and K\n");
+      return STATUS_INVALID_ARGUMENT;
+    }
+    if (dist_type_ != VlDistanceL2)
+    {
+      fprintf(stderr, "native k-means only supports the L2 distance\n");
+      return STATUS_UNSUPPORTED;
+    }
+
+    // the first chunk also seeds the centers, it needs at least K data
+    const uint32_t first_chunk = std::max(batch_size_, K);
+    vector<float> buf((size_t) first_chunk * dim);
+
+    uint32_t num(0);
+    bool ended(false);
+    while (num < first_chunk && !ended)
+    {
+      const uint32_t n = reader(&buf[(size_t) num * dim], first_chunk - num,
+                                user);
+      num += n;
+      ended = (n == 0);
+    }
+
+    if (num < K)
+    {
+      fprintf(stderr, "number of data must be equal or greater than centers\n");
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    if (!has_setup_)
+      SetUp();
+
+    seed_centers(&buf[0], num, dim, K);
+
+    vector<double> counts(K, 0);
+    minibatch_step(&buf[0], num, dim, K, counts);
+
+    uint32_t epoch = (ended ? 1 : 0);
+    while (epoch < num_epochs_)
+    {
+      const uint32_t n = reader(&buf[0], batch_size_, user);
+      if (n == 0)
+      {
+        ++epoch;
+        continue;
+      }
+      minibatch_step(&buf[0], n, dim, K, counts);
+    }
+    return STATUS_OK;
+  }
+
+  Status CodeBook::GenVocabTree(const float* data, const uint32_t num_data,
+                                const uint32_t dim, const uint32_t branch,
+                                const uint32_t depth, VocabTree* const tree)
+  {
+    if (data == NULL || tree == NULL)
+    {
+      fprintf(stderr, "NULL pointer for data and tree\n");
+      return STATUS_NULL_POINTER;
+    }
+    if (num_data == 0 || dim == 0 || branch < 2 || depth == 0)
+    {
+      fprintf(stderr, "Check the number of data, dim, branch and depth\n");
+      return STATUS_INVALID_ARGUMENT;
+    }
+    if (dist_type_ != VlDistanceL2)
+    {
+      fprintf(stderr, "vocabulary tree only supports the L2 distance\n");
+      return STATUS_UNSUPPORTED;
+    }
+
+    // the root is the mean of all the data
+    {
+      vector<double> mean(dim, 0);
+      for (uint32_t i = 0; i < num_data; ++i)
+        for (uint32_t d = 0; d < dim; ++d)
+          mean[d] += data[(size_t) i * dim + d];
+      vector<float> root(dim);
+      for (uint32_t d = 0; d < dim; ++d)
+        root[d] = mean[d] / num_data;
+      tree->init(&root[0], dim);
+    }
+
+    // data of each node, freed once the node is split
+    vector<vector<uint32_t> > members(1);
+    members[0].resize(num_data);
+    for (uint32_t i = 0; i < num_data; ++i)
+      members[0][i] = i;
+    vector<uint32_t> level(1, 0);
+
+    CodeBook split;
+    split.set_max_iter(max_iter_);
+    split.set_num_kdtrees(num_kdtrees_);
+    split.set_max_comp(max_comp_);
+    split.set_algorithm(algorithm_);
+    split.set_batch_size(batch_size_);
+    split.set_num_threads(num_threads_);
+    split.set_seeding(seeding_);
+    split.set_seed(seed_);
+    split.set_seed_rounds(seed_rounds_);
+
+    ExactKNN knn;
+    knn.set_blocked(true);
+    knn.set_num_threads(num_threads_);
+
+    vector<float> buf;
+    vector<vl_uint32> assign;
+    vector<float> centers;
+
+    // the nodes are appended in breadth first order
+    for (uint32_t node = 0; node < tree->get_num_nodes(); ++node)
+    {
+      vector<uint32_t> member;
+      member.swap(members[node]);
+      const uint32_t num = member.size();
+      if (level[node] >= depth || num < branch)
+        continue;
+
+      buf.resize((size_t) num * dim);
+      for (uint32_t i = 0; i < num; ++i)
+        memcpy(&buf[(size_t) i * dim], data + (size_t) member[i] * dim,
+               sizeof(float) * dim);
+
+      // a failed split leaves no tree rather than a partial one
+      Status status = split.GenKMeans(&buf[0], num, dim, branch);
+      const float* const split_centers = split.get_clusters();
+      assign.resize(num);
+      if (status == STATUS_OK)
+        status = knn.SetUp(split_centers, dim, branch);
+      if (status == STATUS_OK)
+        status = knn.Search(&buf[0], num, 1, &assign[0], NULL);
+      if (status != STATUS_OK)
+      {
+        tree->Clear();
+        return status;
+      }
+
+      // the empty children are dropped
+      vector<uint32_t> child(branch, 0);
+      for (uint32_t i = 0; i < num; ++i)
+        ++child[assign[i]];
+      uint32_t num_child(0);
+      centers.clear();
+      for (uint32_t c = 0; c < branch; ++c)
+      {
+        if (child[c] == 0)
+          continue;
+        centers.insert(centers.end(), split_centers + (size_t) c * dim,
+                       split_centers + (size_t) (c + 1) * dim);
+        child[c] = num_child++;
+      }
+
+      // a node whose data all fall in one child stays a leaf
+      if (num_child < 2)
+        continue;
+
+      uint32_t first(0);
+      tree->add_children(node, &centers[0], num_child, &first);
+      members.resize(first + num_child);
+      level.resize(first + num_child, level[node] + 1);
+      for (uint32_t i = 0; i < num; ++i)
+        members[first + child[assign[i]]].push_back(member[i]);
+    }
+
+    tree->finish();
+    return STATUS_OK;
+  }
+
+
+  void CodeBook::seed_centers(const float* data, const uint32_t num_data,
+                              const uint32_t dim, const uint32_t K)
+  {
+    switch (seeding_)
+    {
+      case SEED_KMEANSPP:
+        init_centers_plus_plus(data, NULL, num_data, dim, K);
+        break;
+      case SEED_KMEANS_PARALLEL:
+        init_centers_parallel(data, num_data, dim, K);
+        break;
+      default:
+        init_centers_with_rand_data(data, num_data, dim, K);
+        break;
+    }
+  }
+
+  void CodeBook::init_centers_with_rand_data(const float* data,
+                                             const uint32_t num_data,
+                                             const uint32_t dim,
+                                             const uint32_t K)
+  {
+    VlRand rand;
+    vl_rand_seed(&rand, seed_);
+
+    // K distinct data
+    vector<bool> picked(num_data, false);
+    centers_.resize((size_t) K * dim);
+    for (uint32_t c = 0; c < K;)
+    {
+      const uint32_t i = vl_rand_uindex(&rand, num_data);
+      if (picked[i])
+        continue;
+      picked[i] = true;
+      memcpy(&centers_[(size_t) c * dim], data + (size_t) i * dim,
+             sizeof(float) * dim);
+      ++c;
+    }
+  }
+
+  void CodeBook::init_centers_plus_plus(const float* data,
+                                        const float* weight,
+                                        const uint32_t num_data,
+                                        const uint32_t dim, const uint32_t K)
+  {
+    VlRand rand;
+    vl_rand_seed(&rand, seed_);
+
+    vector<float> min_dist(num_data);
+    vector<double> block_sum(num_seed_blocks(num_data), 0);
+
+    // the first center is drawn with the weights only
+    for (uint32_t i = 0; i < num_data; ++i)
+    {
+      min_dist[i] = (weight == NULL ? 1 : weight[i]);
+      block_sum[i / SEED_BLOCK] += min_dist[i];
+    }
+
+    centers_.resize((size_t) K * dim);
+    for (uint32_t c = 0; c < K; ++c)
+    {
+      double total(0);
+      for (uint32_t b = 0; b < block_sum.size(); ++b)
+        total += block_sum[b];
+
+      // all the data are taken already
+      const uint32_t i =
+          (total > 0 ?
+              sample_index(min_dist, block_sum, vl_rand_real2(&rand) * total) :
+              vl_rand_uindex(&rand, num_data));
+
+      float* const center = &centers_[(size_t) c * dim];
+      memcpy(center, data + (size_t) i * dim, sizeof(float) * dim);
+
+      if (c == 0)
+        std::fill(min_dist.begin(), min_dist.end(), FLT_MAX);
+      update_min_dist(data, weight, num_data, dim, center, num_threads_,
+                      &min_dist[0], &block_sum[0]);
+    }
+  }
+
+  void CodeBook::init_centers_parallel(const float* data,
+                                       const uint32_t num_data,
+                                       const uint32_t dim, const uint32_t K)
+  {
+    VlRand rand;
+    vl_rand_seed(&rand, seed_);
+
+    const int num_blk = num_seed_blocks(num_data);
+    const int real_num_threads = get_real_num_threads(num_threads_);
+
+    // the candidates, starting with one random datum
+    const float* const first = data
+        + (size_t) vl_rand_uindex(&rand, num_data) * dim;
+    vector<float> cands(first, first + dim);
+
+    vector<float> min_dist(num_data, FLT_MAX);
+    vector<double> block_sum(num_blk, 0);
+    update_min_dist(data, NULL, num_data, dim, &cands[0], num_threads_,
+                    &min_dist[0], &block_sum[0]);
+
+    ExactKNN knn;
+    knn.set_blocked(true);
+    knn.set_num_threads(num_threads_);
+
+    vector<vl_uint32> assign(num_data);
+    vector<float> dist(num_data);
+    vector<vector<uint32_t> > picked(num_blk);
+
+    // each round samples about 2K data with probability ~ D^2
+    const double oversampling = 2.0 * K;
+    for (uint32_t round = 0; round < seed_rounds_; ++round)
+    {
+      double phi(0);
+      for (int b = 0; b < num_blk; ++b)
+        phi += block_sum[b];
+      if (phi <= 0)
+        break;
+
+#pragma omp parallel for if (real_num_threads > 1) num_threads(real_num_threads) schedule(dynamic, 1)
+      for (int b = 0; b < num_blk; ++b)
+      {
+        picked[b].clear();
+        const uint32_t end = std::min((b + 1) * SEED_BLOCK, num_data);
+        for (uint32_t i = b * SEED_BLOCK; i < end; ++i)
+          if (hash_uniform(seed_, round, i) * phi < oversampling * min_dist[i])
+            picked[b].push_back(i);
+      }
+
+      const size_t old_num = cands.size() / dim;
+      for (int b = 0; b < num_blk; ++b)
+        for (uint32_t j = 0; j < picked[b].size(); ++j)
+        {
+          const float* const x = data + (size_t) picked[b][j] * dim;
+          cands.insert(cands.end(), x, x + dim);
+        }
+      const size_t num_new = cands.size() / dim - old_num;
+      if (num_new == 0)
+        continue;
+
+      // distances to the new candidates
+      knn.SetUp(&cands[old_num * dim], dim, num_new);
+      knn.Search(data, num_data, 1, &assign[0], &dist[0]);
+
+#pragma omp parallel for if (real_num_threads > 1) num_threads(real_num_threads) schedule(dynamic, 1)
+      for (int b = 0; b < num_blk; ++b)
+      {
+        const uint32_t end = std::min((b + 1) * SEED_BLOCK, num_data);
+        double sum(0);
+        for (uint32_t i = b * SEED_BLOCK; i < end; ++i)
+        {
+          const float d = std::max(dist[i], 0.0f);
+          if (d < min_dist[i])
+            min_dist[i] = d;
+          sum += min_dist[i];
+        }
+        block_sum[b] = sum;
+      }
+    }
+
+    const uint32_t num_cands = cands.size() / dim;
+    if (num_cands <= K)
+    {
+      // too few candidates, the others are random data
+      centers_.swap(cands);
+      centers_.resize((size_t) K * dim);
+      for (uint32_t c = num_cands; c < K; ++c)
+        memcpy(&centers_[(size_t) c * dim],
+               data + (size_t) vl_rand_uindex(&rand, num_data) * dim,
+               sizeof(float) * dim);
+      return;
+    }
+
+    // weight the candidates by the data closest to them, and recluster
+    // them into K centers with k-means++
+    knn.SetUp(&cands[0], dim, num_cands);
+    knn.Search(data, num_data, 1, &assign[0], NULL);
+
+    vector<float> weight(num_cands, 0);
+    for (uint32_t i = 0; i < num_data; ++i)
+      weight[assign[i]] += 1;
+
+    init_centers_plus_plus(&cands[0], &weight[0], num_cands, dim, K);
+  }
+
+  void CodeBook::refine_lloyd(const float* data, const uint32_t num_data,
+                              const uint32_t dim, const uint32_t K)
+  {
+    ExactKNN knn;
+    knn.set_blocked(true);
+    knn.set_num_threads(num_threads_);
+
+    vector<vl_uint32> assign(num_data, 0);
+    vector<vl_uint32> prev_assign(num_data, K);
+    vector<float> dist(num_data, 0);
+    vector<uint32_t> hits;
+
+    for (uint32_t iter = 0; iter < max_iter_; ++iter)
+    {
+      // assignment with GEMM
+      knn.SetUp(&centers_[0], dim, K);
+      knn.Search(data, num_data, 1, &assign[0], &dist[0]);
+
+      if (assign == prev_assign)
+        break;
+      prev_assign.swap(assign);
+
+      update_centers(data, num_data, dim, K, &prev_assign[0], num_threads_,
+                     NULL, &centers_[0], hits);
+
+      // an empty center takes the data farthest from its own center
+      for (uint32_t c = 0; c < K; ++c)
+      {
+        if (hits[c] > 0)
+          continue;
+        const uint32_t far = std::max_element(dist.begin(), dist.end())
+            - dist.begin();
+        memcpy(&centers_[(size_t) c * dim], data + (size_t) far * dim,
+               sizeof(float) * dim);
+        dist[far] = 0;
+      }
+    }
+  }
+
+  void CodeBook::refine_minibatch(const float* data, const uint32_t num_data,
+                                  const uint32_t dim, const uint32_t K)
+  {
+    VlRand rand;
+    vl_rand_seed(&rand, seed_);
+
+    const uint32_t num = std::min(batch_size_, num_data);
+    vector<float> batch((size_t) num * dim);
+    vector<double> counts(K, 0);
+
+    for (uint32_t iter = 0; iter < max_iter_; ++iter)
+    {
+      for (uint32_t i = 0; i < num; ++i)
+        memcpy(&batch[(size_t) i * dim],
+               data + (size_t) vl_rand_uindex(&rand, num_data) * dim,
+               sizeof(float) * dim);
+
+      minibatch_step(&batch[0], num, dim, K, counts);
+    }
+  }
+
+  void CodeBook::minibatch_step(const float* batch, const uint32_t num,
+                                const uint32_t dim, const uint32_t K,
+                                vector<double>& counts)
+  {
+    ExactKNN knn;
+    knn.set_blocked(true);
+    knn.set_num_threads(num_threads_);
+    knn.SetUp(&centers_[0], dim, K);
+
+    vector<vl_uint32> assign(num);
+    knn.Search(batch, num, 1, &assign[0], NULL);
+
+    // with a per-center learning rate of 1 / count, the sequential
+    // mini-batch updates sum up to a weighted mean
+    vector<uint32_t> hits;
+    update_centers(batch, num, dim, K, &assign[0], num_threads_, &counts[0],
+                   &centers_[0], hits);
+  }
+}
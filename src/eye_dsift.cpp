@@ -6,13 +6,13 @@
  */
 
 #include "EYE/eye_dsift.hpp"
-
-#include <vl/imopv.h>
+#include "EYE/eye_thread.hpp"
 
 #include <mkl.h>
 
 #include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <vector>
 #include <iostream>
@@ -24,13 +24,72 @@ using std::endl;
 
 namespace EYE
 {
+  namespace
+  {
+    // scale, remove the low contrast descriptors, clamp and truncate in a
+    // single pass from the vlfeat buffer to the output. The conversion to
+    // uint8 truncates as well.
+    template<typename T>
+    void write_descriptors(const float* const features,
+                           const VlDsiftKeypoint* const key_points,
+                           const int num_key_pts, const uint32_t dim,
+                           const float contr_thrd, const bool float_desc,
+                           T* const out)
+    {
+      for (int d = 0; d < num_key_pts; ++d)
+      {
+        const float* const f = features + d * dim;
+        T* const o = out + d * dim;
+
+        if ((key_points + d)->norm < contr_thrd)
+        {
+          // remove low contrast
+          memset(o, 0, sizeof(T) * dim);
+        }
+        else if (float_desc)
+        {
+          for (uint32_t j = 0; j < dim; ++j)
+            o[j] = VL_MIN(512.0f * f[j], 255.0);
+        }
+        else
+        {
+          for (uint32_t j = 0; j < dim; ++j)
+            o[j] = (int) VL_MIN(512.0f * f[j], 255.0);
+        }
+      }
+    }
+
+    // the rows of an image are at least its width apart and hold whole
+    // pixels
+    template<typename P>
+    bool check_stride(const uint32_t width, const size_t stride)
+    {
+      if (stride < width * sizeof(P) || stride % sizeof(P) != 0)
+      {
+        cerr << "ERROR: the stride of the image is shorter than its rows or"
+             << " splits a pixel" << endl;
+        return false;
+      }
+      return true;
+    }
+
+    // index of the first row of frames whose top is at row or below
+    inline uint32_t get_frame_row(const int min_y, const int step,
+                                  const uint32_t row)
+    {
+      return std::max(0, (int) row - min_y + step - 1) / step;
+    }
+  }
 
   DSift::DSift()
-      : dsift_model_(NULL),
-        width_(0),
+      : width_(0),
         height_(0),
         has_setup_(false),
-        total_num_patches_(0)
+        total_num_patches_(0),
+        descr_dim_(0),
+        max_radius_(0),
+        band_width_(0),
+        workspace_(NULL)
   {
     init_with_default_parameter();
   }
@@ -44,6 +103,7 @@ namespace EYE
   {
     init_with_default_parameter();
     clear_data();
+    own_workspace_.Clear();
     has_setup_ = false;
   }
 
@@ -65,31 +125,130 @@ namespace EYE
     bound_miny_ = DEFAULT_BOUND_MINY;
     bound_maxx_ = DEFAULT_BOUND_MAXX;
     bound_maxy_ = DEFAULT_BOUND_MAXY;
+
+    num_threads_ = DEFAULT_DSIFT_NUM_THREADS;
+    cache_size_ = DEFAULT_DSIFT_CACHE_SIZE;
+    band_height_ = DEFAULT_DSIFT_BAND_HEIGHT;
+    smooth_method_ = DEFAULT_DSIFT_SMOOTH_METHOD;
   }
 
   void DSift::clear_data()
   {
-    if (dsift_model_ != NULL)
+    for (size_t i = 0; i < dsift_models_.size(); ++i)
+      vl_dsift_delete(dsift_models_[i]);
+    dsift_models_.clear();
+    for (size_t i = 0; i < band_models_.size(); ++i)
+      vl_dsift_delete(band_models_[i]);
+    band_models_.clear();
+    band_heights_.clear();
+    band_width_ = 0;
+    width_ = 0;
+    height_ = 0;
+    kernels_.clear();
+    smooth_order_.clear();
+    cascade_kernels_.clear();
+    max_radius_ = 0;
+
+    for (std::list<Geometry>::iterator it = cache_.begin(); it != cache_.end();
+        ++it)
+      delete_geometry(&(*it));
+    cache_.clear();
+  }
+
+  void DSift::delete_geometry(Geometry* const geom)
+  {
+    for (size_t i = 0; i < geom->dsift_models.size(); ++i)
+      vl_dsift_delete(geom->dsift_models[i]);
+    geom->dsift_models.clear();
+  }
+
+  void DSift::swap_geometry(Geometry* const geom)
+  {
+    std::swap(width_, geom->width);
+    std::swap(height_, geom->height);
+    dsift_models_.swap(geom->dsift_models);
+    off_.swap(geom->off);
+    start_x_.swap(geom->start_x);
+    start_y_.swap(geom->start_y);
+    end_x_.swap(geom->end_x);
+    end_y_.swap(geom->end_y);
+    num_patches_.swap(geom->num_patches);
+    patch_off_.swap(geom->patch_off);
+    std::swap(total_num_patches_, geom->total_num_patches);
+  }
+
+  Status DSift::SetUp(const uint32_t width, const uint32_t height)
+  {
+    if (width == 0 || height == 0)
+    {
+      cerr << "ERROR: empty image" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    const Status status = set_up_parameters();
+    if (status != STATUS_OK)
+      return status;
+
+    use_size(width, height);
+    return STATUS_OK;
+  }
+
+  Status DSift::set_up_parameters()
+  {
+    if (sizes_.empty() || step_ == 0)
+    {
+      cerr << "ERROR: check the sizes and the step" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    // the cached sizes were built with the previous parameters
+    if (!has_setup_)
     {
-      vl_dsift_delete(dsift_model_);
-      dsift_model_ = NULL;
-      width_ = 0;
-      height_ = 0;
+      clear_data();
+      build_kernels();
+      has_setup_ = true;
     }
+    return STATUS_OK;
   }
 
-  void DSift::SetUp(const uint32_t width, const uint32_t height)
+  void DSift::use_size(const uint32_t width, const uint32_t height)
   {
-    if (dsift_model_ != NULL)
-      vl_dsift_delete(dsift_model_);
+    if (!dsift_models_.empty() && width == width_ && height == height_)
+      return;
+
+    std::list<Geometry>::iterator it = cache_.begin();
+    while (it != cache_.end() && (it->width != width || it->height != height))
+      ++it;
+
+    if (it != cache_.end())
+    {
+      // the current size takes the place of the cached one, which becomes
+      // the most recently used
+      swap_geometry(&(*it));
+      cache_.splice(cache_.begin(), cache_, it);
+    }
+    else
+    {
+      if (!dsift_models_.empty())
+      {
+        cache_.push_front(Geometry());
+        swap_geometry(&cache_.front());
+      }
+      build_geometry(width, height);
+    }
+
+    // the current size counts in the cache size
+    while (!cache_.empty() && cache_.size() + 1 > cache_size_)
+    {
+      delete_geometry(&cache_.back());
+      cache_.pop_back();
+    }
+  }
 
+  void DSift::build_geometry(const uint32_t width, const uint32_t height)
+  {
     width_ = width;
     height_ = height;
-    dsift_model_ = vl_dsift_new(width_, height_);
-
-    vl_dsift_set_steps(dsift_model_, step_, step_);
-    vl_dsift_set_window_size(dsift_model_, win_size_);
-    vl_dsift_set_flat_window(dsift_model_, fast_);
 
     // set the aux data
     const int num_sz = sizes_.size();
@@ -99,6 +258,8 @@ namespace EYE
     end_x_.resize(num_sz, 0);
     end_y_.resize(num_sz, 0);
     num_patches_.resize(num_sz, 0);
+    patch_off_.resize(num_sz, 0);
+    dsift_models_.resize(num_sz, NULL);
 
     total_num_patches_ = 0;
     const uint32_t max_sz = *(std::max_element(sizes_.begin(), sizes_.end()));
@@ -111,154 +272,734 @@ namespace EYE
       end_x_[i] = width_ - 1.5 * sz;
       end_y_[i] = height_ - 1.5 * sz;
 
-      const int num_x = std::ceil((end_x_[i] - start_x_[i]) * 1.0 / step_);
-      const int num_y = std::ceil((end_y_[i] - start_y_[i]) * 1.0 / step_);
+      dsift_models_[i] = new_scale_model(i);
 
-      num_patches_[i] = num_x * num_y;
+      // take the exact number from vlfeat, it agrees with
+      // ceil((end - start) / step) for the default bounds
+      num_patches_[i] = vl_dsift_get_keypoint_num(dsift_models_[i]);
 
+      // the output of each size starts after all the previous sizes
+      patch_off_[i] = total_num_patches_;
       total_num_patches_ += num_patches_[i];
     }
+    descr_dim_ = vl_dsift_get_descriptor_size(dsift_models_[0]);
+  }
+
+  void DSift::build_kernels()
+  {
+    // the kernel of vl_imsmooth_f, which allocates it and a buffer at each
+    // call
+    const uint32_t num_sz = sizes_.size();
+    kernels_.resize(num_sz);
+    vector<std::pair<uint32_t, uint32_t> > order(num_sz);
+    for (uint32_t i = 0; i < num_sz; ++i)
+    {
+      get_gaussian_kernel(1.0 * sizes_[i] / magnif_, &kernels_[i]);
+      order[i] = std::make_pair(sizes_[i], i);
+    }
+
+    // the variances add up along the cascade, the kernels between two
+    // sizes are narrower than the ones of the sizes
+    std::sort(order.begin(), order.end());
+    smooth_order_.resize(num_sz);
+    cascade_kernels_.resize(num_sz);
+    float prev_sigma(0);
+    for (uint32_t k = 0; k < num_sz; ++k)
+    {
+      const uint32_t i = order[k].second;
+      const float sigma = 1.0 * sizes_[i] / magnif_;
+      smooth_order_[k] = i;
+      get_gaussian_kernel(std::sqrt(sigma * sigma - prev_sigma * prev_sigma),
+                          &cascade_kernels_[i]);
+      prev_sigma = sigma;
+    }
+
+    max_radius_ = 0;
+    for (uint32_t i = 0; i < num_sz; ++i)
+      max_radius_ = std::max<uint32_t>(max_radius_,
+                                       (kernels_[i].size() - 1) / 2);
+  }
+
+  VlDsiftFilter* DSift::new_scale_model(const uint32_t i) const
+  {
+    VlDsiftFilter* model = new_model(i, width_, height_);
+
+    const int off = off_[i];
+    vl_dsift_set_bounds(model, bound_minx_ + std::max(0, off),
+                        bound_miny_ + std::max(0, off),
+                        std::min((int) width_ - 1, bound_maxx_),
+                        std::min((int) height_ - 1, bound_maxy_));
+
+    return model;
+  }
+
+  VlDsiftFilter* DSift::new_model(const uint32_t i, const uint32_t width,
+                                  const uint32_t height) const
+  {
+    const uint32_t sz = sizes_[i];
+
+    VlDsiftFilter* model = vl_dsift_new(width, height);
+
+    vl_dsift_set_steps(model, step_, step_);
+    vl_dsift_set_window_size(model, win_size_);
+    vl_dsift_set_flat_window(model, fast_);
+
+    VlDsiftDescriptorGeometry geom;
+    geom.numBinX = DEFAULT_NUM_BIN_X;
+    geom.numBinY = DEFAULT_NUM_BIN_Y;
+    geom.numBinT = DEFAULT_NUM_BIN_T;
+    geom.binSizeX = sz;
+    geom.binSizeY = sz;
+    vl_dsift_set_geometry(model, &geom);
+
+    return model;
+  }
+
+  void DSift::get_grid(const uint32_t i, const uint32_t width,
+                       const uint32_t height, FrameGrid* const grid) const
+  {
+    // the bounds of new_scale_model() clamped by vlfeat, and its number of
+    // frames
+    const int sz = sizes_[i];
+    const int max_sz = *(std::max_element(sizes_.begin(), sizes_.end()));
+    const int off = std::floor(1.5 * (max_sz - sz));
+    const int frame_x = (DEFAULT_NUM_BIN_X - 1) * sz;
+    const int frame_y = (DEFAULT_NUM_BIN_Y - 1) * sz;
+
+    grid->min_x = std::max(0, bound_minx_ + std::max(0, off));
+    grid->min_y = std::max(0, bound_miny_ + std::max(0, off));
+    grid->max_x = std::min((int) width - 1, bound_maxx_);
+    const int max_y = std::min((int) height - 1, bound_maxy_);
+
+    const int range_x = grid->max_x - grid->min_x - frame_x;
+    const int range_y = max_y - grid->min_y - frame_y;
+    grid->num_x = (range_x >= 0 ? range_x / step_ + 1 : 0);
+    grid->num_y = (range_y >= 0 ? range_y / step_ + 1 : 0);
+
+    // the bins of a frame reach sz - 1 rows beyond their centers, the
+    // gradient one more and the gaussian its radius. One more row keeps
+    // the one-sided gradient of the border of the band out.
+    const int radius = (kernels_[i].size() - 1) / 2;
+    grid->halo_top = sz + radius + 1;
+    grid->halo_bottom = frame_y + sz + radius + 2;
+
+    const uint32_t rows = (band_height_ - 1) / step_ + 1;
+    grid->band_height = std::min<int64_t>(
+        height,
+        (int64_t) (rows - 1) * step_ + grid->halo_top + grid->halo_bottom);
+  }
+
+  void DSift::reserve_band_models(const uint32_t width,
+                                  const vector<uint32_t>& heights)
+  {
+    band_models_.resize(heights.size(), NULL);
+    band_heights_.resize(heights.size(), 0);
+
+    // vlfeat allocates the gradients of the whole band with the filter,
+    // they are kept for the next image of this size
+    for (size_t i = 0; i < heights.size(); ++i)
+    {
+      if (band_models_[i] != NULL && width == band_width_
+          && heights[i] == band_heights_[i])
+        continue;
+      if (band_models_[i] != NULL)
+        vl_dsift_delete(band_models_[i]);
+      band_models_[i] = new_model(i, width, heights[i]);
+      band_heights_[i] = heights[i];
+    }
+    band_width_ = width;
+  }
+
+  void DSift::reserve_models(const uint32_t num)
+  {
+    const uint32_t num_sz = sizes_.size();
+    while (dsift_models_.size() < num * num_sz)
+      dsift_models_.push_back(new_scale_model(dsift_models_.size() % num_sz));
+  }
+
+  Status DSift::Extract(const float* gray_img, const uint32_t width,
+                        const uint32_t height, vector<VlDsiftKeypoint>* frames,
+                        vector<float>* descrs, uint32_t* dim)
+  {
+    return extract(gray_img, width, height, width * sizeof(float), frames,
+                   descrs, dim);
+  }
+
+  Status DSift::Extract(const float* gray_img, const uint32_t width,
+                        const uint32_t height, vector<VlDsiftKeypoint>* frames,
+                        vector<uint8_t>* descrs, uint32_t* dim)
+  {
+    return extract(gray_img, width, height, width * sizeof(float), frames,
+                   descrs, dim);
+  }
+
+  Status DSift::Extract(const float* gray_img, const uint32_t width,
+                        const uint32_t height, VlDsiftKeypoint* const frames,
+                        float* const descrs)
+  {
+    return extract(gray_img, width, height, width * sizeof(float), frames,
+                   descrs);
+  }
+
+  Status DSift::Extract(const float* gray_img, const uint32_t width,
+                        const uint32_t height, VlDsiftKeypoint* const frames,
+                        uint8_t* const descrs)
+  {
+    return extract(gray_img, width, height, width * sizeof(float), frames,
+                   descrs);
+  }
+
+  Status DSift::Extract(const uint8_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        vector<VlDsiftKeypoint>* frames,
+                        vector<float>* descrs, uint32_t* dim)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs, dim);
+  }
+
+  Status DSift::Extract(const uint8_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        vector<VlDsiftKeypoint>* frames,
+                        vector<uint8_t>* descrs, uint32_t* dim)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs, dim);
+  }
+
+  Status DSift::Extract(const uint8_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        VlDsiftKeypoint* const frames, float* const descrs)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs);
+  }
+
+  Status DSift::Extract(const uint8_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        VlDsiftKeypoint* const frames, uint8_t* const descrs)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs);
+  }
+
+  Status DSift::Extract(const uint16_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        vector<VlDsiftKeypoint>* frames,
+                        vector<float>* descrs, uint32_t* dim)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs, dim);
+  }
+
+  Status DSift::Extract(const uint16_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        vector<VlDsiftKeypoint>* frames,
+                        vector<uint8_t>* descrs, uint32_t* dim)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs, dim);
+  }
+
+  Status DSift::Extract(const uint16_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        VlDsiftKeypoint* const frames, float* const descrs)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs);
+  }
+
+  Status DSift::Extract(const uint16_t* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        VlDsiftKeypoint* const frames, uint8_t* const descrs)
+  {
+    return extract(gray_img, width, height, stride, frames, descrs);
+  }
+
+  Status DSift::Extract_batch(const float* const* gray_imgs,
+                              const uint32_t num_img, const uint32_t width,
+                              const uint32_t height,
+                              vector<VlDsiftKeypoint>* frames,
+                              vector<float>* descrs, vector<uint32_t>* offsets,
+                              uint32_t* dim)
+  {
+    return extract_batch(gray_imgs, num_img, width, height, frames, descrs,
+                         offsets, dim);
+  }
+
+  Status DSift::Extract_batch(const float* const* gray_imgs,
+                              const uint32_t num_img, const uint32_t width,
+                              const uint32_t height,
+                              vector<VlDsiftKeypoint>* frames,
+                              vector<uint8_t>* descrs,
+                              vector<uint32_t>* offsets, uint32_t* dim)
+  {
+    return extract_batch(gray_imgs, num_img, width, height, frames, descrs,
+                         offsets, dim);
+  }
+
+  Status DSift::Extract_batch(const float* gray_imgs, const uint32_t num_img,
+                              const uint32_t width, const uint32_t height,
+                              vector<VlDsiftKeypoint>* frames,
+                              vector<float>* descrs, vector<uint32_t>* offsets,
+                              uint32_t* dim)
+  {
+    vector<const float*> imgs(num_img, gray_imgs);
+    for (uint32_t n = 0; gray_imgs != NULL && n < num_img; ++n)
+      imgs[n] = gray_imgs + (size_t) n * width * height;
+
+    return extract_batch(num_img == 0 ? NULL : &imgs[0], num_img, width,
+                         height, frames, descrs, offsets, dim);
+  }
+
+  Status DSift::Extract_batch(const float* gray_imgs, const uint32_t num_img,
+                              const uint32_t width, const uint32_t height,
+                              vector<VlDsiftKeypoint>* frames,
+                              vector<uint8_t>* descrs,
+                              vector<uint32_t>* offsets, uint32_t* dim)
+  {
+    vector<const float*> imgs(num_img, gray_imgs);
+    for (uint32_t n = 0; gray_imgs != NULL && n < num_img; ++n)
+      imgs[n] = gray_imgs + (size_t) n * width * height;
+
+    return extract_batch(num_img == 0 ? NULL : &imgs[0], num_img, width,
+                         height, frames, descrs, offsets, dim);
+  }
+
+  Status DSift::Extract_tiled(const float* gray_img, const uint32_t width,
+                              const uint32_t height, FloatSink sink,
+                              void* user)
+  {
+    return extract_tiled<float>(gray_img, width, height, sink, user);
+  }
+
+  Status DSift::Extract_tiled(const float* gray_img, const uint32_t width,
+                              const uint32_t height, ByteSink sink,
+                              void* user)
+  {
+    return extract_tiled<uint8_t>(gray_img, width, height, sink, user);
+  }
+
+  Status DSift::check_input(const void* gray_img, const uint32_t width,
+                            const uint32_t height) const
+  {
+    if (gray_img == NULL)
+    {
+      cerr << "NULL pointer for image" << endl;
+      return STATUS_NULL_POINTER;
+    }
+
+    if (!has_setup_)
+    {
+      cerr << "ERROR: Must call SetUp() before." << endl;
+      return STATUS_NOT_SETUP;
+    }
 
-    has_setup_ = true;
+    if (width == 0 || height == 0)
+    {
+      cerr << "ERROR: empty image" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+    return STATUS_OK;
   }
 
-  void DSift::Extract(const float* gray_img, const uint32_t width,
-                      const uint32_t height, vector<VlDsiftKeypoint>* frames,
-                      vector<float>* descrs, uint32_t* dim)
+  template<typename P, typename T>
+  Status DSift::extract(const P* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        vector<VlDsiftKeypoint>* frames, vector<T>* descrs,
+                        uint32_t* dim)
   {
     if (frames != NULL)
       frames->clear();
 
-    if (descrs == NULL || dim == NULL)
+    if (gray_img == NULL || descrs == NULL || dim == NULL)
     {
-      cerr << "NULL pointer for descriptors and dim" << endl;
-      exit(-1);
+      cerr << "NULL pointer for image, descriptors and dim" << endl;
+      return STATUS_NULL_POINTER;
     }
     descrs->clear();
     *dim = 0;
 
-    const uint32_t max_sz = *(std::max_element(sizes_.begin(), sizes_.end()));
-    const uint32_t len_img = width * height;
+    if (!check_stride<P>(width, stride))
+      return STATUS_INVALID_ARGUMENT;
 
-    if (!has_setup_)
-      SetUp(width, height);
-    else
+    // selects the size when it is cached
+    const Status status = SetUp(width, height);
+    if (status != STATUS_OK)
+      return status;
+
+    // the output is written in place, no more intermediate copies
+    if (frames != NULL)
+      frames->resize(total_num_patches_);
+    descrs->resize(total_num_patches_ * descr_dim_);
+    *dim = descr_dim_;
+
+    if (total_num_patches_ == 0)
+      return STATUS_OK;
+
+    return extract(gray_img, width, height, stride,
+                   (frames == NULL ? NULL : &(*frames)[0]), &(*descrs)[0]);
+  }
+
+  template<typename P, typename T>
+  Status DSift::extract(const P* gray_img, const uint32_t width,
+                        const uint32_t height, const size_t stride,
+                        VlDsiftKeypoint* const frames, T* const descrs)
+  {
+    if (descrs == NULL)
+    {
+      cerr << "NULL pointer for image and descriptors" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    const Status status = check_input(gray_img, width, height);
+    if (status != STATUS_OK)
+      return status;
+    if (!check_stride<P>(width, stride))
+      return STATUS_INVALID_ARGUMENT;
+    // the output was sized for the current size
+    if (width != width_ || height != height_)
+    {
+      cerr << "ERROR: the image is not of the size set up" << endl;
+      return STATUS_SIZE_MISMATCH;
+    }
+
+    const int num_sz = sizes_.size();
+    const int num_threads = std::min(get_real_num_threads(num_threads_),
+                                     num_sz);
+
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    const size_t len_img = (size_t) width_ * height_;
+    const size_t len_smooth = get_smooth_buffer_size(width_, height_,
+                                                     smooth_method_);
+
+    if (smooth_method_ == SMOOTH_CASCADE)
+    {
+      // each size depends on the previous one, they are smoothed here and
+      // described concurrently
+      float* const levels = workspace.alloc<float>(num_sz * len_img);
+      float* const buffer = workspace.alloc<float>(len_smooth);
+      smooth_cascade(gray_img, stride, width_, height_, levels, buffer);
+
+#pragma omp parallel for if (num_threads > 1) num_threads(num_threads) \
+    schedule(dynamic, 1)
+      for (int i = num_sz - 1; i >= 0; --i)
+        describe_size(levels + i * len_img, i, 0, frames, descrs);
+      return STATUS_OK;
+    }
+
+    // a slice of the workspace for each thread
+    const size_t len_buf = len_img + len_smooth;
+    float* const buf = workspace.alloc<float>(num_threads * len_buf);
+
+    // the larger sizes smooth with wider kernels, start them first
+#pragma omp parallel for if (num_threads > 1) num_threads(num_threads) \
+    schedule(dynamic, 1)
+    for (int i = num_sz - 1; i >= 0; --i)
+      extract_size(gray_img, stride, i, 0, buf + get_thread_id() * len_buf,
+                   frames, descrs);
+    return STATUS_OK;
+  }
+
+
+  template<typename T>
+  Status DSift::extract_batch(const float* const* gray_imgs,
+                              const uint32_t num_img, const uint32_t width,
+                              const uint32_t height,
+                              vector<VlDsiftKeypoint>* frames,
+                              vector<T>* descrs, vector<uint32_t>* offsets,
+                              uint32_t* dim)
+  {
+    if (frames != NULL)
+      frames->clear();
+
+    if (gray_imgs == NULL || descrs == NULL || offsets == NULL || dim == NULL)
     {
-      if (width != width_ || height != height_)
+      cerr << "NULL pointer for images, descriptors, offsets and dim" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    descrs->clear();
+    offsets->clear();
+    *dim = 0;
+
+    // every image is checked before any is processed
+    for (uint32_t n = 0; n < num_img; ++n)
+      if (gray_imgs[n] == NULL)
       {
-        cerr << "ERROR: Image size not matching!" << endl;
-        exit(-1);
+        cerr << "NULL pointer for image" << endl;
+        return STATUS_NULL_POINTER;
       }
-    }
 
-    for (size_t i = 0; i < sizes_.size(); ++i)
+    const Status status = SetUp(width, height);
+    if (status != STATUS_OK)
+      return status;
+
+    // every image has the same frames, the output is allocated once
+    const uint32_t num_patches = total_num_patches_;
+    offsets->resize(num_img + 1);
+    for (uint32_t n = 0; n <= num_img; ++n)
+      (*offsets)[n] = n * num_patches;
+    if (frames != NULL)
+      frames->resize((size_t) num_img * num_patches);
+    descrs->resize((size_t) num_img * num_patches * descr_dim_);
+    *dim = descr_dim_;
+
+    if (num_img == 0 || num_patches == 0)
+      return STATUS_OK;
+
+    // small images do not keep the sizes of one image busy, the threads
+    // take whole images with a filter set and a workspace each
+    const int num_sz = sizes_.size();
+    const int num_threads = std::min(get_real_num_threads(num_threads_),
+                                     (int) num_img);
+    reserve_models(num_threads);
+
+    // the cascade keeps every size of the image of a thread
+    const bool cascade = (smooth_method_ == SMOOTH_CASCADE);
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    const size_t len_img = (size_t) width_ * height_;
+    const size_t len_levels = (cascade ? num_sz : 1) * len_img;
+    const size_t len_buf = len_levels
+        + get_smooth_buffer_size(width_, height_, smooth_method_);
+    float* const buf = workspace.alloc<float>(num_threads * len_buf);
+
+#pragma omp parallel for if (num_threads > 1) num_threads(num_threads) \
+    schedule(dynamic, 1)
+    for (int n = 0; n < (int) num_img; ++n)
     {
-      const uint32_t sz = sizes_[i];
+      const int t = get_thread_id();
+      const size_t first = (size_t) n * num_patches;
+      VlDsiftKeypoint* const f = (frames == NULL ? NULL : &(*frames)[first]);
+      T* const d = &(*descrs)[first * descr_dim_];
+      float* const thread_buf = buf + t * len_buf;
 
-      const int off = std::floor(1.5 * (max_sz - sz));
-      vl_dsift_set_bounds(dsift_model_, bound_minx_ + std::max(0, off),
-                          bound_miny_ + std::max(0, off),
-                          std::min((int) width - 1, bound_maxx_),
-                          std::min((int) height - 1, bound_maxy_));
-
-      VlDsiftDescriptorGeometry geom;
-      geom.numBinX = DEFAULT_NUM_BIN_X;
-      geom.numBinY = DEFAULT_NUM_BIN_Y;
-      geom.numBinT = DEFAULT_NUM_BIN_T;
-      geom.binSizeX = sz;
-      geom.binSizeY = sz;
-      vl_dsift_set_geometry(dsift_model_, &geom);
-
-      /*
-       {
-       int stepX;
-       int stepY;
-       int minX;
-       int minY;
-       int maxX;
-       int maxY;
-       vl_bool useFlatWindow;
-
-       int numFrames = vl_dsift_get_keypoint_num(dsift_model_);
-       int descrSize = vl_dsift_get_descriptor_size(dsift_model_);
-       VlDsiftDescriptorGeometry g = *vl_dsift_get_geometry(dsift_model_);
-
-       vl_dsift_get_steps(dsift_model_, &stepY, &stepX);
-       vl_dsift_get_bounds(dsift_model_, &minY, &minX, &maxY, &maxX);
-       useFlatWindow = vl_dsift_get_flat_window(dsift_model_);
-
-       printf(
-       "vl_dsift: bounds:            [minX,minY,maxX,maxY] = [%d, %d, %d, %d]\n",
-       minX + 1, minY + 1, maxX + 1, maxY + 1);
-       printf("vl_dsift: subsampling steps: stepX=%d, stepY=%d\n", stepX,
-       stepY);
-       printf(
-       "vl_dsift: num bins:          [numBinT, numBinX, numBinY] = [%d, %d, %d]\n",
-       g.numBinT, g.numBinX, g.numBinY);
-       printf("vl_dsift: descriptor size:   %d\n", descrSize);
-       printf("vl_dsift: bin sizes:         [binSizeX, binSizeY] = [%d, %d]\n",
-       g.binSizeX, g.binSizeY);
-       printf("vl_dsift: flat window:       %s\n", VL_YESNO(useFlatWindow));
-       printf("vl_dsift: window size:       %g\n",
-       vl_dsift_get_window_size(dsift_model_));
-       printf("vl_dsift: num of features:   %d\n", numFrames);
-       }
-       */
-
-      const float sigma = 1.0 * sz / magnif_;
-      float* smooth_img = (float*) malloc(sizeof(float) * len_img);
-      memset(smooth_img, 0, sizeof(float) * len_img);
-      vl_imsmooth_f(smooth_img, width, gray_img, width, height, width, sigma,
-                    sigma);
-
-      vl_dsift_process(dsift_model_, smooth_img);
-
-      free(smooth_img);
-
-      const int num_key_pts = vl_dsift_get_keypoint_num(dsift_model_);
-      const VlDsiftKeypoint* key_points = vl_dsift_get_keypoints(dsift_model_);
-      *dim = vl_dsift_get_descriptor_size(dsift_model_);
-      const float* features = vl_dsift_get_descriptors(dsift_model_);
-
-      float* f = (float*) malloc(sizeof(float) * num_key_pts * (*dim));
-      cblas_scopy(num_key_pts * (*dim), features, 1, f, 1);
-      cblas_sscal(num_key_pts * (*dim), 512.0f, f, 1);
-
-      for (uint32_t d = 0; d < num_key_pts; ++d)
+      if (cascade)
       {
-        const float norm = (key_points + d)->norm;
-        if (norm < contr_thrd_)
-        {
-          // remove low contrast
-          memset(f + d * (*dim), 0, sizeof(float) * (*dim));
-        }
-        else
-        {
-          for (uint32_t j = d * (*dim); j < (d + 1) * (*dim); ++j)
-          {
-            float tmp = VL_MIN(f[j], 255.0);
-            if (!float_desc_)
-              tmp = (int) tmp;
-            f[j] = tmp;
-          }
-        }
+        smooth_cascade(gray_imgs[n], width * sizeof(float), width_, height_,
+                       thread_buf, thread_buf + len_levels);
+        for (int i = num_sz - 1; i >= 0; --i)
+          describe_size(thread_buf + i * len_img, i, t, f, d);
+        continue;
       }
 
-      if (i == 0)
+      for (int i = num_sz - 1; i >= 0; --i)
+        extract_size(gray_imgs[n], width * sizeof(float), i, t, thread_buf, f,
+                     d);
+    }
+    return STATUS_OK;
+  }
+
+  template<typename T, typename Sink>
+  Status DSift::extract_tiled(const float* gray_img, const uint32_t width,
+                              const uint32_t height, Sink sink, void* user)
+  {
+    if (gray_img == NULL || sink == NULL)
+    {
+      cerr << "NULL pointer for image and sink" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (width == 0 || height == 0)
+    {
+      cerr << "ERROR: empty image" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+    const Status status = set_up_parameters();
+    if (status != STATUS_OK)
+      return status;
+
+    const int num_sz = sizes_.size();
+    const uint32_t dim = DEFAULT_NUM_BIN_X * DEFAULT_NUM_BIN_Y
+        * DEFAULT_NUM_BIN_T;
+
+    vector<FrameGrid> grids(num_sz);
+    vector<uint32_t> heights(num_sz);
+    uint32_t first(0);
+    uint32_t max_height(0);
+    for (int i = 0; i < num_sz; ++i)
+    {
+      get_grid(i, width, height, &grids[i]);
+      grids[i].first = first;
+      first += grids[i].num_x * grids[i].num_y;
+      heights[i] = grids[i].band_height;
+      max_height = std::max(max_height, heights[i]);
+    }
+    reserve_band_models(width, heights);
+
+    const int num_threads = std::min(get_real_num_threads(num_threads_),
+                                     num_sz);
+
+    // the smoothing buffers of the threads and the output of each size for
+    // one band, taken once for all the bands
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    const size_t len_buf = (size_t) width * max_height
+        + get_smooth_buffer_size(width, max_height, SMOOTH_EXACT);
+    float* const buf = workspace.alloc<float>(num_threads * len_buf);
+
+    const uint32_t rows = (band_height_ - 1) / step_ + 1;
+    vector<VlDsiftKeypoint*> band_frames(num_sz);
+    vector<T*> band_descrs(num_sz);
+    vector<uint32_t> first_k(num_sz);
+    vector<uint32_t> end_k(num_sz);
+    for (int i = 0; i < num_sz; ++i)
+    {
+      const size_t num = (size_t) rows * grids[i].num_x;
+      band_frames[i] = workspace.alloc<VlDsiftKeypoint>(num);
+      band_descrs[i] = workspace.alloc<T>(num * dim);
+    }
+
+    for (uint32_t row = 0; row < height; row += band_height_)
+    {
+      const uint32_t end_row = std::min<int64_t>(height,
+                                                 (int64_t) row + band_height_);
+      // rows of frames whose top is in the band
+      for (int i = 0; i < num_sz; ++i)
       {
-        if (frames != NULL)
-          frames->reserve(num_key_pts * sizes_.size());
+        first_k[i] = std::min(
+            grids[i].num_y, get_frame_row(grids[i].min_y, step_, row));
+        end_k[i] = std::min(grids[i].num_y,
+                            get_frame_row(grids[i].min_y, step_, end_row));
+      }
 
-        descrs->reserve(num_key_pts * sizes_.size() * (*dim));
+#pragma omp parallel for if (num_threads > 1) num_threads(num_threads) \
+    schedule(dynamic, 1)
+      for (int i = num_sz - 1; i >= 0; --i)
+        if (grids[i].num_x > 0 && end_k[i] > first_k[i])
+          extract_band(gray_img, width, height, i, grids[i], first_k[i],
+                       end_k[i], buf + get_thread_id() * len_buf,
+                       band_frames[i], band_descrs[i]);
+
+      // the sink runs on the calling thread, size after size
+      for (int i = 0; i < num_sz; ++i)
+      {
+        const uint32_t num = (end_k[i] - first_k[i]) * grids[i].num_x;
+        if (num == 0)
+          continue;
+        if (!sink(i, grids[i].first + first_k[i] * grids[i].num_x,
+                  band_frames[i], band_descrs[i], num, dim, user))
+          return STATUS_OK;
       }
+    }
+    return STATUS_OK;
+  }
 
-      if (frames != NULL)
-        frames->insert(frames->end(), key_points, key_points + num_key_pts);
+  template<typename T>
+  void DSift::extract_band(const float* gray_img, const uint32_t width,
+                           const uint32_t height, const uint32_t i,
+                           const FrameGrid& grid, const uint32_t first_k,
+                           const uint32_t end_k, float* const workspace,
+                           VlDsiftKeypoint* const frames, T* const descrs)
+  {
+    // the rows of the band and its halo, slid back into the image at the
+    // borders so that the filter keeps its height
+    const int top = grid.min_y + first_k * step_;
+    const int bottom = grid.min_y + (end_k - 1) * step_;
+    const int start = std::max(0, std::min(top - grid.halo_top,
+                                           (int) height
+                                               - (int) grid.band_height));
+
+    VlDsiftFilter* const model = band_models_[i];
+    vl_dsift_set_bounds(model, grid.min_x, top - start, grid.max_x,
+                        bottom - start + (DEFAULT_NUM_BIN_Y - 1) * sizes_[i]);
+
+    // the halos are as wide as the exact kernels
+    float* const smooth_img = workspace;
+    smooth(gray_img + (size_t) start * width, width * sizeof(float), width,
+           grid.band_height, i, SMOOTH_EXACT, smooth_img,
+           workspace + (size_t) width * grid.band_height);
+    vl_dsift_process(model, smooth_img);
+
+    const int num_key_pts = vl_dsift_get_keypoint_num(model);
+    const VlDsiftKeypoint* key_points = vl_dsift_get_keypoints(model);
+    const float* features = vl_dsift_get_descriptors(model);
+
+    write_descriptors(features, key_points, num_key_pts,
+                      vl_dsift_get_descriptor_size(model), contr_thrd_,
+                      float_desc_, descrs);
+
+    // back to the coordinates of the image
+    for (int k = 0; k < num_key_pts; ++k)
+    {
+      frames[k] = key_points[k];
+      frames[k].y += start;
+    }
+  }
 
-      descrs->insert(descrs->end(), f, f + num_key_pts * (*dim));
+  size_t DSift::get_smooth_buffer_size(const uint32_t width,
+                                       const uint32_t height,
+                                       const SmoothMethod method) const
+  {
+    if (method == SMOOTH_RECURSIVE)
+      return get_recursive_buffer_size(width, height);
+    return get_separable_buffer_size(width, max_radius_);
+  }
 
-      free(f);
+  template<typename P>
+  void DSift::smooth(const P* gray_img, const size_t stride,
+                     const uint32_t width, const uint32_t height,
+                     const uint32_t i, const SmoothMethod method,
+                     float* const out, float* const buffer) const
+  {
+    if (method == SMOOTH_RECURSIVE)
+    {
+      smooth_recursive(out, gray_img, stride, width, height,
+                       1.0 * sizes_[i] / magnif_, buffer);
+      return;
     }
+
+    // the two passes of vl_imsmooth_f, the same sums in the same order
+    const vector<float>& kernel = kernels_[i];
+    smooth_separable(out, gray_img, stride, width, height, &kernel[0],
+                     (kernel.size() - 1) / 2, buffer);
   }
-}
 
+  template<typename P>
+  void DSift::smooth_cascade(const P* gray_img, const size_t stride,
+                             const uint32_t width, const uint32_t height,
+                             float* const levels, float* const buffer) const
+  {
+    const size_t len_img = (size_t) width * height;
+    const float* prev(NULL);
+    for (size_t k = 0; k < smooth_order_.size(); ++k)
+    {
+      const uint32_t i = smooth_order_[k];
+      const vector<float>& kernel = cascade_kernels_[i];
+      const uint32_t radius = (kernel.size() - 1) / 2;
+      float* const out = levels + i * len_img;
+      if (prev == NULL)
+        smooth_separable(out, gray_img, stride, width, height, &kernel[0],
+                         radius, buffer);
+      else
+        smooth_separable(out, prev, width * sizeof(float), width, height,
+                         &kernel[0], radius, buffer);
+      prev = out;
+    }
+  }
+
+  template<typename P, typename T>
+  void DSift::extract_size(const P* gray_img, const size_t stride,
+                           const uint32_t i, const uint32_t set,
+                           float* const workspace,
+                           VlDsiftKeypoint* const frames, T* const descrs)
+  {
+    float* const smooth_img = workspace;
+    smooth(gray_img, stride, width_, height_, i, smooth_method_, smooth_img,
+           workspace + (size_t) width_ * height_);
+    describe_size(smooth_img, i, set, frames, descrs);
+  }
+
+  template<typename T>
+  void DSift::describe_size(const float* smooth_img, const uint32_t i,
+                            const uint32_t set, VlDsiftKeypoint* const frames,
+                            T* const descrs)
+  {
+    VlDsiftFilter* const model = dsift_models_[set * sizes_.size() + i];
+    vl_dsift_process(model, smooth_img);
+
+    const int num_key_pts = vl_dsift_get_keypoint_num(model);
+    const VlDsiftKeypoint* key_points = vl_dsift_get_keypoints(model);
+    const float* features = vl_dsift_get_descriptors(model);
+
+    write_descriptors(features, key_points, num_key_pts, descr_dim_,
+                      contr_thrd_, float_desc_,
+                      descrs + patch_off_[i] * descr_dim_);
+
+    if (frames != NULL)
+      memcpy(frames + patch_off_[i], key_points,
+             sizeof(VlDsiftKeypoint) * num_key_pts);
+  }
+}
@@ -0,0 +1,322 @@
+/*
+ * eye_knn.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_knn.hpp"
+#include "EYE/eye_simd.hpp"
+#include "EYE/eye_thread.hpp"
+
+#include <mkl.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+
+namespace EYE
+{
+  namespace
+  {
+    // insert (d, idx) into the sorted top-k list of one query
+    inline void push_neighbor(float* const best_dist, vl_uint32* const best_idx,
+                              const uint32_t num_knn, const float d,
+                              const vl_uint32 idx)
+    {
+      int pos = num_knn - 1;
+      while (pos > 0 && best_dist[pos - 1] > d)
+      {
+        best_dist[pos] = best_dist[pos - 1];
+        best_idx[pos] = best_idx[pos - 1];
+        --pos;
+      }
+      best_dist[pos] = d;
+      best_idx[pos] = idx;
+    }
+  }
+
+  ExactKNN::ExactKNN()
+      : base_(NULL),
+        base_u8_(NULL),
+        dim_(0),
+        num_base_(0)
+  {
+    init_with_default_parameter();
+  }
+
+  ExactKNN::~ExactKNN()
+  {
+    Clear();
+  }
+
+  void ExactKNN::init_with_default_parameter()
+  {
+    blocked_ = false;
+    query_block_ = DEFAULT_QUERY_BLOCK;
+    cache_size_ = DEFAULT_CACHE_SIZE;
+    num_threads_ = DEFAULT_NUM_THREADS;
+  }
+
+  void ExactKNN::Clear()
+  {
+    base_ = NULL;
+    base_u8_ = NULL;
+    dim_ = 0;
+    num_base_ = 0;
+    base_norm_.clear();
+    base_norm_u8_.clear();
+  }
+
+  Status ExactKNN::SetUp(const float* const base, const uint32_t dim,
+                         const uint32_t num_base)
+  {
+    if (base == NULL || dim == 0 || num_base == 0)
+    {
+      cerr << "ERROR in ExactKNN::SetUp" << endl;
+      return (base == NULL ? STATUS_NULL_POINTER : STATUS_INVALID_ARGUMENT);
+    }
+
+    Clear();
+    base_ = base;
+    dim_ = dim;
+    num_base_ = num_base;
+
+    base_norm_.resize(num_base_);
+    for (uint32_t i = 0; i < num_base_; ++i)
+      base_norm_[i] = cblas_sdot(dim_, base_ + (size_t) i * dim_, 1,
+                                 base_ + (size_t) i * dim_, 1);
+    return STATUS_OK;
+  }
+
+  Status ExactKNN::SetUp(const uint8_t* const base, const uint32_t dim,
+                         const uint32_t num_base)
+  {
+    if (base == NULL || dim == 0 || dim > 65536 || num_base == 0)
+    {
+      cerr << "ERROR in ExactKNN::SetUp" << endl;
+      return (base == NULL ? STATUS_NULL_POINTER : STATUS_INVALID_ARGUMENT);
+    }
+
+    Clear();
+    base_u8_ = base;
+    dim_ = dim;
+    num_base_ = num_base;
+
+    base_norm_u8_.resize(num_base_);
+    for (uint32_t i = 0; i < num_base_; ++i)
+      base_norm_u8_[i] = dot_u8(base_u8_ + (size_t) i * dim_,
+                                base_u8_ + (size_t) i * dim_, dim_);
+    return STATUS_OK;
+  }
+
+  Status ExactKNN::check_search(const void* const query,
+                                const uint32_t num_knn,
+                                const vl_uint32* const index) const
+  {
+    if (base_ == NULL && base_u8_ == NULL)
+    {
+      cerr << "ERROR: Must call ExactKNN::SetUp() before." << endl;
+      return STATUS_NOT_SETUP;
+    }
+    if (query == NULL || index == NULL)
+    {
+      cerr << "ERROR in ExactKNN::Search" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (num_knn == 0 || num_knn > num_base_)
+    {
+      cerr << "ERROR in ExactKNN::Search" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+    return STATUS_OK;
+  }
+
+  uint32_t ExactKNN::get_base_block(const uint32_t elem_size) const
+  {
+    if (!blocked_)
+      return num_base_;
+
+    const uint32_t base_block = cache_size_ / (elem_size * dim_);
+    return std::max(1u, std::min(num_base_, base_block));
+  }
+
+  Status ExactKNN::Search(const float* const query, const uint32_t num_query,
+                          const uint32_t num_knn, vl_uint32* const index,
+                          float* const dist, Workspace* const workspace) const
+  {
+    const Status status = check_search(query, num_knn, index);
+    if (status != STATUS_OK)
+      return status;
+    if (base_ == NULL)
+    {
+      cerr << "ERROR: the base of ExactKNN is uint8." << endl;
+      return STATUS_UNSUPPORTED;
+    }
+    if (num_query == 0)
+      return STATUS_OK;
+
+    // number of base vectors computed by one SGEMM
+    const uint32_t base_block = get_base_block(sizeof(float));
+
+    const uint32_t query_block = std::min(query_block_, num_query);
+    const int num_qblk = (num_query + query_block - 1) / query_block;
+    const int num_threads = std::max(
+        1, std::min(get_real_num_threads(num_threads_), num_qblk));
+
+    // the scratch of all the threads is taken at once
+    Workspace local;
+    Workspace& ws = (workspace == NULL ? local : *workspace);
+    WorkspaceScope scope(ws);
+    const size_t len_scratch = (size_t) query_block * base_block
+        + query_block + query_block * num_knn;
+    float* const scratch = ws.alloc<float>(num_threads * len_scratch);
+
+#pragma omp parallel if (num_threads > 1) num_threads(num_threads)
+    {
+      float* const D = scratch + get_thread_id() * len_scratch;
+      float* const qnorm = D + query_block * base_block;
+      float* const best_dist = qnorm + query_block;
+
+#pragma omp for schedule(dynamic)
+      for (int qb = 0; qb < num_qblk; ++qb)
+      {
+        const uint32_t q0 = qb * query_block;
+        const uint32_t nq = std::min(query_block, num_query - q0);
+        const float* const X = query + (size_t) q0 * dim_;
+        vl_uint32* const best_idx = index + q0 * num_knn;
+
+        for (uint32_t i = 0; i < nq; ++i)
+          qnorm[i] = cblas_sdot(dim_, X + i * dim_, 1, X + i * dim_, 1);
+        for (uint32_t i = 0; i < nq * num_knn; ++i)
+        {
+          best_dist[i] = FLT_MAX;
+          best_idx[i] = 0;
+        }
+
+        for (uint32_t b0 = 0; b0 < num_base_; b0 += base_block)
+        {
+          const uint32_t nb = std::min(base_block, num_base_ - b0);
+
+          // D = -2 * X * B'
+          cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, nq, nb, dim_,
+                      -2.0f, X, dim_, base_ + (size_t) b0 * dim_, dim_, 0.0f,
+                      D, nb);
+
+          for (uint32_t i = 0; i < nq; ++i)
+          {
+            const float* const Di = D + i * nb;
+            const float* const bnorm = &base_norm_[b0];
+            float* const bd = best_dist + i * num_knn;
+            vl_uint32* const bi = best_idx + i * num_knn;
+            const float xnorm = qnorm[i];
+
+            for (uint32_t j = 0; j < nb; ++j)
+            {
+              const float d = Di[j] + xnorm + bnorm[j];
+              if (d < bd[num_knn - 1])
+                push_neighbor(bd, bi, num_knn, d, b0 + j);
+            }
+          }
+        }
+
+        if (dist != NULL)
+        {
+          float* const out = dist + q0 * num_knn;
+          for (uint32_t i = 0; i < nq * num_knn; ++i)
+            out[i] = std::max(0.0f, best_dist[i]);
+        }
+      }
+    }
+    return STATUS_OK;
+  }
+
+  Status ExactKNN::Search(const uint8_t* const query, const uint32_t num_query,
+                          const uint32_t num_knn, vl_uint32* const index,
+                          float* const dist, Workspace* const workspace) const
+  {
+    const Status status = check_search(query, num_knn, index);
+    if (status != STATUS_OK)
+      return status;
+    if (base_u8_ == NULL)
+    {
+      cerr << "ERROR: the base of ExactKNN is float." << endl;
+      return STATUS_UNSUPPORTED;
+    }
+    if (num_query == 0)
+      return STATUS_OK;
+
+    const uint32_t base_block = get_base_block(sizeof(uint8_t));
+
+    const uint32_t query_block = std::min(query_block_, num_query);
+    const int num_qblk = (num_query + query_block - 1) / query_block;
+    const int num_threads = std::max(
+        1, std::min(get_real_num_threads(num_threads_), num_qblk));
+
+    Workspace local;
+    Workspace& ws = (workspace == NULL ? local : *workspace);
+    WorkspaceScope scope(ws);
+    uint32_t* const qnorms = ws.alloc<uint32_t>(num_threads * query_block);
+    float* const best_dists = ws.alloc<float>(
+        num_threads * query_block * num_knn);
+
+#pragma omp parallel if (num_threads > 1) num_threads(num_threads)
+    {
+      uint32_t* const qnorm = qnorms + get_thread_id() * query_block;
+      float* const best_dist = best_dists
+          + get_thread_id() * query_block * num_knn;
+
+#pragma omp for schedule(dynamic)
+      for (int qb = 0; qb < num_qblk; ++qb)
+      {
+        const uint32_t q0 = qb * query_block;
+        const uint32_t nq = std::min(query_block, num_query - q0);
+        const uint8_t* const X = query + (size_t) q0 * dim_;
+        vl_uint32* const best_idx = index + q0 * num_knn;
+
+        for (uint32_t i = 0; i < nq; ++i)
+          qnorm[i] = dot_u8(X + i * dim_, X + i * dim_, dim_);
+        for (uint32_t i = 0; i < nq * num_knn; ++i)
+        {
+          best_dist[i] = FLT_MAX;
+          best_idx[i] = 0;
+        }
+
+        // the base tile stays in cache while the query block runs over it
+        for (uint32_t b0 = 0; b0 < num_base_; b0 += base_block)
+        {
+          const uint32_t nb = std::min(base_block, num_base_ - b0);
+          const uint8_t* const B = base_u8_ + (size_t) b0 * dim_;
+          const uint32_t* const bnorm = &base_norm_u8_[b0];
+
+          for (uint32_t i = 0; i < nq; ++i)
+          {
+            const uint8_t* const x = X + i * dim_;
+            float* const bd = best_dist + i * num_knn;
+            vl_uint32* const bi = best_idx + i * num_knn;
+            const int64_t xnorm = qnorm[i];
+
+            for (uint32_t j = 0; j < nb; ++j)
+            {
+              const float d = (float) (xnorm + bnorm[j]
+                  - 2 * (int64_t) dot_u8(x, B + j * dim_, dim_));
+              if (d < bd[num_knn - 1])
+                push_neighbor(bd, bi, num_knn, d, b0 + j);
+            }
+          }
+        }
+
+        if (dist != NULL)
+          memcpy(dist + q0 * num_knn, best_dist,
+                 sizeof(float) * nq * num_knn);
+      }
+    }
+    return STATUS_OK;
+  }
+}
+
@@ -6,19 +6,181 @@
  */
 
 #include "EYE/eye_llc.hpp"
+#include "EYE/eye_simd.hpp"
+#include "EYE/eye_thread.hpp"
 
 #include <mkl.h>
 
 #include <vl/kdtree.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <new>
 using std::cerr;
 using std::endl;
 
 namespace EYE
 {
+  namespace
+  {
+    // Solve C * x = b in place for a symmetric positive definite K x K
+    // matrix with an unrolled Cholesky factorization C = U' * U, the same
+    // factorization done by sposv. C is left untouched so that the caller
+    // can fall back to LAPACK when the matrix is not positive definite.
+    template<int K>
+    inline bool solve_small(const float* const C, float* const b)
+    {
+      float U[K * K];
+      for (int j = 0; j < K; ++j)
+      {
+        float s = C[j * K + j];
+        for (int p = 0; p < j; ++p)
+          s -= U[p * K + j] * U[p * K + j];
+        if (!(s > 0))
+          return false;
+        const float ujj = std::sqrt(s);
+        U[j * K + j] = ujj;
+        for (int i = j + 1; i < K; ++i)
+        {
+          float t = C[j * K + i];
+          for (int p = 0; p < j; ++p)
+            t -= U[p * K + j] * U[p * K + i];
+          U[j * K + i] = t / ujj;
+        }
+      }
+
+      // U' * y = b
+      for (int j = 0; j < K; ++j)
+      {
+        float t = b[j];
+        for (int p = 0; p < j; ++p)
+          t -= U[p * K + j] * b[p];
+        b[j] = t / U[j * K + j];
+      }
+      // U * x = y
+      for (int j = K - 1; j >= 0; --j)
+      {
+        float t = b[j];
+        for (int p = j + 1; p < K; ++p)
+          t -= U[j * K + p] * b[p];
+        b[j] = t / U[j * K + j];
+      }
+
+      return true;
+    }
+
+    const char KDFOREST_MAGIC[8] = { 'E', 'Y', 'E', 'K', 'D', 'F', 'O', 'R' };
+    const uint32_t KDFOREST_VERSION = 1;
+    const uint32_t KDFOREST_ALIGN = 64;
+
+    // header of the kd-forest file, followed by one KDTreeRecord per tree.
+    // The nodes and the data index of each tree are stored as the vlfeat
+    // structs, at 64-byte aligned offsets, so that they are used in place.
+    struct KDForestHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t dim;
+        uint32_t num_data;
+        uint32_t num_trees;
+        uint32_t dist_method;
+        uint32_t thrd_method;
+        uint32_t node_size;
+        uint32_t entry_size;
+        uint64_t base_checksum;
+        uint8_t reserved[16];
+    };
+    typedef char check_kdforest_header_size[
+        sizeof(KDForestHeader) == KDFOREST_ALIGN ? 1 : -1];
+
+    struct KDTreeRecord
+    {
+        uint64_t num_nodes;
+        uint64_t nodes_offset;
+        uint64_t index_offset;
+        uint32_t depth;
+        uint32_t reserved;
+    };
+
+    inline uint64_t align_offset(const uint64_t offset)
+    {
+      return (offset + KDFOREST_ALIGN - 1) / KDFOREST_ALIGN * KDFOREST_ALIGN;
+    }
+
+    // a mapped tree is searched by vlfeat as it is, it must not lead out of
+    // its arrays. vlfeat creates the children after their parent, and
+    // stores the range of the data index of a leaf as -begin-1 and -end-1.
+    bool check_kdtree(const VlKDTreeNode* const nodes,
+                      const uint64_t num_nodes,
+                      const VlKDTreeDataIndexEntry* const entries,
+                      const uint32_t num_data, const uint32_t dim)
+    {
+      for (uint64_t n = 0; n < num_nodes; ++n)
+      {
+        const vl_index lower = nodes[n].lowerChild;
+        const vl_index upper = nodes[n].upperChild;
+        if (lower >= 0)
+        {
+          if ((uint64_t) lower <= n || (uint64_t) lower >= num_nodes
+              || upper < 0 || (uint64_t) upper <= n
+              || (uint64_t) upper >= num_nodes
+              || nodes[n].splitDimension >= dim)
+            return false;
+        }
+        else if (upper >= 0 || -upper - 1 < -lower - 1
+            || (uint64_t) (-upper - 1) > num_data)
+          return false;
+      }
+
+      for (uint32_t i = 0; i < num_data; ++i)
+        if (entries[i].index < 0 || (uint64_t) entries[i].index >= num_data)
+          return false;
+      return true;
+    }
+
+    // frames converted to float at once by the kd-forest search
+    const uint32_t SEARCH_CHUNK = 4096;
+
+    // the frames of a tile as floats, uint8 frames are converted to buf
+    inline const float* tile_as_float(const float* const data,
+                                      const uint32_t /*num*/,
+                                      float* const /*buf*/)
+    {
+      return data;
+    }
+    inline const float* tile_as_float(const uint8_t* const data,
+                                      const uint32_t num, float* const buf)
+    {
+      for (uint32_t i = 0; i < num; ++i)
+        buf[i] = data[i];
+      return buf;
+    }
+
+    // size the CSR matrix of the codes
+    inline Status init_sparse_code(SparseCode* const codes,
+                                   const uint32_t num_frame,
+                                   const uint32_t num_knn,
+                                   const uint32_t num_base)
+    {
+      if (codes == NULL)
+      {
+        cerr << "ERROR: Null pointer of output" << endl;
+        return STATUS_NULL_POINTER;
+      }
+
+      codes->num_frame = num_frame;
+      codes->num_knn = num_knn;
+      codes->num_base = num_base;
+      codes->index.resize(num_frame * num_knn);
+      codes->weight.resize(num_frame * num_knn);
+      return STATUS_OK;
+    }
+  }
+
   LLC::LLC()
-      : kdforest_model_(NULL),
+      : workspace_(NULL),
         has_setup_(false)
   {
     init_with_default_parameter();
@@ -28,7 +190,7 @@ namespace EYE
 
   LLC::LLC(const shared_ptr<float>& base, const uint32_t dim,
            const uint32_t num_base)
-      : kdforest_model_(NULL),
+      : workspace_(NULL),
         has_setup_(false)
   {
     init_with_default_parameter();
@@ -40,20 +202,45 @@ namespace EYE
     Clear();
   }
 
-  void LLC::set_base(const shared_ptr<float>& base, const uint32_t dim,
-                     const uint32_t num_base)
+  Status LLC::set_base(const shared_ptr<float>& base, const uint32_t dim,
+                       const uint32_t num_base)
   {
+    if (base.get() == NULL)
+    {
+      cerr << "ERROR in set_base" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (dim == 0 || num_base == 0)
+    {
+      cerr << "ERROR in set_base" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
     base_ = base;
     dim_ = dim;
     num_base_ = num_base;
 
-    if (base_.get() == NULL || dim_ == 0 || num_base_ == 0)
+    has_setup_ = false;
+    return STATUS_OK;
+  }
+
+  Status LLC::set_vocab_tree(const shared_ptr<VocabTree>& tree)
+  {
+    if (tree.get() == NULL || tree->get_words() == NULL)
     {
-      cerr << "ERROR in set_base" << endl;
-      exit(-1);
+      cerr << "ERROR in set_vocab_tree" << endl;
+      return (tree.get() == NULL ? STATUS_NULL_POINTER : STATUS_NOT_SETUP);
     }
 
-    has_setup_ = false;
+    // the base shares the ownership of the tree
+    const Status status = set_base(
+        shared_ptr<float>(tree, const_cast<float*>(tree->get_words())),
+        tree->get_dim(), tree->get_num_words());
+    if (status != STATUS_OK)
+      return status;
+    vocab_tree_ = tree;
+    search_method_ = SEARCH_TREE;
+    return STATUS_OK;
   }
 
   void LLC::Clear()
@@ -63,294 +250,1113 @@ namespace EYE
     has_setup_ = false;
   }
 
-  void LLC::SetUp()
+  Status LLC::SetUp()
   {
     if (base_.get() == NULL || dim_ == 0 || num_base_ == 0)
     {
       cerr << "ERROR: must set the base before." << endl;
-      exit(-1);
+      return STATUS_NOT_SETUP;
+    }
+    if (num_knn_ == 0 || num_knn_ > num_base_)
+    {
+      cerr << "ERROR: num_knn must be within [1, num_base]." << endl;
+      return STATUS_INVALID_ARGUMENT;
     }
 
-    if (kdforest_model_ != NULL)
-      vl_kdforest_delete(kdforest_model_);
-
-    kdforest_model_ = vl_kdforest_new(VL_TYPE_FLOAT, dim_, num_tree_,
-                                      dist_method_);
+    // the parameters are checked before anything is built
+    switch (search_method_)
+    {
+      case SEARCH_KDFOREST:
+        break;
+      case SEARCH_EXACT:
+      case SEARCH_EXACT_BLOCKED:
+        if (dist_method_ != VlDistanceL2)
+        {
+          cerr << "ERROR: exact search only supports the L2 distance." << endl;
+          return STATUS_UNSUPPORTED;
+        }
+        break;
+      case SEARCH_TREE:
+        if (vocab_tree_.get() == NULL
+            || vocab_tree_->get_words() != base_.get())
+        {
+          cerr << "ERROR: tree search needs the base from set_vocab_tree()."
+               << endl;
+          return STATUS_UNSUPPORTED;
+        }
+        if (dist_method_ != VlDistanceL2)
+        {
+          cerr << "ERROR: tree search only supports the L2 distance." << endl;
+          return STATUS_UNSUPPORTED;
+        }
+        break;
+      case SEARCH_PQ:
+        if (dist_method_ != VlDistanceL2)
+        {
+          cerr << "ERROR: PQ search only supports the L2 distance." << endl;
+          return STATUS_UNSUPPORTED;
+        }
+        break;
+      default:
+        cerr << "ERROR: unknown search method." << endl;
+        return STATUS_INVALID_ARGUMENT;
+    }
 
-    vl_kdforest_set_thresholding_method(kdforest_model_, thrd_method_);
-    vl_kdforest_set_max_num_comparisons(kdforest_model_, max_comp_);
-    vl_kdforest_build(kdforest_model_, num_base_, base_.get());
+    // a new model, the encoders of the previous one keep it alive
+    shared_ptr<LLCModel> model(new LLCModel);
+    model->base_ = base_;
+    model->dim_ = dim_;
+    model->num_base_ = num_base_;
+    model->num_knn_ = num_knn_;
+    model->max_comp_ = max_comp_;
+    model->beta_ = beta_;
+    model->search_method_ = search_method_;
+    model->thrd_method_ = thrd_method_;
+    model->dist_method_ = dist_method_;
+    model->num_tree_ = num_tree_;
+
+    // the threads share the frames, each encoder searches on its own thread
+    Status status(STATUS_OK);
+    switch (search_method_)
+    {
+      case SEARCH_KDFOREST:
+        if (!index_file_.empty())
+          status = model->attach_kdforest(index_file_.c_str());
+        else
+          model->build_kdforest();
+        break;
+      case SEARCH_EXACT:
+      case SEARCH_EXACT_BLOCKED:
+        model->exact_knn_.set_blocked(search_method_ == SEARCH_EXACT_BLOCKED);
+        status = model->exact_knn_.SetUp(base_.get(), dim_, num_base_);
+        break;
+      case SEARCH_TREE:
+        model->vocab_tree_ = vocab_tree_;
+        break;
+      case SEARCH_PQ:
+        // the training is threaded, not the search
+        model->pq_.set_num_subspaces(num_subspaces_);
+        model->pq_.set_num_threads(num_threads_);
+        status = model->pq_.SetUp(base_.get(), dim_, num_base_);
+        break;
+      default:
+        break;
+    }
+    if (status != STATUS_OK)
+      return status;
 
+    clear_encoders();
+    model_ = model;
     has_setup_ = true;
+    return STATUS_OK;
+  }
+
+  shared_ptr<const LLCModel> LLC::get_model() const
+  {
+    if (!has_setup_)
+    {
+      cerr << "ERROR: Must call SetUp() before." << endl;
+      return shared_ptr<const LLCModel>();
+    }
+
+    return model_;
   }
 
-  void LLC::Encode_with_max_pooling(const float* const data, const uint32_t dim,
-                                    const uint32_t num_frame,
-                                    float* const code) const
+  Status LLC::check_encode(const void* const data, const uint32_t dim,
+                           const uint32_t num_frame,
+                           const void* const codes) const
   {
-    if (data == NULL || dim != dim_ || num_frame <= 0)
+    if (data == NULL || codes == NULL)
     {
       cerr << "ERROR in input data" << endl;
-      exit(-1);
+      return STATUS_NULL_POINTER;
     }
 
     if (!has_setup_)
     {
       cerr << "ERROR: Must call SetUp() before." << endl;
-      exit(-1);
+      return STATUS_NOT_SETUP;
     }
 
-    vl_uint32* index = (vl_uint32*) vl_malloc(
-        sizeof(vl_uint32) * num_knn_ * num_frame);
-    memset(index, 0, num_knn_ * num_frame);
-    float* dist(NULL);
-
-    vl_kdforest_query_with_array(kdforest_model_, index, num_knn_, num_frame,
-                                 dist, data);
+    if (dim != dim_)
+    {
+      cerr << "ERROR in input data" << endl;
+      return STATUS_SIZE_MISMATCH;
+    }
+    if (num_frame == 0)
+    {
+      cerr << "ERROR in input data" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+    return STATUS_OK;
+  }
 
-    // start to encode
-    const uint32_t len_code = num_base_;
-    memset(code, 0, sizeof(float) * len_code);
 
-    const uint32_t len_z = dim_ * num_knn_;
-    const uint32_t len_C = num_knn_ * num_knn_;
-    const uint32_t len_b = num_knn_;
-    float* z = (float*) malloc(sizeof(float) * len_z);
-    float* C = (float*) malloc(sizeof(float) * len_C);
-    float* b = (float*) malloc(sizeof(float) * len_b);
-    memset(z, 0, sizeof(float) * len_z);
-    memset(C, 0, sizeof(float) * len_C);
-    memset(b, 0, sizeof(float) * len_b);
+  uint32_t LLC::split_frames(const uint32_t num_frame,
+                             int* const num_threads) const
+  {
+    const uint32_t batch = std::min(batch_size_, num_frame);
+    const int num_tile = (num_frame + batch - 1) / batch;
+    *num_threads = std::min(get_real_num_threads(num_threads_), num_tile);
 
-    double sum(0);
-    const float* base = base_.get();
+    return (num_tile + *num_threads - 1) / *num_threads * batch;
+  }
 
-    for (uint32_t i = 0; i < num_frame; i++)
+  LLCEncoder* LLC::acquire_encoder(const bool caller) const
+  {
+    LLCEncoder* encoder(NULL);
     {
+      ScopedLock lock(encoders_lock_);
+      if (!encoders_.empty())
+      {
+        encoder = encoders_.back();
+        encoders_.pop_back();
+      }
+    }
+    // the first calls create the encoders, the searcher of the kd-forest
+    // is created under the lock of the model
+    if (encoder == NULL)
+      encoder = new LLCEncoder(model_);
+
+    encoder->set_batch_size(batch_size_);
+    encoder->set_beam_width(beam_width_);
+    encoder->set_workspace(caller ? workspace_ : NULL);
+    return encoder;
+  }
 
-      uint32_t tmp_ind;
+  void LLC::release_encoder(LLCEncoder* const encoder) const
+  {
+    ScopedLock lock(encoders_lock_);
+    encoders_.push_back(encoder);
+  }
 
-      // z = B_i - 1 * x_i'
-      for (uint32_t n = 0; n < num_knn_; n++)
-      {
-        tmp_ind = (uint32_t) index[i * num_knn_ + n];
-        memcpy(z + n * dim_, base + tmp_ind * dim_, sizeof(float) * dim_);
+  void LLC::clear_encoders()
+  {
+    for (size_t i = 0; i < encoders_.size(); ++i)
+      delete encoders_[i];
+    encoders_.clear();
+  }
+
+  Status LLC::Encode_with_max_pooling(const float* const data,
+                                      const uint32_t dim,
+                                      const uint32_t num_frame,
+                                      float* const code) const
+  {
+    const Status status = check_encode(data, dim, num_frame, code);
+    if (status != STATUS_OK)
+      return status;
+
+    const uint32_t len_code = num_base_;
+    memset(code, 0, sizeof(float) * len_code);
+
+    int num_threads(1);
+    const uint32_t range = split_frames(num_frame, &num_threads);
 
-        cblas_saxpy(dim_, -1.0f, data + i * dim_, 1, z + n * dim_, 1);
+    LLCEncoder* const caller = acquire_encoder(true);
+    // an exception can not leave the threads, it is thrown again here
+    bool out_of_memory(false);
+    {
+      // every range is pooled into a partial code, the partial codes are
+      // merged at the end so that the result does not depend on the number
+      // of threads
+      Workspace& workspace = *caller->get_workspace();
+      WorkspaceScope scope(workspace);
+      float* partial(NULL);
+      if (num_threads > 1)
+      {
+        partial = workspace.alloc<float>(num_threads * len_code);
+        memset(partial, 0, sizeof(float) * num_threads * len_code);
       }
 
-      // C = z * z', i.e. covariance matrix
-      for (uint32_t m = 0; m < num_knn_; ++m)
-        for (uint32_t n = m; n < num_knn_; ++n)
+#pragma omp parallel if (num_threads > 1) num_threads(num_threads)
+      {
+        LLCEncoder* const encoder = (
+            get_thread_id() == 0 ? caller : acquire_encoder(false));
+
+#pragma omp for schedule(static)
+        for (int r = 0; r < num_threads; ++r)
         {
-          float sum = cblas_sdot(dim_, z + m * dim_, 1, z + n * dim_, 1);
-          C[m * num_knn_ + n] = sum;
-          C[n * num_knn_ + m] = sum;
+          const uint32_t start = r * range;
+          if (start >= num_frame)
+            continue;
+
+          try
+          {
+            encoder->max_pool(data + start * dim_,
+                              std::min(range, num_frame - start),
+                              partial == NULL ? code : partial + r * len_code);
+          }
+          catch (const std::bad_alloc&)
+          {
+#pragma omp atomic write
+            out_of_memory = true;
+          }
         }
 
-      sum = 0;
-      for (uint32_t m = 0; m < num_knn_; m++)
-        sum += C[m * num_knn_ + m];
-      sum = sum * beta_;
-      for (uint32_t m = 0; m < num_knn_; m++)
-        C[m * num_knn_ + m] += sum;
+        if (encoder != caller)
+          release_encoder(encoder);
+      }
+      for (int t = 0; partial != NULL && t < num_threads; ++t)
+        vec_max(code, partial + t * len_code, len_code);
+    }
+    release_encoder(caller);
+    if (out_of_memory)
+      throw std::bad_alloc();
+    return STATUS_OK;
+  }
 
-      for (uint32_t m = 0; m < num_knn_; m++)
-        b[m] = 1;
+  Status LLC::Encode_with_max_pooling(const float* const data,
+                                      const uint32_t dim,
+                                      const uint32_t num_frame,
+                                      shared_ptr<float>* const codes) const
+  {
+    const Status status = check_encode(data, dim, num_frame, codes);
+    if (status != STATUS_OK)
+      return status;
 
-      // solve
-      {
-        char upper_triangle = 'U';
-        int INFO;
-        int int_one = 1;
-        const int num_knn = (int) num_knn_;
-        sposv(&upper_triangle, &num_knn, &int_one, C, &num_knn, b, &num_knn,
-              &INFO);
-      }
+    // start to encode
+    const uint32_t len_code = num_base_;
+    float* code = new float[len_code];
+    Encode_with_max_pooling(data, dim, num_frame, code);
 
-      sum = 0;
+    codes->reset(code);
+    return STATUS_OK;
+  }
 
-      for (uint32_t m = 0; m < num_knn_; m++)
-        sum += b[m];
-      cblas_sscal(num_knn_, 1.0 / sum, b, 1);
+  Status LLC::Encode(const float* const data, const uint32_t dim,
+                     const uint32_t num_frame,
+                     float* const code) const
+  {
+    const Status status = check_encode(data, dim, num_frame, code);
+    if (status != STATUS_OK)
+      return status;
+
+    int num_threads(1);
+    const uint32_t range = split_frames(num_frame, &num_threads);
 
-      for (uint32_t m = 0; m < num_knn_; m++)
+    // the ranges write to disjoint rows, no merging is needed
+    bool out_of_memory(false);
+#pragma omp parallel if (num_threads > 1) num_threads(num_threads)
+    {
+      LLCEncoder* const encoder = acquire_encoder(get_thread_id() == 0);
+
+#pragma omp for schedule(static)
+      for (int r = 0; r < num_threads; ++r)
       {
-        tmp_ind = (uint32_t) index[i * num_knn_ + m];
+        const uint32_t start = r * range;
+        if (start >= num_frame)
+          continue;
 
-        if (code[tmp_ind] < b[m])
-          code[tmp_ind] = b[m];
+        try
+        {
+          encoder->Encode(data + start * dim_, dim,
+                          std::min(range, num_frame - start),
+                          code + start * num_base_);
+        }
+        catch (const std::bad_alloc&)
+        {
+#pragma omp atomic write
+          out_of_memory = true;
+        }
       }
-    }
 
-    free(index);
-    free(z);
-    free(C);
-    free(b);
+      release_encoder(encoder);
+    }
+    if (out_of_memory)
+      throw std::bad_alloc();
+    return STATUS_OK;
   }
 
-  void LLC::Encode_with_max_pooling(const float* const data, const uint32_t dim,
-                                    const uint32_t num_frame,
-                                    shared_ptr<float>* const codes) const
+  Status LLC::Encode(const float* const data, const uint32_t dim,
+                     const uint32_t num_frame,
+                     shared_ptr<float>* const codes) const
   {
+    const Status status = check_encode(data, dim, num_frame, codes);
+    if (status != STATUS_OK)
+      return status;
+
     // start to encode
-    const uint32_t len_code = num_base_;
+    const uint32_t len_code = num_base_ * num_frame;
     float* code = new float[len_code];
-    Encode_with_max_pooling(data, dim, num_frame, code);
 
+    Encode(data, dim, num_frame, code);
     codes->reset(code);
+    return STATUS_OK;
+  }
+
+  Status LLC::Encode_sparse(const float* const data, const uint32_t dim,
+                            const uint32_t num_frame, uint32_t* const index,
+                            float* const weight) const
+  {
+    return encode_sparse(data, dim, num_frame, index, weight);
+  }
+
+  Status LLC::Encode_sparse(const float* const data, const uint32_t dim,
+                            const uint32_t num_frame,
+                            SparseCode* const codes) const
+  {
+    Status status = check_encode(data, dim, num_frame, codes);
+    if (status == STATUS_OK)
+      status = init_sparse_code(codes, num_frame, num_knn_, num_base_);
+    if (status != STATUS_OK)
+      return status;
+    return encode_sparse(data, dim, num_frame, &codes->index[0],
+                         &codes->weight[0]);
+  }
+
+  Status LLC::Encode_sparse(const uint8_t* const data, const uint32_t dim,
+                            const uint32_t num_frame, uint32_t* const index,
+                            float* const weight) const
+  {
+    return encode_sparse(data, dim, num_frame, index, weight);
+  }
+
+  Status LLC::Encode_sparse(const uint8_t* const data, const uint32_t dim,
+                            const uint32_t num_frame,
+                            SparseCode* const codes) const
+  {
+    Status status = check_encode(data, dim, num_frame, codes);
+    if (status == STATUS_OK)
+      status = init_sparse_code(codes, num_frame, num_knn_, num_base_);
+    if (status != STATUS_OK)
+      return status;
+    return encode_sparse(data, dim, num_frame, &codes->index[0],
+                         &codes->weight[0]);
   }
 
-  void LLC::Encode(const float* const data, const uint32_t dim,
-                   const uint32_t num_frame,
-                   float* const code) const
+  template<typename T>
+  Status LLC::encode_sparse(const T* const data, const uint32_t dim,
+                            const uint32_t num_frame, uint32_t* const index,
+                            float* const weight) const
   {
-    if (data == NULL || dim != dim_ || num_frame <= 0)
+    if (weight == NULL)
     {
       cerr << "ERROR in input data" << endl;
-      exit(-1);
+      return STATUS_NULL_POINTER;
     }
+    const Status status = check_encode(data, dim, num_frame, index);
+    if (status != STATUS_OK)
+      return status;
 
-    if (!has_setup_)
+    int num_threads(1);
+    const uint32_t range = split_frames(num_frame, &num_threads);
+
+    // the weights are solved in place, no scattering
+    bool out_of_memory(false);
+#pragma omp parallel if (num_threads > 1) num_threads(num_threads)
     {
-      cerr << "ERROR: Must call SetUp() before." << endl;
-      exit(-1);
+      LLCEncoder* const encoder = acquire_encoder(get_thread_id() == 0);
+
+#pragma omp for schedule(static)
+      for (int r = 0; r < num_threads; ++r)
+      {
+        const uint32_t start = r * range;
+        if (start >= num_frame)
+          continue;
+
+        try
+        {
+          encoder->Encode_sparse(data + start * dim_, dim,
+                                 std::min(range, num_frame - start),
+                                 index + start * num_knn_,
+                                 weight + start * num_knn_);
+        }
+        catch (const std::bad_alloc&)
+        {
+#pragma omp atomic write
+          out_of_memory = true;
+        }
+      }
+
+      release_encoder(encoder);
     }
+    if (out_of_memory)
+      throw std::bad_alloc();
+    return STATUS_OK;
+  }
 
-    vl_uint32* index = (vl_uint32*) vl_malloc(
-        sizeof(vl_uint32) * num_knn_ * num_frame);
-    memset(index, 0, num_knn_ * num_frame);
-    float* dist(NULL);
+  Status LLC::save_index(const char* filename) const
+  {
+    if (filename == NULL)
+    {
+      cerr << "ERROR: NULL file name for save_index" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (!has_setup_ || model_->kdforest_ == NULL)
+    {
+      cerr << "ERROR: save_index needs the kd-forest built by SetUp()."
+           << endl;
+      return STATUS_NOT_SETUP;
+    }
 
-    vl_kdforest_query_with_array(kdforest_model_, index, num_knn_, num_frame,
-                                 dist, data);
+    return model_->save_kdforest(filename);
+  }
 
-    // start to encode
-    const uint32_t len_code = num_base_ * num_frame;
-    memset(code, 0, sizeof(float) * len_code);
 
-    const uint32_t len_z = dim_ * num_knn_;
-    const uint32_t len_C = num_knn_ * num_knn_;
-    const uint32_t len_b = num_knn_;
-    float* z = (float*) malloc(sizeof(float) * len_z);
-    float* C = (float*) malloc(sizeof(float) * len_C);
-    float* b = (float*) malloc(sizeof(float) * len_b);
-    memset(z, 0, sizeof(float) * len_z);
-    memset(C, 0, sizeof(float) * len_C);
-    memset(b, 0, sizeof(float) * len_b);
+  void LLC::init_with_default_parameter()
+  {
+    thrd_method_ = DEFAULT_THRD_METHOD;
+    dist_method_ = DEFAULT_DIST_METHOD;
+    num_tree_ = DEFAULT_NUM_TREE;
+    num_knn_ = DEFAULT_NUM_KNN;
+    max_comp_ = DEFAULT_MAX_COMP;
+    beta_ = DEFAULT_BETA;
+    batch_size_ = DEFAULT_BATCH_SIZE;
+    num_threads_ = DEFAULT_NUM_THREADS;
+    search_method_ = DEFAULT_SEARCH_METHOD;
+    index_file_.clear();
+    beam_width_ = DEFAULT_BEAM_WIDTH;
+    num_subspaces_ = PQIndex::DEFAULT_NUM_SUBSPACES;
+  }
+
+  void LLC::clear_data()
+  {
+    clear_encoders();
+    model_.reset();
+    vocab_tree_.reset();
+
+    base_.reset();
+    dim_ = 0;
+    num_base_ = 0;
+  }
 
-    double sum(0);
-    const float* base = base_.get();
+  LLCModel::LLCModel()
+      : dim_(0),
+        num_base_(0),
+        num_knn_(0),
+        max_comp_(0),
+        beta_(0),
+        search_method_(LLC::SEARCH_KDFOREST),
+        kdforest_(NULL),
+        thrd_method_(DEFAULT_THRD_METHOD),
+        dist_method_(DEFAULT_DIST_METHOD),
+        num_tree_(0),
+        has_base_u8_(false)
+  {
+  }
 
-    for (uint32_t i = 0; i < num_frame; i++)
+  LLCModel::~LLCModel()
+  {
+    delete_kdforest();
+  }
+
+  const ExactKNN* LLCModel::get_exact_knn_u8() const
+  {
+    ScopedLock lock(base_u8_lock_);
+    if (has_base_u8_)
+      return &exact_knn_u8_;
+
+    // the bases trained on quantized descriptors are within [0, 255]
+    base_u8_.resize(num_base_ * dim_);
+    for (uint32_t i = 0; i < num_base_ * dim_; ++i)
+      base_u8_[i] = (uint8_t) std::min(255.0f,
+                                       std::max(0.0f, base_.get()[i] + 0.5f));
+    exact_knn_u8_.set_blocked(search_method_ == LLC::SEARCH_EXACT_BLOCKED);
+    if (exact_knn_u8_.SetUp(&base_u8_[0], dim_, num_base_) != STATUS_OK)
     {
+      vector<uint8_t>().swap(base_u8_);
+      return NULL;
+    }
+    has_base_u8_ = true;
+    return &exact_knn_u8_;
+  }
+
+  void LLCModel::build_kdforest()
+  {
+    kdforest_ = vl_kdforest_new(VL_TYPE_FLOAT, dim_, num_tree_, dist_method_);
+
+    vl_kdforest_set_thresholding_method(kdforest_, thrd_method_);
+    vl_kdforest_set_max_num_comparisons(kdforest_, max_comp_);
+    vl_kdforest_build(kdforest_, num_base_, base_.get());
+  }
 
-      uint32_t tmp_ind;
+  void LLCModel::delete_kdforest()
+  {
+    if (kdforest_ == NULL)
+      return;
 
-      // z = B_i - 1 * x_i'
-      for (uint32_t n = 0; n < num_knn_; n++)
+    if (index_map_.get() != NULL)
+    {
+      for (vl_size t = 0; t < kdforest_->numTrees; ++t)
       {
-        tmp_ind = (uint32_t) index[i * num_knn_ + n];
-        memcpy(z + n * dim_, base + tmp_ind * dim_, sizeof(float) * dim_);
+        kdforest_->trees[t]->nodes = NULL;
+        kdforest_->trees[t]->dataIndex = NULL;
+      }
+      index_map_.reset();
+    }
+
+    vl_kdforest_delete(kdforest_);
+    kdforest_ = NULL;
+  }
+
+  Status LLCModel::save_kdforest(const char* filename) const
+  {
+    FILE* output = fopen(filename, "wb");
+    if (output == NULL)
+    {
+      cerr << "ERROR: can not write " << filename << endl;
+      return STATUS_IO_ERROR;
+    }
+
+    const uint32_t num_trees = kdforest_->numTrees;
+    KDForestHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KDFOREST_MAGIC, sizeof(KDFOREST_MAGIC));
+    header.version = KDFOREST_VERSION;
+    header.dim = dim_;
+    header.num_data = num_base_;
+    header.num_trees = num_trees;
+    header.dist_method = dist_method_;
+    header.thrd_method = thrd_method_;
+    header.node_size = sizeof(VlKDTreeNode);
+    header.entry_size = sizeof(VlKDTreeDataIndexEntry);
+    header.base_checksum = fnv1a_checksum(base_.get(),
+                                          sizeof(float) * num_base_ * dim_);
+
+    vector<KDTreeRecord> records(num_trees);
+    uint64_t offset = align_offset(
+        sizeof(header) + sizeof(KDTreeRecord) * num_trees);
+    for (uint32_t t = 0; t < num_trees; ++t)
+    {
+      const VlKDTree* tree = kdforest_->trees[t];
+      memset(&records[t], 0, sizeof(KDTreeRecord));
+      records[t].num_nodes = tree->numUsedNodes;
+      records[t].depth = tree->depth;
+      records[t].nodes_offset = offset;
+      offset = align_offset(offset + sizeof(VlKDTreeNode) * tree->numUsedNodes);
+      records[t].index_offset = offset;
+      offset = align_offset(
+          offset + sizeof(VlKDTreeDataIndexEntry) * num_base_);
+    }
+
+    const char zeros[KDFOREST_ALIGN] = { 0 };
+    bool ok = (fwrite(&header, sizeof(header), 1, output) == 1
+        && fwrite(&records[0], sizeof(KDTreeRecord), num_trees, output)
+            == num_trees);
+    uint64_t pos = sizeof(header) + sizeof(KDTreeRecord) * num_trees;
+    for (uint32_t t = 0; t < num_trees && ok; ++t)
+    {
+      const VlKDTree* tree = kdforest_->trees[t];
+
+      ok = fwrite(zeros, 1, records[t].nodes_offset - pos, output)
+          == records[t].nodes_offset - pos
+          && fwrite(tree->nodes, sizeof(VlKDTreeNode), tree->numUsedNodes,
+                    output) == tree->numUsedNodes;
+      pos = records[t].nodes_offset
+          + sizeof(VlKDTreeNode) * tree->numUsedNodes;
+
+      ok = ok && fwrite(zeros, 1, records[t].index_offset - pos, output)
+          == records[t].index_offset - pos
+          && fwrite(tree->dataIndex, sizeof(VlKDTreeDataIndexEntry),
+                    num_base_, output) == num_base_;
+      pos = records[t].index_offset
+          + sizeof(VlKDTreeDataIndexEntry) * num_base_;
+    }
+
+    if (fclose(output) != 0 || !ok)
+    {
+      cerr << "ERROR: failed to write " << filename << endl;
+      return STATUS_IO_ERROR;
+    }
+    return STATUS_OK;
+  }
+
+  Status LLCModel::attach_kdforest(const char* filename)
+  {
+    shared_ptr<MappedFile> file(new MappedFile);
+    if (!file->Open(filename))
+    {
+      cerr << "ERROR: can not map the index " << filename << endl;
+      return STATUS_IO_ERROR;
+    }
+    if (file->get_size() < sizeof(KDForestHeader))
+    {
+      cerr << "ERROR: truncated index " << filename << endl;
+      return STATUS_BAD_FILE;
+    }
+
+    const uint8_t* const data = file->get_data();
+    KDForestHeader header;
+    memcpy(&header, data, sizeof(header));
 
-        cblas_saxpy(dim_, -1.0f, data + i * dim_, 1, z + n * dim_, 1);
+    if (memcmp(header.magic, KDFOREST_MAGIC, sizeof(KDFOREST_MAGIC)) != 0
+        || header.version != KDFOREST_VERSION
+        || header.node_size != sizeof(VlKDTreeNode)
+        || header.entry_size != sizeof(VlKDTreeDataIndexEntry))
+    {
+      cerr << "ERROR: " << filename << " is not a kd-forest of this build."
+           << endl;
+      return STATUS_BAD_FILE;
+    }
+
+    // the index only fits the base and the parameters it was built with
+    if (header.dim != dim_ || header.num_data != num_base_
+        || header.num_trees != num_tree_
+        || header.dist_method != (uint32_t) dist_method_
+        || header.thrd_method != (uint32_t) thrd_method_
+        || header.base_checksum
+            != fnv1a_checksum(base_.get(), sizeof(float) * num_base_ * dim_))
+    {
+      cerr << "ERROR: the index " << filename
+           << " was built for another base or parameters." << endl;
+      return STATUS_BAD_FILE;
+    }
+
+    const uint64_t len_records = sizeof(KDTreeRecord) * header.num_trees;
+    if (file->get_size() < sizeof(header) + len_records)
+    {
+      cerr << "ERROR: truncated index " << filename << endl;
+      return STATUS_BAD_FILE;
+    }
+    vector<KDTreeRecord> records(header.num_trees);
+    memcpy(&records[0], data + sizeof(header), len_records);
+
+    for (uint32_t t = 0; t < header.num_trees; ++t)
+    {
+      const KDTreeRecord& r = records[t];
+      if (r.nodes_offset % KDFOREST_ALIGN != 0
+          || r.index_offset % KDFOREST_ALIGN != 0
+          || r.num_nodes == 0 || r.num_nodes > 2 * (uint64_t) num_base_
+          || r.nodes_offset + sizeof(VlKDTreeNode) * r.num_nodes
+              > file->get_size()
+          || r.index_offset + sizeof(VlKDTreeDataIndexEntry) * num_base_
+              > file->get_size()
+          || !check_kdtree((const VlKDTreeNode*) (data + r.nodes_offset),
+                           r.num_nodes,
+                           (const VlKDTreeDataIndexEntry*) (data
+                               + r.index_offset),
+                           num_base_, dim_))
+      {
+        cerr << "ERROR: corrupted index " << filename << endl;
+        return STATUS_BAD_FILE;
       }
+    }
+
+    // the same forest as vl_kdforest_build() leaves, with the trees in
+    // the mapping
+    kdforest_ = vl_kdforest_new(VL_TYPE_FLOAT, dim_, num_tree_, dist_method_);
+    vl_kdforest_set_thresholding_method(kdforest_, thrd_method_);
+    vl_kdforest_set_max_num_comparisons(kdforest_, max_comp_);
+
+    kdforest_->data = base_.get();
+    kdforest_->numData = num_base_;
+    kdforest_->trees = (VlKDTree**) vl_malloc(
+        sizeof(VlKDTree*) * num_tree_);
+    kdforest_->maxNumNodes = 0;
+    for (uint32_t t = 0; t < num_tree_; ++t)
+    {
+      VlKDTree* tree = (VlKDTree*) vl_malloc(sizeof(VlKDTree));
+      tree->nodes = (VlKDTreeNode*) (data + records[t].nodes_offset);
+      tree->numUsedNodes = records[t].num_nodes;
+      tree->numAllocatedNodes = records[t].num_nodes;
+      tree->dataIndex = (VlKDTreeDataIndexEntry*) (data
+          + records[t].index_offset);
+      tree->depth = records[t].depth;
+
+      kdforest_->trees[t] = tree;
+      kdforest_->maxNumNodes += tree->numUsedNodes;
+    }
+
+    index_map_ = file;
+    return STATUS_OK;
+  }
+
+  LLCEncoder::LLCEncoder(const shared_ptr<const LLCModel>& model)
+      : model_(model),
+        searcher_(NULL),
+        workspace_(NULL),
+        batch_size_(LLC::DEFAULT_BATCH_SIZE),
+        beam_width_(LLC::DEFAULT_BEAM_WIDTH)
+  {
+    // the encoding functions report the missing model
+    if (model_.get() == NULL)
+      return;
+
+    // vlfeat links the searchers of a forest in a list
+    if (model_->kdforest_ != NULL)
+    {
+      ScopedLock lock(model_->searcher_lock_);
+      searcher_ = vl_kdforest_new_searcher(model_->kdforest_);
+    }
+  }
+
+  LLCEncoder::~LLCEncoder()
+  {
+    if (searcher_ != NULL)
+    {
+      ScopedLock lock(model_->searcher_lock_);
+      vl_kdforestsearcher_delete(searcher_);
+    }
+  }
+
+  Status LLCEncoder::check_input(const void* const data, const uint32_t dim,
+                                 const uint32_t num_frame,
+                                 const void* const codes) const
+  {
+    if (model_.get() == NULL)
+    {
+      cerr << "ERROR: NULL model for the encoder" << endl;
+      return STATUS_NOT_SETUP;
+    }
+    if (data == NULL || codes == NULL)
+    {
+      cerr << "ERROR in input data" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (dim != model_->dim_)
+    {
+      cerr << "ERROR in input data" << endl;
+      return STATUS_SIZE_MISMATCH;
+    }
+    if (num_frame == 0)
+    {
+      cerr << "ERROR in input data" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+    return STATUS_OK;
+  }
 
-      // C = z * z', i.e. covariance matrix
-      for (uint32_t m = 0; m < num_knn_; ++m)
-        for (uint32_t n = m; n < num_knn_; ++n)
+  Status LLCEncoder::Encode(const float* const data, const uint32_t dim,
+                            const uint32_t num_frame, float* const code)
+  {
+    const Status status = check_input(data, dim, num_frame, code);
+    if (status != STATUS_OK)
+      return status;
+
+    const LLCModel& model = *model_;
+    const uint32_t num_knn = model.num_knn_;
+    const uint32_t num_base = model.num_base_;
+
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    vl_uint32* const index = workspace.alloc<vl_uint32>(num_frame * num_knn);
+    float* const w = workspace.alloc<float>(batch_size_ * num_knn);
+    search(data, num_frame, index);
+
+    memset(code, 0, sizeof(float) * num_base * num_frame);
+
+    for (uint32_t start = 0; start < num_frame; start += batch_size_)
+    {
+      const uint32_t num = std::min(batch_size_, num_frame - start);
+      const vl_uint32* const ind = index + start * num_knn;
+      encode_tile(data + start * dim, ind, num, w);
+
+      for (uint32_t i = 0; i < num; i++)
+        for (uint32_t m = 0; m < num_knn; m++)
         {
-          float sum = cblas_sdot(dim_, z + m * dim_, 1, z + n * dim_, 1);
-          C[m * num_knn_ + n] = sum;
-          C[n * num_knn_ + m] = sum;
+          const uint32_t tmp_ind = (uint32_t) ind[i * num_knn + m];
+
+          code[(start + i) * num_base + tmp_ind] = w[i * num_knn + m];
         }
+    }
+    return STATUS_OK;
+  }
 
-      sum = 0;
-      for (uint32_t m = 0; m < num_knn_; m++)
-        sum += C[m * num_knn_ + m];
-      sum = sum * beta_;
-      for (uint32_t m = 0; m < num_knn_; m++)
-        C[m * num_knn_ + m] += sum;
+  Status LLCEncoder::Encode_with_max_pooling(const float* const data,
+                                             const uint32_t dim,
+                                             const uint32_t num_frame,
+                                             float* const code)
+  {
+    const Status status = check_input(data, dim, num_frame, code);
+    if (status != STATUS_OK)
+      return status;
 
-      for (uint32_t m = 0; m < num_knn_; m++)
-        b[m] = 1;
+    memset(code, 0, sizeof(float) * model_->num_base_);
+    max_pool(data, num_frame, code);
+    return STATUS_OK;
+  }
 
-      // solve
-      {
-        char upper_triangle = 'U';
-        int INFO;
-        int int_one = 1;
-        const int num_knn = (int) num_knn_;
-        sposv(&upper_triangle, &num_knn, &int_one, C, &num_knn, b, &num_knn,
-              &INFO);
-      }
+  void LLCEncoder::max_pool(const float* const data, const uint32_t num_frame,
+                            float* const code)
+  {
+    const LLCModel& model = *model_;
+    const uint32_t num_knn = model.num_knn_;
 
-      sum = 0;
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    vl_uint32* const index = workspace.alloc<vl_uint32>(num_frame * num_knn);
+    float* const w = workspace.alloc<float>(batch_size_ * num_knn);
+    search(data, num_frame, index);
 
-      for (uint32_t m = 0; m < num_knn_; m++)
-        sum += b[m];
-      cblas_sscal(num_knn_, 1.0 / sum, b, 1);
+    for (uint32_t start = 0; start < num_frame; start += batch_size_)
+    {
+      const uint32_t num = std::min(batch_size_, num_frame - start);
+      const vl_uint32* const ind = index + start * num_knn;
+      encode_tile(data + start * model.dim_, ind, num, w);
 
-      for (uint32_t m = 0; m < num_knn_; m++)
+      for (uint32_t m = 0; m < num * num_knn; m++)
       {
-        tmp_ind = (uint32_t) index[i * num_knn_ + m];
+        const uint32_t tmp_ind = (uint32_t) ind[m];
 
-        code[i * num_base_ + tmp_ind] = b[m];
+        if (code[tmp_ind] < w[m])
+          code[tmp_ind] = w[m];
       }
     }
+  }
 
-    /*
-     float* max_code = (float*) malloc(sizeof(float) * num_base_);
-     memset(max_code, 0, sizeof(float) * num_base_);
-     for (uint32_t m = 0; m < num_base_; ++m)
-     for (uint32_t n = 0; n < num_frame; ++n)
-     if (max_code[m] < code[n * num_base_ + m])
-     max_code[m] = code[n * num_base_ + m];
+  Status LLCEncoder::Encode_sparse(const float* const data,
+                                   const uint32_t dim,
+                                   const uint32_t num_frame,
+                                   uint32_t* const index, float* const weight)
+  {
+    return encode_sparse(data, dim, num_frame, index, weight);
+  }
 
-     codes.reset(max_code);
-     free(code);
-     */
+  Status LLCEncoder::Encode_sparse(const float* const data,
+                                   const uint32_t dim,
+                                   const uint32_t num_frame,
+                                   SparseCode* const codes)
+  {
+    Status status = check_input(data, dim, num_frame, codes);
+    if (status == STATUS_OK)
+      status = init_sparse_code(codes, num_frame, model_->num_knn_,
+                                model_->num_base_);
+    if (status != STATUS_OK)
+      return status;
+    return encode_sparse(data, dim, num_frame, &codes->index[0],
+                         &codes->weight[0]);
+  }
 
-    free(index);
-    free(z);
-    free(C);
-    free(b);
+  Status LLCEncoder::Encode_sparse(const uint8_t* const data,
+                                   const uint32_t dim,
+                                   const uint32_t num_frame,
+                                   uint32_t* const index, float* const weight)
+  {
+    return encode_sparse(data, dim, num_frame, index, weight);
   }
 
-  void LLC::Encode(const float* const data, const uint32_t dim,
-                   const uint32_t num_frame,
-                   shared_ptr<float>* const codes) const
+  Status LLCEncoder::Encode_sparse(const uint8_t* const data,
+                                   const uint32_t dim,
+                                   const uint32_t num_frame,
+                                   SparseCode* const codes)
   {
-    // start to encode
-    const uint32_t len_code = num_base_ * num_frame;
-    float* code = new float[len_code];
+    Status status = check_input(data, dim, num_frame, codes);
+    if (status == STATUS_OK)
+      status = init_sparse_code(codes, num_frame, model_->num_knn_,
+                                model_->num_base_);
+    if (status != STATUS_OK)
+      return status;
+    return encode_sparse(data, dim, num_frame, &codes->index[0],
+                         &codes->weight[0]);
+  }
 
-    Encode(data, dim, num_frame, code);
-    codes->reset(code);
+  template<typename T>
+  Status LLCEncoder::encode_sparse(const T* const data, const uint32_t dim,
+                                   const uint32_t num_frame,
+                                   uint32_t* const index, float* const weight)
+  {
+    if (weight == NULL)
+    {
+      cerr << "ERROR in input data" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    const Status status = check_input(data, dim, num_frame, index);
+    if (status != STATUS_OK)
+      return status;
+
+    const uint32_t num_knn = model_->num_knn_;
+    search(data, num_frame, (vl_uint32*) index);
+
+    // the weights are solved in place, uint8 frames are converted to x
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    float* const x = workspace.alloc<float>(batch_size_ * dim);
+    for (uint32_t start = 0; start < num_frame; start += batch_size_)
+    {
+      const uint32_t num = std::min(batch_size_, num_frame - start);
+      encode_tile(tile_as_float(data + start * dim, num * dim, x),
+                  (const vl_uint32*) index + start * num_knn, num,
+                  weight + start * num_knn);
+    }
+    return STATUS_OK;
   }
 
-  void LLC::init_with_default_parameter()
+
+  void LLCEncoder::search(const float* const data, const uint32_t num_frame,
+                          vl_uint32* const index)
   {
-    thrd_method_ = DEFAULT_THRD_METHOD;
-    dist_method_ = DEFAULT_DIST_METHOD;
-    num_tree_ = DEFAULT_NUM_TREE;
-    num_knn_ = DEFAULT_NUM_KNN;
-    max_comp_ = DEFAULT_MAX_COMP;
-    beta_ = DEFAULT_BETA;
+    const LLCModel& model = *model_;
+    const uint32_t num_knn = model.num_knn_;
+
+    Workspace& workspace = *get_workspace();
+    switch (model.search_method_)
+    {
+      case LLC::SEARCH_KDFOREST:
+      {
+        WorkspaceScope scope(workspace);
+        VlKDForestNeighbor* const neighbors =
+            workspace.alloc<VlKDForestNeighbor>(num_knn);
+        for (uint32_t i = 0; i < num_frame; ++i)
+        {
+          vl_kdforestsearcher_query(searcher_, neighbors, num_knn,
+                                    data + i * model.dim_);
+          for (uint32_t k = 0; k < num_knn; ++k)
+            index[i * num_knn + k] = (vl_uint32) neighbors[k].index;
+        }
+        break;
+      }
+      case LLC::SEARCH_EXACT:
+      case LLC::SEARCH_EXACT_BLOCKED:
+        model.exact_knn_.Search(data, num_frame, num_knn, index, NULL,
+                                &workspace);
+        break;
+      case LLC::SEARCH_TREE:
+        model.vocab_tree_->Search(data, num_frame, num_knn, beam_width_, index,
+                                  NULL, &workspace, 1);
+        break;
+      case LLC::SEARCH_PQ:
+        model.pq_.Search(data, num_frame, num_knn, model.max_comp_, index,
+                         NULL, &workspace, 1);
+        break;
+      default:
+        break;
+    }
   }
 
-  void LLC::clear_data()
+  void LLCEncoder::search(const uint8_t* const data, const uint32_t num_frame,
+                          vl_uint32* const index)
   {
-    if (kdforest_model_ != NULL)
+    const LLCModel& model = *model_;
+    Workspace& workspace = *get_workspace();
+
+    // the uint8 base is built by the first quantized frames, the float
+    // search is kept if it cannot be
+    const ExactKNN* knn_u8(NULL);
+    if (model.search_method_ == LLC::SEARCH_EXACT
+        || model.search_method_ == LLC::SEARCH_EXACT_BLOCKED)
+      knn_u8 = model.get_exact_knn_u8();
+    if (knn_u8 != NULL)
     {
-      vl_kdforest_delete(kdforest_model_);
-      kdforest_model_ = NULL;
+      knn_u8->Search(data, num_frame, model.num_knn_, index, NULL,
+                     &workspace);
+      return;
     }
 
-    base_.reset();
-    dim_ = 0;
-    num_base_ = 0;
+    // the kd-forest and the tree only take floats, convert the frames by
+    // chunks
+    WorkspaceScope scope(workspace);
+    const uint32_t chunk = std::min(SEARCH_CHUNK, num_frame);
+    float* const buf = workspace.alloc<float>(chunk * model.dim_);
+    for (uint32_t start = 0; start < num_frame; start += chunk)
+    {
+      const uint32_t num = std::min(chunk, num_frame - start);
+      search(tile_as_float(data + start * model.dim_, num * model.dim_, buf),
+             num, index + start * model.num_knn_);
+    }
   }
 
-}
+  void LLCEncoder::encode_tile(const float* const data,
+                               const vl_uint32* const index,
+                               const uint32_t num_frame, float* const w)
+  {
+    const LLCModel& model = *model_;
+    const float* base = model.base_.get();
+    const uint32_t len_z = model.dim_ * model.num_knn_;
+    const uint32_t len_C = model.num_knn_ * model.num_knn_;
 
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    float* const z = workspace.alloc<float>(num_frame * len_z);
+    float* const C = workspace.alloc<float>(num_frame * len_C);
+
+    // z = B_i - 1 * x_i' for every frame of the tile
+    for (uint32_t i = 0; i < num_frame; i++)
+      for (uint32_t n = 0; n < model.num_knn_; n++)
+      {
+        const uint32_t tmp_ind = (uint32_t) index[i * model.num_knn_ + n];
+        float* const zn = z + i * len_z + n * model.dim_;
+        const float* const bn = base + tmp_ind * model.dim_;
+        const float* const x = data + i * model.dim_;
+        for (uint32_t d = 0; d < model.dim_; d++)
+          zn[d] = bn[d] - x[d];
+      }
+
+    // C = z * z', i.e. covariance matrix, all the tile in one batched call
+    {
+      const CBLAS_TRANSPOSE trans_a = CblasNoTrans;
+      const CBLAS_TRANSPOSE trans_b = CblasTrans;
+      const int num_knn = (int) model.num_knn_;
+      const int dim = (int) model.dim_;
+      const float alpha = 1.0f;
+      const float beta = 0.0f;
+      const int group_size = (int) num_frame;
+
+      const float** a_array = workspace.alloc<const float*>(num_frame);
+      float** c_array = workspace.alloc<float*>(num_frame);
+      for (uint32_t i = 0; i < num_frame; i++)
+      {
+        a_array[i] = z + i * len_z;
+        c_array[i] = C + i * len_C;
+      }
+
+      cblas_sgemm_batch(CblasRowMajor, &trans_a, &trans_b, &num_knn,
+                        &num_knn, &dim, &alpha, a_array, &dim, a_array, &dim,
+                        &beta, c_array, &num_knn, 1, &group_size);
+    }
+
+    for (uint32_t i = 0; i < num_frame; i++)
+    {
+      float* const Ci = C + i * len_C;
+      float* const b = w + i * model.num_knn_;
+
+      double sum(0);
+      for (uint32_t m = 0; m < model.num_knn_; m++)
+        sum += Ci[m * model.num_knn_ + m];
+      sum = sum * model.beta_;
+      for (uint32_t m = 0; m < model.num_knn_; m++)
+        Ci[m * model.num_knn_ + m] += sum;
+
+      for (uint32_t m = 0; m < model.num_knn_; m++)
+        b[m] = 1;
+
+      // solve
+      bool solved(false);
+      switch (model.num_knn_)
+      {
+        case 1:
+          solved = solve_small<1>(Ci, b);
+          break;
+        case 2:
+          solved = solve_small<2>(Ci, b);
+          break;
+        case 3:
+          solved = solve_small<3>(Ci, b);
+          break;
+        case 4:
+          solved = solve_small<4>(Ci, b);
+          break;
+        case 5:
+          solved = solve_small<5>(Ci, b);
+          break;
+        case 6:
+          solved = solve_small<6>(Ci, b);
+          break;
+        case 7:
+          solved = solve_small<7>(Ci, b);
+          break;
+        case 8:
+          solved = solve_small<8>(Ci, b);
+          break;
+        default:
+          break;
+      }
+
+      if (!solved)
+      {
+        char upper_triangle = 'U';
+        int INFO;
+        int int_one = 1;
+        const int num_knn = (int) model.num_knn_;
+        sposv(&upper_triangle, &num_knn, &int_one, Ci, &num_knn, b, &num_knn,
+              &INFO);
+      }
+
+      sum = 0;
+
+      for (uint32_t m = 0; m < model.num_knn_; m++)
+        sum += b[m];
+      cblas_sscal(model.num_knn_, 1.0 / sum, b, 1);
+    }
+  }
+
+}
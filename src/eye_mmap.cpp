@@ -0,0 +1,76 @@
+/*
+ * eye_mmap.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_mmap.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace EYE
+{
+  uint64_t fnv1a_checksum(const void* data, const size_t len)
+  {
+    const uint8_t* p = (const uint8_t*) data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+    {
+      hash ^= p[i];
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  MappedFile::MappedFile()
+      : data_(NULL),
+        size_(0)
+  {
+  }
+
+  MappedFile::~MappedFile()
+  {
+    Close();
+  }
+
+  bool MappedFile::Open(const char* filename)
+  {
+    Close();
+
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0)
+    {
+      close(fd);
+      return false;
+    }
+
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after closing the descriptor
+    close(fd);
+    if (addr == MAP_FAILED)
+      return false;
+
+    data_ = (uint8_t*) addr;
+    size_ = st.st_size;
+
+    return true;
+  }
+
+  void MappedFile::Close()
+  {
+    if (data_ != NULL)
+    {
+      munmap(data_, size_);
+      data_ = NULL;
+      size_ = 0;
+    }
+  }
+}
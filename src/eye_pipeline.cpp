@@ -0,0 +1,175 @@
+/*
+ * eye_pipeline.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_pipeline.hpp"
+
+#include <cstring>
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+
+namespace EYE
+{
+  Pipeline::Pipeline()
+      : width_(0),
+        height_(0),
+        quantized_(false),
+        has_setup_(false),
+        workspace_(NULL)
+  {
+    set_workspace(NULL);
+  }
+
+  Pipeline::~Pipeline()
+  {
+    Clear();
+  }
+
+  void Pipeline::Clear()
+  {
+    dsift_.Clear();
+    llc_.Clear();
+    spm_ = SPM();
+    spm_.set_workspace(get_workspace());
+
+    width_ = 0;
+    height_ = 0;
+    quantized_ = false;
+    has_setup_ = false;
+
+    frames_.clear();
+    descrs_.clear();
+    descrs_u8_.clear();
+    pos_.clear();
+    codes_.index.clear();
+    codes_.weight.clear();
+    own_workspace_.Clear();
+  }
+
+  void Pipeline::set_workspace(Workspace* const workspace)
+  {
+    workspace_ = workspace;
+    dsift_.set_workspace(get_workspace());
+    llc_.set_workspace(get_workspace());
+    spm_.set_workspace(get_workspace());
+  }
+
+  Status Pipeline::SetUp(const uint32_t width, const uint32_t height)
+  {
+    if (llc_.get_base() == NULL)
+    {
+      cerr << "ERROR: must set the base of the LLC before." << endl;
+      return STATUS_NOT_SETUP;
+    }
+
+    has_setup_ = false;
+    Status status = dsift_.SetUp(width, height);
+    if (status == STATUS_OK)
+      status = llc_.SetUp();
+    if (status == STATUS_OK)
+      status = spm_.SetUp(width, height);
+    if (status != STATUS_OK)
+      return status;
+
+    width_ = width;
+    height_ = height;
+    has_setup_ = true;
+    return STATUS_OK;
+  }
+
+  Status Pipeline::Process(const float* gray_img, const uint32_t width,
+                           const uint32_t height,
+                           shared_ptr<float>* const spm_code)
+  {
+    if (spm_code == NULL)
+    {
+      cerr << "Pipeline::Process. ERROR: Null pointer of output" << endl;
+      return STATUS_NULL_POINTER;
+    }
+
+    if (!has_setup_)
+    {
+      const Status status = SetUp(width, height);
+      if (status != STATUS_OK)
+        return status;
+    }
+
+    shared_ptr<float> code(new float[get_code_len()]);
+    const Status status = Process(gray_img, width, height, code.get());
+    if (status == STATUS_OK)
+      spm_code->swap(code);
+    return status;
+  }
+
+  Status Pipeline::Process(const float* gray_img, const uint32_t width,
+                           const uint32_t height, float* const spm_code)
+  {
+    if (gray_img == NULL || spm_code == NULL)
+    {
+      cerr << "ERROR: Input for Pipeline::Process" << endl;
+      return STATUS_NULL_POINTER;
+    }
+
+    Status status(STATUS_OK);
+    if (!has_setup_)
+      status = SetUp(width, height);
+    else if (width != width_ || height != height_)
+    {
+      // the LLC does not depend on the image size
+      status = dsift_.SetUp(width, height);
+      if (status == STATUS_OK)
+        status = spm_.SetUp(width, height);
+      if (status == STATUS_OK)
+      {
+        width_ = width;
+        height_ = height;
+      }
+    }
+    if (status != STATUS_OK)
+      return status;
+
+    // 1. dense sift
+    uint32_t dim(0);
+    if (quantized_)
+      status = dsift_.Extract(gray_img, width, height, &frames_, &descrs_u8_,
+                              &dim);
+    else
+      status = dsift_.Extract(gray_img, width, height, &frames_, &descrs_,
+                              &dim);
+    if (status != STATUS_OK)
+      return status;
+    const uint32_t num_frame = frames_.size();
+
+    const uint32_t num_base = llc_.get_num_base();
+    if (num_frame == 0)
+    {
+      memset(spm_code, 0, sizeof(float) * get_code_len());
+      return STATUS_OK;
+    }
+
+    // 2. sparse codes, num_knn non-zeros per frame
+    if (quantized_)
+      status = llc_.Encode_sparse(&descrs_u8_[0], dim, num_frame, &codes_);
+    else
+      status = llc_.Encode_sparse(&descrs_[0], dim, num_frame, &codes_);
+    if (status != STATUS_OK)
+      return status;
+
+    // 3. max pooling of the non-zeros
+    pos_.resize(2 * num_frame);
+    for (uint32_t i = 0; i < num_frame; ++i)
+    {
+      pos_[2 * i] = frames_[i].x;
+      pos_[2 * i + 1] = frames_[i].y;
+    }
+    return spm_.MaxPooling(&codes_.index[0], &codes_.weight[0],
+                           codes_.num_knn, num_base, num_frame, &pos_[0],
+                           spm_code);
+  }
+
+}
@@ -0,0 +1,233 @@
+/*
+ * eye_pq.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_pq.hpp"
+#include "EYE/eye_knn.hpp"
+#include "EYE/eye_thread.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+using std::cerr;
+using std::endl;
+
+namespace EYE
+{
+  namespace
+  {
+    typedef std::pair<float, uint32_t> Neighbor;
+
+    inline float squared_l2(const float* const a, const float* const b,
+                            const uint32_t dim)
+    {
+      float d(0);
+      for (uint32_t k = 0; k < dim; ++k)
+        d += (a[k] - b[k]) * (a[k] - b[k]);
+      return d;
+    }
+  }
+
+  PQIndex::PQIndex()
+      : base_(NULL),
+        dim_(0),
+        num_base_(0),
+        sub_dim_(0),
+        num_centroids_(0),
+        num_subspaces_(DEFAULT_NUM_SUBSPACES),
+        num_threads_(DEFAULT_NUM_THREADS)
+  {
+    // the subspaces are low dimensional, the exact assignment is cheap
+    trainer_.set_algorithm(CodeBook::KMEANS_LLOYD);
+    trainer_.set_seeding(CodeBook::SEED_KMEANSPP);
+    trainer_.set_max_iter(DEFAULT_TRAIN_ITER);
+  }
+
+  PQIndex::~PQIndex()
+  {
+    Clear();
+  }
+
+  void PQIndex::Clear()
+  {
+    base_ = NULL;
+    dim_ = 0;
+    num_base_ = 0;
+    sub_dim_ = 0;
+    num_centroids_ = 0;
+    centroids_.clear();
+    codes_.clear();
+  }
+
+  Status PQIndex::SetUp(const float* const base, const uint32_t dim,
+                        const uint32_t num_base)
+  {
+    if (base == NULL || dim == 0 || num_base == 0)
+    {
+      cerr << "ERROR in PQIndex::SetUp" << endl;
+      return (base == NULL ? STATUS_NULL_POINTER : STATUS_INVALID_ARGUMENT);
+    }
+    if (dim % num_subspaces_ != 0)
+    {
+      cerr << "ERROR: dim must be a multiple of the number of subspaces."
+           << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    Clear();
+    base_ = base;
+    dim_ = dim;
+    num_base_ = num_base;
+
+    const uint32_t M = num_subspaces_;
+    sub_dim_ = dim_ / M;
+    num_centroids_ = std::min((uint32_t) MAX_NUM_CENTROIDS, num_base_);
+
+    centroids_.resize((size_t) M * num_centroids_ * sub_dim_);
+    codes_.resize((size_t) num_base_ * M);
+
+    vector<float> sub((size_t) num_base_ * sub_dim_);
+    vector<vl_uint32> assign(num_base_);
+
+    ExactKNN knn;
+    knn.set_num_threads(num_threads_);
+
+    for (uint32_t m = 0; m < M; ++m)
+    {
+      for (uint32_t i = 0; i < num_base_; ++i)
+        memcpy(&sub[(size_t) i * sub_dim_],
+               base_ + (size_t) i * dim_ + m * sub_dim_,
+               sizeof(float) * sub_dim_);
+
+      Status status = trainer_.GenKMeans(&sub[0], num_base_, sub_dim_,
+                                         num_centroids_);
+      float* const centroids = &centroids_[(size_t) m * num_centroids_
+          * sub_dim_];
+      if (status == STATUS_OK)
+      {
+        memcpy(centroids, trainer_.get_clusters(),
+               sizeof(float) * num_centroids_ * sub_dim_);
+
+        // code of every base vector in this subspace
+        status = knn.SetUp(centroids, sub_dim_, num_centroids_);
+      }
+      if (status == STATUS_OK)
+        status = knn.Search(&sub[0], num_base_, 1, &assign[0], NULL);
+      if (status != STATUS_OK)
+      {
+        Clear();
+        return status;
+      }
+      for (uint32_t i = 0; i < num_base_; ++i)
+        codes_[(size_t) i * M + m] = (uint8_t) assign[i];
+    }
+    return STATUS_OK;
+  }
+
+  Status PQIndex::Search(const float* const query, const uint32_t num_query,
+                         const uint32_t num_knn, const uint32_t max_comp,
+                         vl_uint32* const index, float* const dist,
+                         Workspace* const workspace) const
+  {
+    return Search(query, num_query, num_knn, max_comp, index, dist, workspace,
+                  num_threads_);
+  }
+
+  Status PQIndex::Search(const float* const query, const uint32_t num_query,
+                         const uint32_t num_knn, const uint32_t max_comp,
+                         vl_uint32* const index, float* const dist,
+                         Workspace* const workspace,
+                         const uint32_t threads) const
+  {
+    if (codes_.empty())
+    {
+      cerr << "ERROR: Must call PQIndex::SetUp() before." << endl;
+      return STATUS_NOT_SETUP;
+    }
+    if (query == NULL || index == NULL)
+    {
+      cerr << "ERROR in PQIndex::Search" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (num_knn == 0 || num_knn > num_base_)
+    {
+      cerr << "ERROR in PQIndex::Search" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    const uint32_t M = dim_ / sub_dim_;
+    const uint32_t Ks = num_centroids_;
+    // number of candidates re-ranked with the exact distances
+    const uint32_t num_cand = std::min(num_base_, std::max(max_comp, num_knn));
+    const int num_threads = get_real_num_threads(threads);
+
+    Workspace local;
+    Workspace& ws = (workspace == NULL ? local : *workspace);
+    WorkspaceScope scope(ws);
+    float* const tables = ws.alloc<float>((size_t) num_threads * M * Ks);
+    Neighbor* const heaps = ws.alloc<Neighbor>(
+        (size_t) num_threads * num_cand);
+
+#pragma omp parallel if (num_threads > 1) num_threads(num_threads)
+    {
+      float* const table = tables + (size_t) get_thread_id() * M * Ks;
+      Neighbor* const heap = heaps + (size_t) get_thread_id() * num_cand;
+
+#pragma omp for schedule(dynamic, 16)
+      for (int q = 0; q < (int) num_query; ++q)
+      {
+        const float* const x = query + (size_t) q * dim_;
+
+        // distances of every subvector to every centroid
+        for (uint32_t m = 0; m < M; ++m)
+          for (uint32_t c = 0; c < Ks; ++c)
+            table[m * Ks + c] = squared_l2(
+                x + m * sub_dim_,
+                &centroids_[((size_t) m * Ks + c) * sub_dim_], sub_dim_);
+
+        // the num_cand smallest approximate distances in a max-heap
+        uint32_t num_heap(0);
+        const uint8_t* code = &codes_[0];
+        for (uint32_t i = 0; i < num_base_; ++i, code += M)
+        {
+          float d(0);
+          for (uint32_t m = 0; m < M; ++m)
+            d += table[m * Ks + code[m]];
+
+          if (num_heap < num_cand)
+          {
+            heap[num_heap++] = Neighbor(d, i);
+            std::push_heap(heap, heap + num_heap);
+          }
+          else if (d < heap[0].first)
+          {
+            std::pop_heap(heap, heap + num_heap);
+            heap[num_heap - 1] = Neighbor(d, i);
+            std::push_heap(heap, heap + num_heap);
+          }
+        }
+
+        // re-rank
+        for (uint32_t j = 0; j < num_heap; ++j)
+          heap[j].first = squared_l2(x, base_ + (size_t) heap[j].second * dim_,
+                                     dim_);
+        std::partial_sort(heap, heap + num_knn, heap + num_heap);
+
+        for (uint32_t k = 0; k < num_knn; ++k)
+        {
+          index[(size_t) q * num_knn + k] = heap[k].second;
+          if (dist != NULL)
+            dist[(size_t) q * num_knn + k] = heap[k].first;
+        }
+      }
+    }
+    return STATUS_OK;
+  }
+
+}
@@ -0,0 +1,403 @@
+/*
+ * eye_simd.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_simd.hpp"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EYE_X86 1
+#include <immintrin.h>
+#endif
+
+namespace EYE
+{
+  namespace
+  {
+    typedef void (*BinaryKernel)(float* const, const float* const,
+                                 const uint32_t);
+    typedef void (*ScaleKernel)(float* const, const float, const uint32_t);
+    typedef void (*AxpyKernel)(float* const, const float, const float* const,
+                               const uint32_t);
+    typedef uint32_t (*DotU8Kernel)(const uint8_t* const,
+                                    const uint8_t* const, const uint32_t);
+
+    void max_scalar(float* const out, const float* const in, const uint32_t n)
+    {
+      for (uint32_t i = 0; i < n; ++i)
+        out[i] = std::max(out[i], in[i]);
+    }
+    void add_scalar(float* const out, const float* const in, const uint32_t n)
+    {
+      for (uint32_t i = 0; i < n; ++i)
+        out[i] += in[i];
+    }
+    void scale_scalar(float* const out, const float scale, const uint32_t n)
+    {
+      for (uint32_t i = 0; i < n; ++i)
+        out[i] *= scale;
+    }
+    void axpy_scalar(float* const out, const float a, const float* const in,
+                     const uint32_t n)
+    {
+      for (uint32_t i = 0; i < n; ++i)
+        out[i] += a * in[i];
+    }
+    uint32_t dot_u8_scalar(const uint8_t* const a, const uint8_t* const b,
+                           const uint32_t n)
+    {
+      uint32_t s = 0;
+      for (uint32_t i = 0; i < n; ++i)
+        s += (uint32_t) a[i] * b[i];
+      return s;
+    }
+
+#ifdef EYE_X86
+    // SSE is part of every x86-64 target
+    void max_sse(float* const out, const float* const in, const uint32_t n)
+    {
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i, _mm_max_ps(_mm_loadu_ps(out + i),
+                                          _mm_loadu_ps(in + i)));
+      max_scalar(out + i, in + i, n - i);
+    }
+    void add_sse(float* const out, const float* const in, const uint32_t n)
+    {
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i),
+                                          _mm_loadu_ps(in + i)));
+      add_scalar(out + i, in + i, n - i);
+    }
+    void scale_sse(float* const out, const float scale, const uint32_t n)
+    {
+      const __m128 s = _mm_set1_ps(scale);
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(out + i), s));
+      scale_scalar(out + i, scale, n - i);
+    }
+
+    void axpy_sse(float* const out, const float a, const float* const in,
+                  const uint32_t n)
+    {
+      const __m128 s = _mm_set1_ps(a);
+      uint32_t i = 0;
+      for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(out + i,
+                      _mm_add_ps(_mm_loadu_ps(out + i),
+                                 _mm_mul_ps(_mm_loadu_ps(in + i), s)));
+      axpy_scalar(out + i, a, in + i, n - i);
+    }
+
+    // the bytes are widened to int16 and multiplied with madd, which is
+    // exact. maddubs would be faster but it needs one signed operand and
+    // saturates for uint8 * uint8.
+    uint32_t dot_u8_sse(const uint8_t* const a, const uint8_t* const b,
+                        const uint32_t n)
+    {
+      const __m128i zero = _mm_setzero_si128();
+      __m128i acc = _mm_setzero_si128();
+      uint32_t i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        const __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero),
+                                                _mm_unpacklo_epi8(vb, zero)));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero),
+                                                _mm_unpackhi_epi8(vb, zero)));
+      }
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+      acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+      return (uint32_t) _mm_cvtsi128_si32(acc) + dot_u8_scalar(a + i, b + i,
+                                                               n - i);
+    }
+
+    __attribute__((target("avx2")))
+    void max_avx2(float* const out, const float* const in, const uint32_t n)
+    {
+      uint32_t i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        _mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_loadu_ps(out + i),
+                                                _mm256_loadu_ps(in + i)));
+        _mm256_storeu_ps(out + i + 8,
+                         _mm256_max_ps(_mm256_loadu_ps(out + i + 8),
+                                       _mm256_loadu_ps(in + i + 8)));
+      }
+      for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_loadu_ps(out + i),
+                                                _mm256_loadu_ps(in + i)));
+      max_scalar(out + i, in + i, n - i);
+    }
+    __attribute__((target("avx2")))
+    void add_avx2(float* const out, const float* const in, const uint32_t n)
+    {
+      uint32_t i = 0;
+      for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i),
+                                                _mm256_loadu_ps(in + i)));
+      add_scalar(out + i, in + i, n - i);
+    }
+    __attribute__((target("avx2")))
+    void scale_avx2(float* const out, const float scale, const uint32_t n)
+    {
+      const __m256 s = _mm256_set1_ps(scale);
+      uint32_t i = 0;
+      for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(out + i), s));
+      scale_scalar(out + i, scale, n - i);
+    }
+
+    // AVX2 does not imply FMA, the product stays rounded
+    __attribute__((target("avx2")))
+    void axpy_avx2(float* const out, const float a, const float* const in,
+                   const uint32_t n)
+    {
+      const __m256 s = _mm256_set1_ps(a);
+      uint32_t i = 0;
+      for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(out + i,
+                         _mm256_add_ps(_mm256_loadu_ps(out + i),
+                                       _mm256_mul_ps(_mm256_loadu_ps(in + i),
+                                                     s)));
+      axpy_scalar(out + i, a, in + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t dot_u8_avx2(const uint8_t* const a, const uint8_t* const b,
+                         const uint32_t n)
+    {
+      __m256i acc = _mm256_setzero_si256();
+      uint32_t i = 0;
+      for (; i + 16 <= n; i += 16)
+      {
+        const __m256i va = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*) (a + i)));
+        const __m256i vb = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*) (b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+      }
+      __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                _mm256_extracti128_si256(acc, 1));
+      s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+      s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+      return (uint32_t) _mm_cvtsi128_si32(s) + dot_u8_scalar(a + i, b + i,
+                                                             n - i);
+    }
+
+    __attribute__((target("avx512f")))
+    void max_avx512(float* const out, const float* const in, const uint32_t n)
+    {
+      uint32_t i = 0;
+      for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(out + i, _mm512_max_ps(_mm512_loadu_ps(out + i),
+                                                _mm512_loadu_ps(in + i)));
+      if (i < n)
+      {
+        // masked tail instead of the scalar loop
+        const __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(
+            out + i, mask,
+            _mm512_max_ps(_mm512_maskz_loadu_ps(mask, out + i),
+                          _mm512_maskz_loadu_ps(mask, in + i)));
+      }
+    }
+    __attribute__((target("avx512f")))
+    void add_avx512(float* const out, const float* const in, const uint32_t n)
+    {
+      uint32_t i = 0;
+      for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_loadu_ps(out + i),
+                                                _mm512_loadu_ps(in + i)));
+      if (i < n)
+      {
+        const __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(
+            out + i, mask,
+            _mm512_add_ps(_mm512_maskz_loadu_ps(mask, out + i),
+                          _mm512_maskz_loadu_ps(mask, in + i)));
+      }
+    }
+    __attribute__((target("avx512f")))
+    void scale_avx512(float* const out, const float scale, const uint32_t n)
+    {
+      const __m512 s = _mm512_set1_ps(scale);
+      uint32_t i = 0;
+      for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(out + i), s));
+      if (i < n)
+      {
+        const __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(out + i, mask,
+                              _mm512_mul_ps(_mm512_maskz_loadu_ps(mask,
+                                                                  out + i),
+                                            s));
+      }
+    }
+    // AVX-512F has FMA, which the compiler would contract the product and
+    // the sum into
+    __attribute__((target("avx512f"), optimize("fp-contract=off")))
+    void axpy_avx512(float* const out, const float a, const float* const in,
+                     const uint32_t n)
+    {
+      const __m512 s = _mm512_set1_ps(a);
+      uint32_t i = 0;
+      for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(out + i,
+                         _mm512_add_ps(_mm512_loadu_ps(out + i),
+                                       _mm512_mul_ps(_mm512_loadu_ps(in + i),
+                                                     s)));
+      if (i < n)
+      {
+        const __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps(
+            out + i, mask,
+            _mm512_add_ps(_mm512_maskz_loadu_ps(mask, out + i),
+                          _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, in + i),
+                                        s)));
+      }
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    uint32_t dot_u8_avx512(const uint8_t* const a, const uint8_t* const b,
+                           const uint32_t n)
+    {
+      __m512i acc = _mm512_setzero_si512();
+      uint32_t i = 0;
+      for (; i + 32 <= n; i += 32)
+      {
+        const __m512i va = _mm512_cvtepu8_epi16(
+            _mm256_loadu_si256((const __m256i*) (a + i)));
+        const __m512i vb = _mm512_cvtepu8_epi16(
+            _mm256_loadu_si256((const __m256i*) (b + i)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+      }
+      return (uint32_t) _mm512_reduce_add_epi32(acc)
+          + dot_u8_scalar(a + i, b + i, n - i);
+    }
+#endif
+
+    SimdLevel detect_simd_level()
+    {
+#ifdef EYE_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+      if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+      return SIMD_SSE;
+#else
+      return SIMD_NONE;
+#endif
+    }
+
+    struct Kernels
+    {
+        SimdLevel level;
+        BinaryKernel max;
+        BinaryKernel add;
+        ScaleKernel scale;
+        AxpyKernel axpy;
+        DotU8Kernel dot_u8;
+    };
+
+    Kernels select_kernels()
+    {
+      Kernels k;
+      k.level = detect_simd_level();
+      k.max = max_scalar;
+      k.add = add_scalar;
+      k.scale = scale_scalar;
+      k.axpy = axpy_scalar;
+      k.dot_u8 = dot_u8_scalar;
+#ifdef EYE_X86
+      switch (k.level)
+      {
+        case SIMD_AVX512:
+          k.max = max_avx512;
+          k.add = add_avx512;
+          k.scale = scale_avx512;
+          k.axpy = axpy_avx512;
+          // the 512-bit integer multiply is in AVX512BW
+          k.dot_u8 = (__builtin_cpu_supports("avx512bw") ?
+              dot_u8_avx512 : dot_u8_avx2);
+          break;
+        case SIMD_AVX2:
+          k.max = max_avx2;
+          k.add = add_avx2;
+          k.scale = scale_avx2;
+          k.axpy = axpy_avx2;
+          k.dot_u8 = dot_u8_avx2;
+          break;
+        case SIMD_SSE:
+          k.max = max_sse;
+          k.add = add_sse;
+          k.scale = scale_sse;
+          k.axpy = axpy_sse;
+          k.dot_u8 = dot_u8_sse;
+          break;
+        default:
+          break;
+      }
+#endif
+      return k;
+    }
+
+    // resolved once when the library is loaded
+    const Kernels kernels = select_kernels();
+  }
+
+  SimdLevel get_simd_level()
+  {
+    return kernels.level;
+  }
+
+  const char* get_simd_name(const SimdLevel level)
+  {
+    switch (level)
+    {
+      case SIMD_SSE:
+        return "sse";
+      case SIMD_AVX2:
+        return "avx2";
+      case SIMD_AVX512:
+        return "avx512";
+      default:
+        return "none";
+    }
+  }
+
+  void vec_max(float* const out, const float* const in, const uint32_t n)
+  {
+    kernels.max(out, in, n);
+  }
+
+  void vec_add(float* const out, const float* const in, const uint32_t n)
+  {
+    kernels.add(out, in, n);
+  }
+
+  void vec_scale(float* const out, const float scale, const uint32_t n)
+  {
+    kernels.scale(out, scale, n);
+  }
+
+  void vec_axpy(float* const out, const float a, const float* const in,
+                const uint32_t n)
+  {
+    kernels.axpy(out, a, in, n);
+  }
+
+  uint32_t dot_u8(const uint8_t* const a, const uint8_t* const b,
+                  const uint32_t n)
+  {
+    return kernels.dot_u8(a, b, n);
+  }
+}
@@ -0,0 +1,315 @@
+/*
+ * eye_smooth.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_smooth.hpp"
+#include "EYE/eye_simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstring>
+
+namespace EYE
+{
+  namespace
+  {
+    // out[x] += c * in[x] over a row, the integer pixels are converted on
+    // the fly and give the sums of the float pixels
+    inline void add_row(float* const out, const float c, const float* const in,
+                        const uint32_t n)
+    {
+      vec_axpy(out, c, in, n);
+    }
+    template<typename P>
+    void add_row(float* const out, const float c, const P* const in,
+                 const uint32_t n)
+    {
+      for (uint32_t x = 0; x < n; ++x)
+        out[x] += c * (float) in[x];
+    }
+
+    template<typename P>
+    inline const P* get_row(const P* const src, const size_t stride,
+                            const size_t y)
+    {
+      return reinterpret_cast<const P*>(reinterpret_cast<const char*>(src)
+          + y * stride);
+    }
+
+    template<typename P>
+    void separable(float* const out, const P* const src, const size_t stride,
+                   const uint32_t width, const uint32_t height,
+                   const float* const kernel, const uint32_t radius,
+                   float* const buffer)
+    {
+      const int r = radius;
+      const int last = (int) height - 1;
+
+      // along the columns, whole rows at once: from the top row and the
+      // last sample of the kernel, as vl_imconvcol_vf sums
+      for (int y = 0; y <= last; ++y)
+      {
+        float* const o = out + (size_t) y * width;
+        memset(o, 0, sizeof(float) * width);
+        for (int k = 0; k <= 2 * r; ++k)
+        {
+          const int row = std::min(last, std::max(0, y - r + k));
+          add_row(o, kernel[2 * r - k], get_row(src, stride, row), width);
+        }
+      }
+
+      // along the rows, in place from a copy padded by continuity, the
+      // shifted copies are contiguous
+      for (uint32_t y = 0; y < height; ++y)
+      {
+        float* const o = out + (size_t) y * width;
+        std::fill(buffer, buffer + r, o[0]);
+        memcpy(buffer + r, o, sizeof(float) * width);
+        std::fill(buffer + r + width, buffer + 2 * r + width, o[width - 1]);
+
+        memset(o, 0, sizeof(float) * width);
+        for (int k = 0; k <= 2 * r; ++k)
+          vec_axpy(o, kernel[2 * r - k], buffer + k, width);
+      }
+    }
+
+    // Deriche's gaussian as the sum of two complex first order filters:
+    // g(n) = sum_j Re(a_j z_j^|n|), with the coefficients of "Recursively
+    // implementing the Gaussian and its derivatives", 1993
+    struct Deriche
+    {
+        explicit Deriche(const float sigma)
+        {
+          const double a[2][2] = { { 1.680, 3.735 }, { -0.6803, -0.2598 } };
+          const double b[2] = { 1.783, 1.723 };
+          const double w[2] = { 0.6318, 1.997 };
+
+          std::complex<double> coef[2];
+          std::complex<double> pole[2];
+          double sum(0);
+          for (int j = 0; j < 2; ++j)
+          {
+            // a0 cos + a1 sin is the real part of (a0 - i a1) e^(i w)
+            coef[j] = std::complex<double>(a[j][0], -a[j][1]);
+            pole[j] = std::polar(std::exp(-b[j] / sigma), w[j] / sigma);
+            // sum over every n
+            sum += std::real(coef[j] * (1.0 + pole[j]) / (1.0 - pole[j]));
+          }
+
+          for (int j = 0; j < 2; ++j)
+          {
+            coef[j] /= sum;
+            ar[j] = coef[j].real();
+            ai[j] = coef[j].imag();
+            zr[j] = pole[j].real();
+            zi[j] = pole[j].imag();
+            // the state of a constant input, before the first sample of
+            // the causal part and after the last one of the anti-causal part
+            const std::complex<double> causal = 1.0 / (1.0 - pole[j]);
+            const std::complex<double> anti = pole[j] / (1.0 - pole[j]);
+            cr[j] = causal.real();
+            ci[j] = causal.imag();
+            nr[j] = anti.real();
+            ni[j] = anti.imag();
+          }
+        }
+
+        float ar[2], ai[2];
+        float zr[2], zi[2];
+        float cr[2], ci[2];
+        float nr[2], ni[2];
+    };
+
+    // the recursive filter along the columns of a width x height image
+    template<typename P>
+    void recursive_columns(float* const out, const P* const src,
+                           const size_t stride, const uint32_t width,
+                           const uint32_t height, const Deriche& f)
+    {
+      // the states of a chunk of columns stay in cache while the rows are
+      // read one after the other, and cannot alias them
+      enum
+      {
+        CHUNK = 256
+      };
+      float sr0[CHUNK], si0[CHUNK], sr1[CHUNK], si1[CHUNK];
+      const float ar0 = f.ar[0], ai0 = f.ai[0], ar1 = f.ar[1], ai1 = f.ai[1];
+      const float zr0 = f.zr[0], zi0 = f.zi[0], zr1 = f.zr[1], zi1 = f.zi[1];
+
+      for (uint32_t x0 = 0; x0 < width; x0 += CHUNK)
+      {
+        const uint32_t num = std::min<uint32_t>(CHUNK, width - x0);
+
+        // causal part, from the first row repeated before the image: the
+        // state before the first row is the one of the first row
+        const P* in = get_row(src, stride, 0) + x0;
+        for (uint32_t x = 0; x < num; ++x)
+        {
+          const float v = in[x];
+          sr0[x] = v * f.cr[0];
+          si0[x] = v * f.ci[0];
+          sr1[x] = v * f.cr[1];
+          si1[x] = v * f.ci[1];
+        }
+        for (uint32_t y = 0; y < height; ++y)
+        {
+          in = get_row(src, stride, y) + x0;
+          float* const o = out + (size_t) y * width + x0;
+          for (uint32_t x = 0; x < num; ++x)
+          {
+            // s = z * s + v
+            const float v = in[x];
+            const float r0 = zr0 * sr0[x] - zi0 * si0[x] + v;
+            si0[x] = zr0 * si0[x] + zi0 * sr0[x];
+            sr0[x] = r0;
+            const float r1 = zr1 * sr1[x] - zi1 * si1[x] + v;
+            si1[x] = zr1 * si1[x] + zi1 * sr1[x];
+            sr1[x] = r1;
+            o[x] = ar0 * r0 - ai0 * si0[x] + ar1 * r1 - ai1 * si1[x];
+          }
+        }
+
+        // anti-causal part, from the last row repeated after the image: the
+        // state after the image is the one of the last row
+        in = get_row(src, stride, height - 1) + x0;
+        for (uint32_t x = 0; x < num; ++x)
+        {
+          const float v = in[x];
+          sr0[x] = v * f.nr[0];
+          si0[x] = v * f.ni[0];
+          sr1[x] = v * f.nr[1];
+          si1[x] = v * f.ni[1];
+        }
+        for (int y = (int) height - 1; y >= 0; --y)
+        {
+          // s = z * (s + v) with v the row below, the last row repeated
+          in = get_row(src, stride, std::min<int>(y + 1, height - 1)) + x0;
+          float* const o = out + (size_t) y * width + x0;
+          for (uint32_t x = 0; x < num; ++x)
+          {
+            const float v = in[x];
+            const float r0 = sr0[x] + v;
+            const float i0 = si0[x];
+            sr0[x] = zr0 * r0 - zi0 * i0;
+            si0[x] = zr0 * i0 + zi0 * r0;
+            const float r1 = sr1[x] + v;
+            const float i1 = si1[x];
+            sr1[x] = zr1 * r1 - zi1 * i1;
+            si1[x] = zr1 * i1 + zi1 * r1;
+            o[x] += ar0 * sr0[x] - ai0 * si0[x] + ar1 * sr1[x] - ai1 * si1[x];
+          }
+        }
+      }
+    }
+
+    // dst is width x height, src height x width. The rows of a block of
+    // dst are often 4 KB apart, a few of them share the sets of the cache.
+    void transpose(float* const dst, const float* const src,
+                   const uint32_t width, const uint32_t height)
+    {
+      enum
+      {
+        BLOCK = 8
+      };
+      for (uint32_t y0 = 0; y0 < height; y0 += BLOCK)
+        for (uint32_t x0 = 0; x0 < width; x0 += BLOCK)
+        {
+          const uint32_t y1 = std::min<uint32_t>(height, y0 + BLOCK);
+          const uint32_t x1 = std::min<uint32_t>(width, x0 + BLOCK);
+          for (uint32_t y = y0; y < y1; ++y)
+            for (uint32_t x = x0; x < x1; ++x)
+              dst[(size_t) x * height + y] = src[(size_t) y * width + x];
+        }
+    }
+
+    template<typename P>
+    void recursive(float* const out, const P* const src, const size_t stride,
+                   const uint32_t width, const uint32_t height,
+                   const float sigma, float* const buffer)
+    {
+      const Deriche f(sigma);
+
+      // the rows are filtered as the columns of the transposed image, so
+      // that every pass runs along the rows in memory. The passes go back
+      // and forth between out and buffer.
+      recursive_columns(buffer, src, stride, width, height, f);
+      transpose(out, buffer, width, height);
+      recursive_columns(buffer, out, height * sizeof(float), height, width,
+                        f);
+      transpose(out, buffer, height, width);
+    }
+  }
+
+  void get_gaussian_kernel(const float sigma, vector<float>* kernel)
+  {
+    const int radius = (int) std::ceil(3.0 * sigma);
+    kernel->assign(2 * radius + 1, 0);
+
+    // the samples in double as in vlfeat, the mass sums them before they
+    // are rounded to float
+    float mass(1);
+    (*kernel)[radius] = 1;
+    for (int k = 1; k <= radius; ++k)
+    {
+      const double x = (double) k / sigma;
+      const double g = std::exp(-0.5 * x * x);
+      mass += g + g;
+      (*kernel)[radius - k] = g;
+      (*kernel)[radius + k] = g;
+    }
+    for (size_t k = 0; k < kernel->size(); ++k)
+      (*kernel)[k] /= mass;
+  }
+
+  void smooth_separable(float* const out, const float* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float* const kernel,
+                        const uint32_t radius, float* const buffer)
+  {
+    separable(out, src, stride, width, height, kernel, radius, buffer);
+  }
+
+  void smooth_separable(float* const out, const uint8_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float* const kernel,
+                        const uint32_t radius, float* const buffer)
+  {
+    separable(out, src, stride, width, height, kernel, radius, buffer);
+  }
+
+  void smooth_separable(float* const out, const uint16_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float* const kernel,
+                        const uint32_t radius, float* const buffer)
+  {
+    separable(out, src, stride, width, height, kernel, radius, buffer);
+  }
+
+  void smooth_recursive(float* const out, const float* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float sigma,
+                        float* const buffer)
+  {
+    recursive(out, src, stride, width, height, sigma, buffer);
+  }
+
+  void smooth_recursive(float* const out, const uint8_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float sigma,
+                        float* const buffer)
+  {
+    recursive(out, src, stride, width, height, sigma, buffer);
+  }
+
+  void smooth_recursive(float* const out, const uint16_t* const src,
+                        const size_t stride, const uint32_t width,
+                        const uint32_t height, const float sigma,
+                        float* const buffer)
+  {
+    recursive(out, src, stride, width, height, sigma, buffer);
+  }
+}
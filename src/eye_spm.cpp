@@ -6,9 +6,11 @@
  */
 
 #include "EYE/eye_spm.hpp"
+#include "EYE/eye_simd.hpp"
 
 #include <mkl.h>
 
+#include <algorithm>
 #include <iostream>
 #include <cstring>
 #include <cmath>
@@ -23,6 +25,7 @@ namespace EYE
         img_height_(0),
         finest_num_blk_(0),
         total_num_blk_(0),
+        workspace_(NULL),
         has_setup_(false),
         same_geom_(true),
         has_built_map_(false)
@@ -33,10 +36,25 @@ namespace EYE
   void SPM::init_with_default_parameter()
   {
     num_spm_level_ = DEFAULT_SPM_LEVEL;
+    pool_method_ = DEFAULT_POOL_METHOD;
   }
 
-  void SPM::SetUp(const uint32_t width, const uint32_t height)
+  Status SPM::SetUp(const uint32_t width, const uint32_t height)
   {
+    if (width == 0 || height == 0 || num_spm_level_ <= 0)
+    {
+      cerr << "ERROR: check the image size and the SPM levels" << endl;
+      has_setup_ = false;
+      return STATUS_INVALID_ARGUMENT;
+    }
+    // the finest blocks are indexed with uint16
+    if (num_spm_level_ > 9)
+    {
+      cerr << "ERROR: too many SPM levels" << endl;
+      has_setup_ = false;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
     img_width_ = width;
     img_height_ = height;
 
@@ -50,6 +68,7 @@ namespace EYE
     }
 
     finest_num_blk_ = level_num_blk_[num_spm_level_ - 1];
+    has_built_map_ = false;
 
     blk_start_x_.resize(num_spm_level_);
     blk_end_x_.resize(num_spm_level_);
@@ -100,165 +119,317 @@ namespace EYE
     }
 
     has_setup_ = true;
+    return STATUS_OK;
   }
 
   uint32_t SPM::get_block_start_idx(const uint32_t level, const uint32_t yidx,
-                                    const uint32_t xidx)
+                                    const uint32_t xidx) const
   {
     return (level_start_idx_[level] + yidx * level_num_blk_[level] + xidx);
   }
 
-  void SPM::build_cell_blk_map(const float* const pos, const uint32_t num_data)
+  Status SPM::build_cell_blk_map(const float* const pos,
+                                 const uint32_t num_data)
   {
-    if (same_geom_ && has_built_map_)
-      return;
+    if (!has_setup_)
+    {
+      cerr << "Call SetUp() first" << endl;
+      return STATUS_NOT_SETUP;
+    }
+    if (pos == NULL)
+    {
+      cerr << "ERROR: Input for build_cell_blk_map" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    // a map of another number of descriptors is rebuilt all the same
+    if (same_geom_ && has_built_map_ && cell_blk_.size() == num_data)
+      return STATUS_OK;
 
-    map_blk_cell_.clear();
-    map_cell_blk_.clear();
+    // the coarser levels are pooled from the finest one, so only the finest
+    // block of each descriptor is needed
+    const uint32_t num_blk = finest_num_blk_;
+    const float blk_width = img_width_ * 1.0 / num_blk;
+    const float blk_height = img_height_ * 1.0 / num_blk;
 
+    cell_blk_.resize(num_data);
     for (uint32_t i = 0; i < num_data; ++i)
     {
       const float x = pos[2 * i];
       const float y = pos[2 * i + 1];
 
-      //std::cout << x << " " << y << endl;
+      const uint32_t xidx = std::min<uint32_t>(std::max(0.0f, x / blk_width),
+                                               num_blk - 1);
+      const uint32_t yidx = std::min<uint32_t>(std::max(0.0f, y / blk_height),
+                                               num_blk - 1);
 
-      vector<uint32_t> blk_idx(num_spm_level_, 0);
-      for (uint32_t lv = 0; lv < num_spm_level_; ++lv)
-      {
-        const uint32_t num_blk = level_num_blk_[lv];
-        const float blk_width = img_width_ * 1.0 / num_blk;
-        const float blk_height = img_height_ * 1.0 / num_blk;
+      cell_blk_[i] = yidx * num_blk + xidx;
+    }
 
-        const uint32_t xidx = x / blk_width;
-        const uint32_t yidx = y / blk_height;
-        /*
-         cerr << "lv = " << lv << "xidx = " << xidx << " yidx = " << yidx
-         << endl;*/
+    has_built_map_ = true;
+    return STATUS_OK;
+  }
 
-        blk_idx[lv] = get_block_start_idx(lv, yidx, xidx);
+  Status SPM::check_input(const void* const data, const uint32_t feat_dim,
+                          const uint32_t num_data, const float* const pos,
+                          const float* const spm_code) const
+  {
+    if (!has_setup_)
+    {
+      cerr << "Call SetUp() first" << endl;
+      return STATUS_NOT_SETUP;
+    }
+    if (data == NULL || pos == NULL || spm_code == NULL)
+    {
+      cerr << "ERROR: Input for MaxPooling" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (feat_dim == 0 || num_data == 0)
+    {
+      cerr << "ERROR: Input for MaxPooling" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+    return STATUS_OK;
+  }
 
-        map<uint32_t, vector<uint32_t> >::iterator it = map_blk_cell_.find(
-            blk_idx[lv]);
-        if (it == map_blk_cell_.end())
-        {
-          vector<uint32_t> cells;
-          cells.reserve(512);
-          cells.push_back(i);
-          map_blk_cell_.insert(std::make_pair(blk_idx[lv], cells));
-        }
-        else
-        {
-          it->second.push_back(i);
-        }
-      }
+  Status SPM::MaxPooling(const float* const data, const uint32_t feat_dim,
+                         const uint32_t num_data, const float* const pos,
+                         float* const spm_code)
+  {
+    return pool(data, feat_dim, num_data, pos, POOL_MAX, spm_code);
+  }
 
-      map_cell_blk_.insert(std::make_pair(i, blk_idx));
+  Status SPM::MaxPooling(const float* const data, const uint32_t feat_dim,
+                         const uint32_t num_data, const float* const pos,
+                         shared_ptr<float>* const spm_code)
+  {
+    if (spm_code == NULL)
+    {
+      cerr << "SPM::MaxPooling. ERROR: Null pointer of output" << endl;
+      return STATUS_NULL_POINTER;
     }
 
-    has_built_map_ = true;
+    shared_ptr<float> code(new float[total_num_blk_ * feat_dim]);
+    const Status status = MaxPooling(data, feat_dim, num_data, pos,
+                                     code.get());
+    if (status == STATUS_OK)
+      spm_code->swap(code);
+    return status;
   }
 
-  void SPM::MaxPooling(const float* const data, const uint32_t feat_dim,
-                       const uint32_t num_data, const float* const pos,
-                       float* const spm_code)
+  Status SPM::MaxPooling(const uint32_t* const index,
+                         const float* const weight, const uint32_t num_knn,
+                         const uint32_t feat_dim, const uint32_t num_data,
+                         const float* const pos, float* const spm_code)
   {
-    if (!has_setup_)
+    if (weight == NULL)
     {
-      cerr << "Call SetUp() first" << endl;
-      exit(-1);
+      cerr << "ERROR: Input for MaxPooling" << endl;
+      return STATUS_NULL_POINTER;
     }
-    if (data == NULL
-        || feat_dim == 0|| num_data ==0 || pos == NULL || spm_code==NULL)
+    const Status status = check_input(index, feat_dim, num_data, pos,
+                                      spm_code);
+    if (status != STATUS_OK)
+      return status;
+    if (num_knn == 0)
     {
       cerr << "ERROR: Input for MaxPooling" << endl;
-      exit(-1);
+      return STATUS_INVALID_ARGUMENT;
     }
 
     const uint32_t spm_code_len = total_num_blk_ * feat_dim;
     memset(spm_code, 0, sizeof(float) * spm_code_len);
 
-    //cerr << "start build" << endl;
     build_cell_blk_map(pos, num_data);
 
-    //cerr << "build done" << endl;
+    const uint32_t finest_start = get_block_start_idx(num_spm_level_ - 1, 0,
+                                                      0);
+    const uint32_t num_finest = finest_num_blk_ * finest_num_blk_;
+    float* const finest_code = spm_code + finest_start * feat_dim;
+
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    uint32_t* const blk_count = workspace.alloc<uint32_t>(total_num_blk_);
+    memset(blk_count, 0, sizeof(uint32_t) * total_num_blk_);
+    uint32_t* const finest_count = blk_count + finest_start;
+    uint32_t* const entry_count = workspace.alloc<uint32_t>(
+        num_finest * feat_dim);
+    memset(entry_count, 0, sizeof(uint32_t) * num_finest * feat_dim);
+
+    // only the non-zeros are visited
+    for (uint32_t i = 0; i < num_data; ++i)
+    {
+      const uint32_t blk = cell_blk_[i];
+      ++finest_count[blk];
+
+      for (uint32_t m = 0; m < num_knn; ++m)
+      {
+        const uint32_t entry = blk * feat_dim + index[i * num_knn + m];
+        const float w = weight[i * num_knn + m];
 
-    // compute the finest bin first
+        if (entry_count[entry]++ == 0 || finest_code[entry] < w)
+          finest_code[entry] = w;
+      }
+    }
+
+    // an entry missed by at least one descriptor of its block has also
+    // pooled a zero
+    for (uint32_t i = 0; i < num_data; ++i)
     {
-      const int lv = num_spm_level_ - 1;
-      const uint32_t num_blk = level_num_blk_[lv];
+      const uint32_t blk = cell_blk_[i];
+      for (uint32_t m = 0; m < num_knn; ++m)
+      {
+        const uint32_t entry = blk * feat_dim + index[i * num_knn + m];
+        if (entry_count[entry] < finest_count[blk] && finest_code[entry] < 0)
+          finest_code[entry] = 0;
+      }
+    }
 
-      for (int ybin = 0; ybin < num_blk; ++ybin)
-        for (int xbin = 0; xbin < num_blk; ++xbin)
-        {
-          const int blk_id = get_block_start_idx(lv, ybin, xbin);
-          const vector<uint32_t>& cells = map_blk_cell_.find(blk_id)->second;
-
-          float* const out = spm_code + blk_id * feat_dim;
-          cblas_scopy(feat_dim, data + cells[0] * feat_dim, 1, out, 1);
-
-          for (size_t i = 1; i < cells.size(); ++i)
-          {
-            const float* const in = data + cells[i] * feat_dim;
-            for (size_t dd = 0; dd < feat_dim; ++dd)
-              out[dd] = std::max(out[dd], in[dd]);
-          }
-        }
+    pool_pyramid(POOL_MAX, feat_dim, blk_count, spm_code);
+    return STATUS_OK;
+  }
+
+  Status SPM::Pooling(const float* const data, const uint32_t feat_dim,
+                      const uint32_t num_data, const float* const pos,
+                      float* const spm_code)
+  {
+    return pool(data, feat_dim, num_data, pos, pool_method_, spm_code);
+  }
+
+  Status SPM::Pooling(const float* const data, const uint32_t feat_dim,
+                      const uint32_t num_data, const float* const pos,
+                      shared_ptr<float>* const spm_code)
+  {
+    if (spm_code == NULL)
+    {
+      cerr << "SPM::Pooling. ERROR: Null pointer of output" << endl;
+      return STATUS_NULL_POINTER;
+    }
+
+    shared_ptr<float> code(new float[total_num_blk_ * feat_dim]);
+    const Status status = Pooling(data, feat_dim, num_data, pos, code.get());
+    if (status == STATUS_OK)
+      spm_code->swap(code);
+    return status;
+  }
+
+  Status SPM::pool(const float* const data, const uint32_t feat_dim,
+                   const uint32_t num_data, const float* const pos,
+                   const PoolMethod method, float* const spm_code)
+  {
+    const Status status = check_input(data, feat_dim, num_data, pos,
+                                      spm_code);
+    if (status != STATUS_OK)
+      return status;
+
+    const uint32_t spm_code_len = total_num_blk_ * feat_dim;
+    memset(spm_code, 0, sizeof(float) * spm_code_len);
+
+    build_cell_blk_map(pos, num_data);
+
+    // compute the finest bin first, streaming once over the descriptors.
+    // Empty blocks stay at zero.
+    const uint32_t finest_start = get_block_start_idx(num_spm_level_ - 1, 0,
+                                                      0);
+    float* const finest_code = spm_code + finest_start * feat_dim;
+
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    uint32_t* const blk_count = workspace.alloc<uint32_t>(total_num_blk_);
+    memset(blk_count, 0, sizeof(uint32_t) * total_num_blk_);
+    uint32_t* const finest_count = blk_count + finest_start;
+
+    for (uint32_t i = 0; i < num_data; ++i)
+    {
+      const uint32_t blk = cell_blk_[i];
+      const float* const in = data + i * feat_dim;
+      float* const out = finest_code + blk * feat_dim;
+
+      if (finest_count[blk]++ == 0)
+        memcpy(out, in, sizeof(float) * feat_dim);
+      else if (method == POOL_MAX)
+        vec_max(out, in, feat_dim);
+      else
+        vec_add(out, in, feat_dim);
+    }
+
+    pool_pyramid(method, feat_dim, blk_count, spm_code);
+    return STATUS_OK;
+  }
+
+  Status SPM::PoolPyramid(const PoolMethod method, const uint32_t feat_dim,
+                          float* const spm_code)
+  {
+    if (!has_setup_ || !has_built_map_)
+    {
+      cerr << "Call SetUp() and build_cell_blk_map() first" << endl;
+      return STATUS_NOT_SETUP;
     }
+    if (spm_code == NULL)
+    {
+      cerr << "ERROR: Input for PoolPyramid" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (feat_dim == 0)
+    {
+      cerr << "ERROR: Input for PoolPyramid" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    const uint32_t finest_start = get_block_start_idx(num_spm_level_ - 1, 0,
+                                                      0);
+    Workspace& workspace = *get_workspace();
+    WorkspaceScope scope(workspace);
+    uint32_t* const blk_count = workspace.alloc<uint32_t>(total_num_blk_);
+    memset(blk_count, 0, sizeof(uint32_t) * total_num_blk_);
+    for (size_t i = 0; i < cell_blk_.size(); ++i)
+      ++blk_count[finest_start + cell_blk_[i]];
+
+    pool_pyramid(method, feat_dim, blk_count, spm_code);
+    return STATUS_OK;
+  }
+
 
+  void SPM::pool_pyramid(const PoolMethod method, const uint32_t feat_dim,
+                         uint32_t* const blk_count, float* const spm_code)
+  {
     // compute the remaining bins
     for (int lv = num_spm_level_ - 2; lv >= 0; --lv)
     {
-      const uint32_t level_start_idx = level_start_idx_[lv];
-      const uint32_t prev_level_start_idx = level_start_idx_[lv + 1];
       const uint32_t num_blk = level_num_blk_[lv];
 
-      int idx(0);
-
-      for (int ybin = 0; ybin < num_blk; ++ybin)
-        for (int xbin = 0; xbin < num_blk; ++xbin)
+      for (uint32_t ybin = 0; ybin < num_blk; ++ybin)
+        for (uint32_t xbin = 0; xbin < num_blk; ++xbin)
         {
-          const int out_idx = level_start_idx + idx;
+          const int out_idx = get_block_start_idx(lv, ybin, xbin);
           float* const out_code = spm_code + feat_dim * out_idx;
 
           for (int y_subbin = 0; y_subbin < 2; ++y_subbin)
             for (int x_subbin = 0; x_subbin < 2; ++x_subbin)
             {
               // figure out which subbin we should use for current pooling
-              const int in_subbin_idx = prev_level_start_idx + 4 * idx
-                  + y_subbin * 2 + x_subbin;
-              //cerr << "in index: " << in_subbin_idx << endl;
+              const int in_subbin_idx = get_block_start_idx(
+                  lv + 1, 2 * ybin + y_subbin, 2 * xbin + x_subbin);
               const float* const in_code = spm_code + in_subbin_idx * feat_dim;
 
+              blk_count[out_idx] += blk_count[in_subbin_idx];
+
               if (y_subbin == 0 && x_subbin == 0)
                 cblas_scopy(feat_dim, in_code, 1, out_code, 1);
+              else if (method == POOL_MAX)
+                vec_max(out_code, in_code, feat_dim);
               else
-              {
-                for (int dd = 0; dd < feat_dim; ++dd)
-                  out_code[dd] = std::max(out_code[dd], in_code[dd]);
-              }
+                vec_add(out_code, in_code, feat_dim);
             }
-
-          ++idx;
         }
     }
 
-  }
-
-  void SPM::MaxPooling(const float* const data, const uint32_t feat_dim,
-                       const uint32_t num_data, const float* const pos,
-                       shared_ptr<float>* const spm_code)
-  {
-    if (spm_code == NULL)
+    if (method == POOL_AVG)
     {
-      cerr << "SPM::MaxPooling. ERROR: Null pointer of output" << endl;
-      exit(-1);
+      for (uint32_t blk = 0; blk < total_num_blk_; ++blk)
+        if (blk_count[blk] > 1)
+          vec_scale(spm_code + blk * feat_dim, 1.0f / blk_count[blk],
+                    feat_dim);
     }
-
-    float* code = new float[total_num_blk_ * feat_dim];
-    MaxPooling(data, feat_dim, num_data, pos, code);
-
-    spm_code->reset(code);
   }
 
 }
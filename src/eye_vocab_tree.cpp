@@ -0,0 +1,352 @@
+/*
+ * eye_vocab_tree.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_vocab_tree.hpp"
+#include "EYE/eye_thread.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+
+namespace EYE
+{
+  namespace
+  {
+    const char VOCAB_TREE_MAGIC[8] =
+      { 'E', 'Y', 'E', 'V', 'T', 'R', 'E', 'E' };
+
+    struct Candidate
+    {
+        float dist;
+        uint32_t node;
+
+        bool operator<(const Candidate& other) const
+        {
+          if (dist != other.dist)
+            return dist < other.dist;
+          return node < other.node;
+        }
+    };
+
+    inline float squared_l2(const float* const a, const float* const b,
+                            const uint32_t dim)
+    {
+      float d(0);
+      for (uint32_t k = 0; k < dim; ++k)
+        d += (a[k] - b[k]) * (a[k] - b[k]);
+      return d;
+    }
+  }
+
+  VocabTree::VocabTree()
+      : dim_(0),
+        depth_(0),
+        num_threads_(DEFAULT_NUM_THREADS)
+  {
+  }
+
+  VocabTree::~VocabTree()
+  {
+    Clear();
+  }
+
+  void VocabTree::Clear()
+  {
+    dim_ = 0;
+    depth_ = 0;
+    centers_.clear();
+    first_child_.clear();
+    num_children_.clear();
+    level_.clear();
+    word_.clear();
+    words_.clear();
+  }
+
+  Status VocabTree::init(const float* const root_center, const uint32_t dim)
+  {
+    if (root_center == NULL || dim == 0)
+    {
+      cerr << "ERROR in VocabTree::init" << endl;
+      return (root_center == NULL ? STATUS_NULL_POINTER :
+                                    STATUS_INVALID_ARGUMENT);
+    }
+
+    Clear();
+    dim_ = dim;
+    centers_.assign(root_center, root_center + dim);
+    first_child_.push_back(0);
+    num_children_.push_back(0);
+    level_.push_back(0);
+    return STATUS_OK;
+  }
+
+  Status VocabTree::add_children(const uint32_t parent,
+                                 const float* const centers,
+                                 const uint32_t num, uint32_t* const first)
+  {
+    if (centers == NULL || first == NULL)
+    {
+      cerr << "ERROR in VocabTree::add_children" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (parent >= get_num_nodes() || num_children_[parent] != 0 || num == 0)
+    {
+      cerr << "ERROR in VocabTree::add_children" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    *first = get_num_nodes();
+    centers_.insert(centers_.end(), centers, centers + num * dim_);
+    first_child_[parent] = *first;
+    num_children_[parent] = num;
+    for (uint32_t i = 0; i < num; ++i)
+    {
+      first_child_.push_back(0);
+      num_children_.push_back(0);
+      level_.push_back(level_[parent] + 1);
+    }
+
+    return STATUS_OK;
+  }
+
+  void VocabTree::finish()
+  {
+    const uint32_t num_nodes = get_num_nodes();
+    word_.assign(num_nodes, UINT_MAX);
+    words_.clear();
+    depth_ = 0;
+
+    uint32_t num_words(0);
+    for (uint32_t n = 0; n < num_nodes; ++n)
+    {
+      depth_ = std::max(depth_, level_[n]);
+      if (num_children_[n] != 0)
+        continue;
+
+      word_[n] = num_words++;
+      words_.insert(words_.end(), centers_.begin() + n * dim_,
+                    centers_.begin() + (n + 1) * dim_);
+    }
+  }
+
+  Status VocabTree::Search(const float* const query, const uint32_t num_query,
+                           const uint32_t num_knn, const uint32_t beam_width,
+                           vl_uint32* const index, float* const dist,
+                           Workspace* const workspace) const
+  {
+    return Search(query, num_query, num_knn, beam_width, index, dist,
+                  workspace, num_threads_);
+  }
+
+  Status VocabTree::Search(const float* const query, const uint32_t num_query,
+                           const uint32_t num_knn, const uint32_t beam_width,
+                           vl_uint32* const index, float* const dist,
+                           Workspace* const workspace,
+                           const uint32_t threads) const
+  {
+    if (words_.empty())
+    {
+      cerr << "ERROR: the vocabulary tree is empty." << endl;
+      return STATUS_NOT_SETUP;
+    }
+    if (query == NULL || index == NULL)
+    {
+      cerr << "ERROR in VocabTree::Search" << endl;
+      return STATUS_NULL_POINTER;
+    }
+    if (num_knn == 0 || num_knn > get_num_words() || beam_width == 0)
+    {
+      cerr << "ERROR in VocabTree::Search" << endl;
+      return STATUS_INVALID_ARGUMENT;
+    }
+
+    const int num_threads = get_real_num_threads(threads);
+    const uint32_t num_nodes = get_num_nodes();
+
+    // a level never holds more than the nodes, nor the leaves met more than
+    // the words
+    Workspace local;
+    Workspace& ws = (workspace == NULL ? local : *workspace);
+    WorkspaceScope scope(ws);
+    const size_t len_scratch = 2 * (size_t) num_nodes + get_num_words();
+    Candidate* const scratch = ws.alloc<Candidate>(num_threads * len_scratch);
+
+#pragma omp parallel if (num_threads > 1) num_threads(num_threads)
+    {
+      Candidate* beam = scratch + get_thread_id() * len_scratch;
+      Candidate* next = beam + num_nodes;
+      Candidate* const leaves = next + num_nodes;
+
+#pragma omp for schedule(dynamic, 64)
+      for (int q = 0; q < (int) num_query; ++q)
+      {
+        const float* const x = query + (size_t) q * dim_;
+
+        // a narrow beam of an unbalanced tree may meet fewer than num_knn
+        // leaves, widen it until it does
+        uint32_t width = beam_width;
+        uint32_t num_leaves(0);
+        for (;;)
+        {
+          num_leaves = 0;
+          beam[0].dist = squared_l2(x, &centers_[0], dim_);
+          beam[0].node = 0;
+          uint32_t num_beam(1);
+
+          while (num_beam > 0)
+          {
+            // the leaves among the children are all candidates, only the
+            // inner nodes compete for the beam
+            uint32_t num_next(0);
+            for (uint32_t b = 0; b < num_beam; ++b)
+            {
+              const uint32_t node = beam[b].node;
+              if (num_children_[node] == 0)
+              {
+                leaves[num_leaves++] = beam[b];
+                continue;
+              }
+
+              const uint32_t first = first_child_[node];
+              for (uint32_t c = first; c < first + num_children_[node]; ++c)
+              {
+                Candidate cand;
+                cand.dist = squared_l2(x, &centers_[(size_t) c * dim_],
+                                       dim_);
+                cand.node = c;
+                if (num_children_[c] == 0)
+                  leaves[num_leaves++] = cand;
+                else
+                  next[num_next++] = cand;
+              }
+            }
+
+            if (num_next > width)
+            {
+              std::nth_element(next, next + width, next + num_next);
+              num_next = width;
+            }
+            std::swap(beam, next);
+            num_beam = num_next;
+          }
+
+          if (num_leaves >= num_knn || width >= num_nodes)
+            break;
+          width *= 2;
+        }
+
+        // the leaf distances are exact, keep the num_knn closest words
+        std::partial_sort(leaves, leaves + num_knn, leaves + num_leaves);
+        for (uint32_t k = 0; k < num_knn; ++k)
+        {
+          index[(size_t) q * num_knn + k] = word_[leaves[k].node];
+          if (dist != NULL)
+            dist[(size_t) q * num_knn + k] = leaves[k].dist;
+        }
+      }
+    }
+    return STATUS_OK;
+  }
+
+  Status VocabTree::save(FILE* output, const VocabTree& tree)
+  {
+    if (output == NULL)
+    {
+      fprintf(stderr, "Check the output and the tree\n");
+      return STATUS_NULL_POINTER;
+    }
+    if (tree.words_.empty())
+    {
+      fprintf(stderr, "Check the output and the tree\n");
+      return STATUS_NOT_SETUP;
+    }
+
+    const uint32_t dim = tree.dim_;
+    const uint32_t num_nodes = tree.get_num_nodes();
+
+    fwrite(VOCAB_TREE_MAGIC, sizeof(char), sizeof(VOCAB_TREE_MAGIC), output);
+    fwrite(&dim, sizeof(uint32_t), 1, output);
+    fwrite(&num_nodes, sizeof(uint32_t), 1, output);
+    fwrite(&tree.centers_[0], sizeof(float), (size_t) num_nodes * dim,
+           output);
+    fwrite(&tree.first_child_[0], sizeof(uint32_t), num_nodes, output);
+    fwrite(&tree.num_children_[0], sizeof(uint32_t), num_nodes, output);
+    fwrite(&tree.level_[0], sizeof(uint32_t), num_nodes, output);
+
+    if (ferror(output))
+    {
+      fprintf(stderr, "Failed to write the vocabulary tree\n");
+      return STATUS_IO_ERROR;
+    }
+    return STATUS_OK;
+  }
+
+  Status VocabTree::load(FILE* input, VocabTree* tree)
+  {
+    if (input == NULL || tree == NULL)
+    {
+      fprintf(stderr, "NULL pointer for input and tree\n");
+      return STATUS_NULL_POINTER;
+    }
+
+    tree->Clear();
+
+    char magic[sizeof(VOCAB_TREE_MAGIC)];
+    uint32_t dim(0);
+    uint32_t num_nodes(0);
+    if (fread(magic, sizeof(char), sizeof(magic), input) != sizeof(magic)
+        || memcmp(magic, VOCAB_TREE_MAGIC, sizeof(magic)) != 0
+        || fread(&dim, sizeof(uint32_t), 1, input) != 1
+        || fread(&num_nodes, sizeof(uint32_t), 1, input) != 1 || dim == 0
+        || num_nodes == 0)
+    {
+      fprintf(stderr, "Not a vocabulary tree file\n");
+      return STATUS_BAD_FILE;
+    }
+
+    tree->dim_ = dim;
+    tree->centers_.resize((size_t) num_nodes * dim);
+    tree->first_child_.resize(num_nodes);
+    tree->num_children_.resize(num_nodes);
+    tree->level_.resize(num_nodes);
+
+    if (fread(&tree->centers_[0], sizeof(float), (size_t) num_nodes * dim,
+              input) != (size_t) num_nodes * dim
+        || fread(&tree->first_child_[0], sizeof(uint32_t), num_nodes, input)
+            != num_nodes
+        || fread(&tree->num_children_[0], sizeof(uint32_t), num_nodes, input)
+            != num_nodes
+        || fread(&tree->level_[0], sizeof(uint32_t), num_nodes, input)
+            != num_nodes)
+    {
+      tree->Clear();
+      fprintf(stderr, "Truncated vocabulary tree file\n");
+      return STATUS_BAD_FILE;
+    }
+
+    // the children must be stored after their parent
+    for (uint32_t n = 0; n < num_nodes; ++n)
+      if (tree->num_children_[n] != 0
+          && (tree->first_child_[n] <= n
+              || tree->first_child_[n] > num_nodes
+              || tree->num_children_[n] > num_nodes - tree->first_child_[n]))
+      {
+        tree->Clear();
+        fprintf(stderr, "Corrupted vocabulary tree file\n");
+        return STATUS_BAD_FILE;
+      }
+
+    tree->finish();
+    return STATUS_OK;
+  }
+
+}
@@ -0,0 +1,163 @@
+/*
+ * eye_workspace.cpp
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: jieshen
+ */
+
+#include "EYE/eye_workspace.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+using std::cerr;
+using std::endl;
+
+namespace EYE
+{
+  namespace
+  {
+    inline size_t align_size(const size_t size)
+    {
+      return (size + Workspace::ALIGN - 1) / Workspace::ALIGN
+          * Workspace::ALIGN;
+    }
+  }
+
+  Workspace::Workspace()
+      : block_(0),
+        offset_(0),
+        used_before_(0),
+        capacity_(0),
+        peak_(0),
+        num_heap_alloc_(0)
+  {
+  }
+
+  Workspace::Workspace(const Workspace&)
+      : block_(0),
+        offset_(0),
+        used_before_(0),
+        capacity_(0),
+        peak_(0),
+        num_heap_alloc_(0)
+  {
+  }
+
+  Workspace& Workspace::operator=(const Workspace&)
+  {
+    return *this;
+  }
+
+  Workspace::~Workspace()
+  {
+    free_blocks();
+  }
+
+  void Workspace::free_blocks()
+  {
+    for (size_t i = 0; i < blocks_.size(); ++i)
+      free(blocks_[i].mem);
+    blocks_.clear();
+    block_ = 0;
+    offset_ = 0;
+    used_before_ = 0;
+    capacity_ = 0;
+  }
+
+  void Workspace::Clear()
+  {
+    free_blocks();
+    peak_ = 0;
+  }
+
+  void* Workspace::alloc_bytes(const size_t size)
+  {
+    // empty arrays get a valid address all the same
+    const size_t len = align_size(std::max<size_t>(size, 1));
+
+    if (blocks_.empty() || offset_ + len > blocks_[block_].size)
+      grow(len);
+
+    void* const p = blocks_[block_].data + offset_;
+    offset_ += len;
+    peak_ = std::max(peak_, used_before_ + offset_);
+    return p;
+  }
+
+  void Workspace::grow(const size_t size)
+  {
+    size_t next(0);
+    if (!blocks_.empty())
+    {
+      blocks_[block_].used = offset_;
+      used_before_ += offset_;
+      next = block_ + 1;
+    }
+
+    // a free block large enough is moved right after the current one
+    for (size_t i = next; i < blocks_.size(); ++i)
+      if (blocks_[i].size >= size)
+      {
+        std::swap(blocks_[next], blocks_[i]);
+        break;
+      }
+
+    if (next == blocks_.size() || blocks_[next].size < size)
+    {
+      // at least double, the block merged by the next rewind then covers
+      // the peak
+      Block block;
+      block.size = std::max(size,
+                            std::max<size_t>(capacity_, MIN_BLOCK_SIZE));
+      block.mem = (char*) malloc(block.size + ALIGN);
+      if (block.mem == NULL)
+        throw std::bad_alloc();
+      block.data = block.mem + (ALIGN - (size_t) block.mem % ALIGN) % ALIGN;
+      block.used = 0;
+      blocks_.insert(blocks_.begin() + next, block);
+      capacity_ += block.size;
+      ++num_heap_alloc_;
+    }
+
+    block_ = next;
+    offset_ = 0;
+  }
+
+  void Workspace::rewind(const Marker& marker)
+  {
+    if (marker.block > block_
+        || (marker.block == block_ && marker.offset > offset_))
+    {
+      cerr << "ERROR: rewind the workspace after its position" << endl;
+      return;
+    }
+
+    block_ = marker.block;
+    offset_ = marker.offset;
+    used_before_ = 0;
+    for (size_t i = 0; i < block_; ++i)
+      used_before_ += blocks_[i].used;
+
+    // nothing is in use any more, merge the blocks
+    if (block_ == 0 && offset_ == 0 && blocks_.size() > 1)
+      reserve(capacity_);
+  }
+
+  void Workspace::reserve(const size_t size)
+  {
+    if (block_ != 0 || offset_ != 0)
+    {
+      cerr << "ERROR: reserve a workspace in use" << endl;
+      return;
+    }
+    if (blocks_.size() == 1 && blocks_[0].size >= size)
+      return;
+
+    const size_t len = align_size(size);
+    free_blocks();
+    grow(len);
+  }
+}
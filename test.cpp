@@ -9,6 +9,9 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <ctime>
+#include <cmath>
+#include <mkl.h>
 #include <opencv2/opencv.hpp>
 using namespace std;
 using boost::shared_ptr;
@@ -66,8 +69,8 @@ namespace EYE
       cerr << "ERROR: must pass an image" << endl;
       exit(-1);
     }
+    // the 8 bit pixels are handed over as decoded
     cv::Mat img = cv::imread(argv[1], CV_LOAD_IMAGE_GRAYSCALE);
-    img.convertTo(img, CV_32FC1);
 
     /*
      float* data_ = (float*) malloc(sizeof(float) * img.rows * img.cols);
@@ -90,12 +93,12 @@ namespace EYE
     ofstream output("data/eye_imgdata.txt");
     for (int i = 0; i < width * height; ++i)
     {
-      output << img.data[i] << " ";
+      output << (int) img.at<uchar>(i / width, i % width) << " ";
       if ((i + 1) % width == 0)
         output << endl;
     }
 
-    dsift_model.Extract((float*) img.data, width, height, &frames, &descrs,
+    dsift_model.Extract(img.data, width, height, img.step, &frames, &descrs,
                         &dim);
     cerr << "frame size: " << frames.size() << endl;
     cerr << "descr size: " << descrs.size() / dim << endl;
@@ -237,4 +240,156 @@ namespace EYE
 
     free(spm_code);
   }
+
+  // recall of the PQ search against the exact search for several numbers
+  // of re-ranked candidates, i.e. the max_comp of the LLC
+  void test_pq(int argc, char* argv[])
+  {
+    const uint32_t num_base = 4000;
+    const uint32_t num_query = 2000;
+    const uint32_t dim = 128;
+    const uint32_t num_knn = 5;
+
+    VlRand rand;
+    vl_rand_init(&rand);
+    vl_rand_seed(&rand, 1000);
+
+    vector<float> base(num_base * dim);
+    vector<float> query(num_query * dim);
+    for (uint32_t i = 0; i < base.size(); ++i)
+      base[i] = (float) vl_rand_real3(&rand) * 255;
+    for (uint32_t i = 0; i < query.size(); ++i)
+      query[i] = (float) vl_rand_real3(&rand) * 255;
+
+    ExactKNN exact;
+    exact.SetUp(&base[0], dim, num_base);
+    vector<vl_uint32> truth(num_query * num_knn);
+    exact.Search(&query[0], num_query, num_knn, &truth[0], NULL);
+
+    PQIndex pq;
+    cerr << "training " << pq.get_num_subspaces() << " subspaces" << endl;
+    pq.SetUp(&base[0], dim, num_base);
+
+    vector<vl_uint32> index(num_query * num_knn);
+    cout << "max_comp recall@" << num_knn << " ms/query" << endl;
+    for (uint32_t max_comp = num_knn; max_comp <= 1024; max_comp *= 2)
+    {
+      const clock_t start = clock();
+      pq.Search(&query[0], num_query, num_knn, max_comp, &index[0], NULL);
+      const double ms = 1000.0 * (clock() - start) / CLOCKS_PER_SEC
+          / num_query;
+
+      uint32_t hit(0);
+      for (uint32_t q = 0; q < num_query; ++q)
+        for (uint32_t i = 0; i < num_knn; ++i)
+          for (uint32_t j = 0; j < num_knn; ++j)
+            hit += (index[q * num_knn + i] == truth[q * num_knn + j]);
+
+      cout << max_comp << " " << (double) hit / (num_query * num_knn) << " "
+           << ms << endl;
+    }
+  }
+
+  // the weights of Encode_sparse() against the former encoder, which built
+  // the covariance of each frame with k^2 dot products and solved it with
+  // sposv. The systems are ill-conditioned, the two single precision
+  // solutions differ by the tolerance documented in LLC::set_batch_size()
+  void test_llc_solve(int argc, char* argv[])
+  {
+    const uint32_t num_base = 1024;
+    const uint32_t num_frame = 4000;
+    const uint32_t dim = 128;
+    const float tolerance = 2e-3;
+
+    VlRand rand;
+    vl_rand_init(&rand);
+    vl_rand_seed(&rand, 1000);
+
+    // sparse quantized frames, the bases drawn among them
+    vector<float> frames(num_frame * dim);
+    for (uint32_t i = 0; i < frames.size(); ++i)
+    {
+      const double r = vl_rand_real3(&rand);
+      frames[i] = (r < 0.3 ? 0 : (float) (int) (r * 160));
+    }
+    float* base_data = new float[num_base * dim];
+    for (uint32_t i = 0; i < num_base; ++i)
+    {
+      const uint32_t k = vl_rand_uindex(&rand, num_frame);
+      for (uint32_t d = 0; d < dim; ++d)
+        base_data[i * dim + d] = frames[k * dim + d]
+            + (float) vl_rand_real3(&rand);
+    }
+    shared_ptr<float> base(base_data);
+
+    const uint32_t knns[] = { 2, 5, 8, 10 };
+    cout << "num_knn max_abs_err max_rel_err" << endl;
+    for (uint32_t q = 0; q < sizeof(knns) / sizeof(knns[0]); ++q)
+    {
+      const uint32_t K = knns[q];
+      LLC llc(base, dim, num_base);
+      llc.set_search_method(LLC::SEARCH_EXACT);
+      llc.set_num_knn(K);
+      llc.SetUp();
+      SparseCode code;
+      llc.Encode_sparse(&frames[0], dim, num_frame, &code);
+
+      vector<float> z(K * dim);
+      vector<float> C(K * K);
+      vector<float> w(K);
+      double max_abs(0);
+      double max_rel(0);
+      for (uint32_t i = 0; i < num_frame; ++i)
+      {
+        for (uint32_t n = 0; n < K; ++n)
+        {
+          memcpy(&z[n * dim], base_data + code.index[i * K + n] * dim,
+                 sizeof(float) * dim);
+          cblas_saxpy(dim, -1.0f, &frames[i * dim], 1, &z[n * dim], 1);
+        }
+        for (uint32_t m = 0; m < K; ++m)
+          for (uint32_t n = m; n < K; ++n)
+          {
+            const float sum = cblas_sdot(dim, &z[m * dim], 1, &z[n * dim], 1);
+            C[m * K + n] = sum;
+            C[n * K + m] = sum;
+          }
+
+        double sum(0);
+        for (uint32_t m = 0; m < K; ++m)
+          sum += C[m * K + m];
+        sum = sum * llc.get_beta();
+        for (uint32_t m = 0; m < K; ++m)
+        {
+          C[m * K + m] += sum;
+          w[m] = 1;
+        }
+
+        char upper_triangle = 'U';
+        int INFO;
+        int int_one = 1;
+        const int num_knn = (int) K;
+        sposv(&upper_triangle, &num_knn, &int_one, &C[0], &num_knn, &w[0],
+              &num_knn, &INFO);
+
+        sum = 0;
+        for (uint32_t m = 0; m < K; ++m)
+          sum += w[m];
+        cblas_sscal(K, 1.0 / sum, &w[0], 1);
+
+        double largest(0);
+        for (uint32_t m = 0; m < K; ++m)
+          largest = std::max(largest, (double) std::fabs(w[m]));
+        for (uint32_t m = 0; m < K; ++m)
+        {
+          const double err = std::fabs(w[m] - code.weight[i * K + m]);
+          max_abs = std::max(max_abs, err);
+          max_rel = std::max(max_rel, err / largest);
+        }
+      }
+
+      cout << K << " " << max_abs << " " << max_rel
+           << (max_rel <= tolerance ? "" : " FAILED") << endl;
+    }
+  }
 }
@@ -14,6 +14,8 @@ namespace EYE
   void test_dsift(int argc, char* argv[]);
   void test_llc(int argc, char* argv[]);
   void test_spm(int argc, char* argv[]);
+  void test_pq(int argc, char* argv[]);
+  void test_llc_solve(int argc, char* argv[]);
 }
 
 #endif /* __EYE_TEST_HPP__ */